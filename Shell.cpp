@@ -19,22 +19,44 @@
 #include <algorithm>
 #include <functional>
 #include <unordered_map>
+#include <unordered_set>
+#include <list>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <queue>
+#include <cctype>
 
 #include <windows.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#include <immintrin.h>
 #include <io.h>
 #include <fcntl.h>
 #include <winternl.h>
 #include <initguid.h>
 #include <diskguid.h>
 
+#include "format_plugin.hpp"
+
 static std::string input;
 
+// False when running a script, in which case nothing may touch the console cursor, window or screen buffer.
+static bool Interactive = false;
+
 struct FileRecord {
 public:
   std::string name;
   std::string attribute;
   bool directory;
   uint64_t size;
+  uint32_t attributes = 0; // FILE_ATTRIBUTE_*
   
   FileRecord(const char *name, uint64_t size, bool directory) : name(name), size(size), directory(directory) {}
   ~FileRecord() {}
@@ -45,12 +67,204 @@ struct ConsoleCharacter {
   WORD a;
 };
 
+// Set by --startup-time: reports how long after the process was created the first prompt and the first output appeared.
+static bool StartupTiming = false;
+static std::atomic<bool> FirstPromptReported{false};
+static std::atomic<bool> FirstOutputReported{false};
+
+static void ReportStartupTime(std::atomic<bool> &reported, const char *event)
+{
+  if (!StartupTiming || reported.exchange(true))
+    return;
+  
+  FILETIME creation, exit, kernel, user, now;
+  GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+  GetSystemTimePreciseAsFileTime(&now);
+  
+  // FILETIME counts 100 ns intervals
+  auto start = ((uint64_t) creation.dwHighDateTime << 32) | creation.dwLowDateTime;
+  auto end = ((uint64_t) now.dwHighDateTime << 32) | now.dwLowDateTime;
+  
+  fprintf(stderr, "[startup] %s after %.3f ms\n", event, (end - start) / 10000.0);
+}
+
+static double GetMilliseconds()
+{
+  static const LONGLONG frequency = [] () -> LONGLONG {
+    LARGE_INTEGER f;
+    QueryPerformanceFrequency(&f);
+    return f.QuadPart;
+  }();
+  
+  LARGE_INTEGER counter;
+  QueryPerformanceCounter(&counter);
+  
+  return counter.QuadPart * 1000.0 / frequency;
+}
+
+// Opt-in trace of hot paths (`trace on|off|dump <file>`). Each thread records scoped timings into its own ring buffer:
+// only the owning thread writes to it, so recording is a couple of stores and never takes a lock. The buffers are
+// exported as Chrome trace JSON (chrome://tracing, Perfetto).
+//
+// Export and clear run while the owners keep recording. Every slot carries the sequence number (index + 1) of the
+// event in it, written after the fields, and is invalidated before they're overwritten; a reader that doesn't see the
+// same sequence before and after copying the fields skips the slot instead of printing a torn event. Clearing only
+// moves the buffer's `first` index, which owners never write.
+struct TraceEvent {
+  std::atomic<uint64_t> sequence{0};
+  std::atomic<const char *> name{nullptr};
+  std::atomic<double> start{0};
+  std::atomic<double> duration{0};
+};
+
+struct TraceBuffer {
+  static const size_t Capacity = 16384;
+  
+  DWORD thread;
+  std::atomic<uint64_t> head{0};
+  std::atomic<uint64_t> first{0}; // Events before it were cleared
+  TraceEvent events[Capacity];
+};
+
+static std::atomic<bool> TraceEnabled{false};
+static std::mutex TraceBuffersLock;
+static std::vector<TraceBuffer *> TraceBuffers;
+thread_local TraceBuffer *ThreadTraceBuffer = nullptr;
+
+static void TraceRecord(const char *name, double start, double duration)
+{
+  auto buffer = ThreadTraceBuffer;
+  
+  // The lock is only taken the first time a thread records something. Buffers are never freed, the worker threads
+  // live as long as the process anyway.
+  if (!buffer) {
+    buffer = ThreadTraceBuffer = new TraceBuffer();
+    buffer->thread = GetCurrentThreadId();
+    
+    std::lock_guard<std::mutex> guard(TraceBuffersLock);
+    TraceBuffers.push_back(buffer);
+  }
+  
+  auto head = buffer->head.load(std::memory_order_relaxed);
+  auto &event = buffer->events[head % TraceBuffer::Capacity];
+  
+  event.sequence.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  event.name.store(name, std::memory_order_relaxed);
+  event.start.store(start, std::memory_order_relaxed);
+  event.duration.store(duration, std::memory_order_relaxed);
+  event.sequence.store(head + 1, std::memory_order_release);
+  
+  buffer->head.store(head + 1, std::memory_order_release);
+}
+
+// Records the lifetime of the enclosing scope when tracing is on. Costs a single relaxed load when it's off.
+class TraceScope {
+  const char *name;
+  double start;
+public:
+  TraceScope(const char *name) : name(TraceEnabled.load(std::memory_order_relaxed) ? name : nullptr)
+  {
+    if (this->name)
+      start = GetMilliseconds();
+  }
+  
+  ~TraceScope()
+  {
+    if (name)
+      TraceRecord(name, start, GetMilliseconds() - start);
+  }
+};
+
+#define TRACE_SCOPE(name) TraceScope trace_scope(name)
+
+// Writes the events still held by the ring buffers, oldest first per thread. Returns the number of events written.
+static size_t TraceExport(FILE *f)
+{
+  std::lock_guard<std::mutex> guard(TraceBuffersLock);
+  size_t n = 0;
+  
+  fprintf(f, "{\"traceEvents\":[");
+  
+  for (const auto buffer : TraceBuffers) {
+    auto head = buffer->head.load(std::memory_order_acquire);
+    auto first = std::max<uint64_t>(buffer->first.load(std::memory_order_relaxed), head > TraceBuffer::Capacity ? head - TraceBuffer::Capacity : 0);
+    
+    for (auto i = first; i < head; ++i) {
+      const auto &event = buffer->events[i % TraceBuffer::Capacity];
+      
+      // Overwritten since `head` was read, or being overwritten right now
+      auto sequence = event.sequence.load(std::memory_order_acquire);
+      auto name = event.name.load(std::memory_order_relaxed);
+      auto start = event.start.load(std::memory_order_relaxed);
+      auto duration = event.duration.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (sequence != i + 1 || event.sequence.load(std::memory_order_relaxed) != sequence)
+        continue;
+      
+      fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%lu,\"tid\":%lu}",
+        n > 0 ? "," : "", name, start * 1000.0, duration * 1000.0, GetCurrentProcessId(), buffer->thread);
+      ++n;
+    }
+  }
+  
+  fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+  
+  return n;
+}
+
+static void TraceClear()
+{
+  std::lock_guard<std::mutex> guard(TraceBuffersLock);
+  
+  for (const auto buffer : TraceBuffers)
+    buffer->first.store(buffer->head.load(std::memory_order_acquire), std::memory_order_relaxed);
+}
+
+// Output collected from a thread that isn't allowed to write to the console directly (i. e. a background job).
+struct ConsoleBuffer {
+  std::mutex lock;
+  std::string text;
+  
+  void Append(const char *data, size_t length)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    text.append(data, length);
+  }
+  
+  // Returns everything appended after the given position, and moves the position to the end.
+  std::string Take(size_t *position)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    auto s = text.substr(*position);
+    *position = text.length();
+    return s;
+  }
+};
+
+// When set, ConsolePrint() output of the current thread goes into this buffer instead of the console.
+thread_local ConsoleBuffer *ConsoleCapture = nullptr;
+
 void ConsolePrint(const char *formatter, ...)
 {
   va_list args;
   va_start(args, formatter);
   
-  vfprintf(stdout, formatter, args);
+  if (ConsoleCapture) {
+    va_list copy;
+    va_copy(copy, args);
+    int length = vsnprintf(nullptr, 0, formatter, copy);
+    va_end(copy);
+    
+    if (length > 0) {
+      std::string s(length + 1, '\0');
+      vsnprintf(&s[0], s.length(), formatter, args);
+      ConsoleCapture->Append(s.data(), length);
+    }
+  } else {
+    ReportStartupTime(FirstOutputReported, "first output");
+    vfprintf(stdout, formatter, args);
+  }
   
   va_end(args);
 }
@@ -63,33 +277,105 @@ void ConsolePrintFast(const char *string)
 using VectorString = std::vector<std::string>;
 using VectorFileRecord = std::vector<FileRecord>;
 
-std::unordered_map<uint16_t, const char *> ImageFileHeader_Characteristics {
-  { IMAGE_FILE_RELOCS_STRIPPED, "IMAGE_FILE_RELOCS_STRIPPED" },
-  { IMAGE_FILE_EXECUTABLE_IMAGE, "IMAGE_FILE_EXECUTABLE_IMAGE" },
-  { IMAGE_FILE_LINE_NUMS_STRIPPED, "IMAGE_FILE_LINE_NUMS_STRIPPED" },
-  { IMAGE_FILE_LOCAL_SYMS_STRIPPED, "IMAGE_FILE_LOCAL_SYMS_STRIPPED" },
-  // { IMAGE_FILE_AGGRESIVE_WS_TRIM, "IMAGE_FILE_AGGRESIVE_WS_TRIM" }, // Obsolete
-  { IMAGE_FILE_LARGE_ADDRESS_AWARE, "IMAGE_FILE_LARGE_ADDRESS_AWARE" },
-  // { IMAGE_FILE_BYTES_REVERSED_LO, "IMAGE_FILE_BYTES_REVERSED_LO" }, // Obsolete
-  { IMAGE_FILE_32BIT_MACHINE, "IMAGE_FILE_32BIT_MACHINE" },
-  { IMAGE_FILE_DEBUG_STRIPPED, "IMAGE_FILE_DEBUG_STRIPPED" },
-  { IMAGE_FILE_REMOVABLE_RUN_FROM_SWAP, "IMAGE_FILE_REMOVABLE_RUN_FROM_SWAP" },
-  { IMAGE_FILE_NET_RUN_FROM_SWAP, "IMAGE_FILE_NET_RUN_FROM_SWAP" },
-  { IMAGE_FILE_SYSTEM, "IMAGE_FILE_SYSTEM" },
-  { IMAGE_FILE_DLL, "IMAGE_FILE_DL" },
-  { IMAGE_FILE_UP_SYSTEM_ONLY, "IMAGE_FILE_UP_SYSTEM_ONLY" },
-  // { IMAGE_FILE_BYTES_REVERSED_HI, "IMAGE_FILE_BYTES_REVERSED_HI" }, // Obsolete
-};
-
-std::unordered_map<uint16_t, const char *> ImageFileHeader_Machine {
-  { IMAGE_FILE_MACHINE_AMD64, "IMAGE_FILE_MACHINE_AMD64" }, // 0x8664
-  { IMAGE_FILE_MACHINE_I386, "IMAGE_FILE_MACHINE_I386" }, // 0x014c
-  { IMAGE_FILE_MACHINE_IA64, "IMAGE_FILE_MACHINE_IA64" }, // 0x0200
+// Fixed set of worker threads executing queued tasks in FIFO order. The workers are detached and live as long as the
+// process, so the pool never has to be torn down while a long-running job is still going.
+class ThreadPool {
+  std::queue<std::function<void(void)>> tasks;
+  std::mutex lock;
+  std::condition_variable condition;
+  unsigned count;
+  
+  void Work()
+  {
+    for (;;) {
+      std::function<void(void)> task;
+      
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        condition.wait(guard, [this] () -> bool { return !tasks.empty(); });
+        task = std::move(tasks.front());
+        tasks.pop();
+      }
+      
+      task();
+    }
+  }
+  
+public:
+  ThreadPool(unsigned count) : count(count > 0 ? count : 4)
+  {
+    for (unsigned i = 0; i < this->count; ++i)
+      std::thread([this] () -> void { Work(); }).detach();
+  }
+  ~ThreadPool() {}
+  
+  unsigned GetThreadCount() const
+  {
+    return count;
+  }
+  
+  void Submit(std::function<void(void)> task)
+  {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      tasks.push(std::move(task));
+    }
+    
+    condition.notify_one();
+  }
+  
+  // Runs f(0) .. f(n - 1) on the pool and waits for all of them. The calling thread takes items as well, so this is
+  // safe to call from inside a pool task (a background job) without starving the pool. Console output of the helpers
+  // goes wherever the caller's output goes.
+  void ParallelFor(size_t n, std::function<void(size_t)> f)
+  {
+    struct State {
+      std::atomic<size_t> next{0};
+      size_t finished = 0;
+      std::mutex lock;
+      std::condition_variable condition;
+    };
+    
+    auto state = std::make_shared<State>();
+    auto capture = ConsoleCapture;
+    
+    const auto Run = [state, f, n] () -> void {
+      size_t i, done = 0;
+      
+      while ((i = state->next++) < n) {
+        f(i);
+        ++done;
+      }
+      
+      if (done > 0) {
+        std::lock_guard<std::mutex> guard(state->lock);
+        state->finished += done;
+        state->condition.notify_all();
+      }
+    };
+    
+    size_t helpers = std::min<size_t>(n > 0 ? n - 1 : 0, count);
+    for (size_t i = 0; i < helpers; ++i) {
+      Submit([Run, capture] () -> void {
+        ConsoleCapture = capture;
+        Run();
+        ConsoleCapture = nullptr;
+      });
+    }
+    
+    Run();
+    
+    std::unique_lock<std::mutex> guard(state->lock);
+    state->condition.wait(guard, [&state, n] () -> bool { return state->finished == n; });
+  }
 };
 
-std::unordered_map<uint16_t, const char *> ImageOptionalHeader_DllCharacteristics {
-  // Reserved.
-};
+// The pool shared by background jobs and the parallel probes, created on first use.
+static ThreadPool &Workers()
+{
+  static ThreadPool *pool = new ThreadPool(std::thread::hardware_concurrency());
+  return *pool;
+}
 
 std::function<void(void)> UpArrowCallFunction = [] (void) -> void {};
 std::function<void(void)> DownArrowCallFunction = [] (void) -> void {};
@@ -145,6 +431,8 @@ static std::string GetWorkingDirectory()
 
 static std::string GetUserPrompt()
 {
+  TRACE_SCOPE("GetUserPrompt");
+  
   DWORD length = 256;
   char user[256];
   
@@ -165,480 +453,365 @@ static std::string GetUserPrompt()
 
 static void PrintPrompt()
 {
+  ReportStartupTime(FirstPromptReported, "first prompt");
+  
   SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE),  6);
   ConsolePrint("%s", GetUserPrompt().c_str());
   SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE),  7);
 }
 
-class Format {
-protected:
-  uint64_t size = -1;
-  bool ready = false;
-public:
+// The format parsers, in a header of their own so the fuzz targets in fuzz/ build them too
+#include "formats.hpp"
 
-  Format() {}
-  ~Format() {}
+Format_BMP ReadBMP(const char *name)
+{
+  Format_BMP format;
+  format.ParseFile(name);
   
-  uint64_t GetSize() const
-  {
-    return size;
-  }
+  return format;
+}
+
+Format_PDF ReadPDF(const char *name)
+{
+  Format_PDF format;
+  format.ParseFile(name);
   
-  bool IsReady() const
-  {
-    return ready;
+  return format;
+}
+
+Format_PE ReadPE(const char *name)
+{
+  Format_PE format;
+  format.ParseFile(name);
+  
+  return format;
+}
+
+Format_ZIP ReadZIP(const char *name)
+{
+  Format_ZIP format;
+  format.ParseFile(name);
+  
+  return format;
+}
+
+static VectorFileRecord TraverseDirectory(const char *path) {
+  TRACE_SCOPE("TraverseDirectory");
+  
+  VectorFileRecord v;
+  
+  WIN32_FIND_DATA data;
+  HANDLE h = FindFirstFileEx(path, FindExInfoStandard, &data, FindExSearchNameMatch, nullptr, 0);
+  
+  if (h != INVALID_HANDLE_VALUE) {
+    do {
+      FileRecord f(
+        data.cFileName,
+        ((uint64_t) data.nFileSizeHigh << 32) | data.nFileSizeLow,
+        data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY
+      );
+      
+      f.attributes = data.dwFileAttributes;
+      
+      f.attribute += data.dwFileAttributes & FILE_ATTRIBUTE_HIDDEN ? 'h' : '-';
+      f.attribute += data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY ? 'd' : '-';
+      f.attribute += data.dwFileAttributes & FILE_ATTRIBUTE_SYSTEM ? 's' : '-';
+      f.attribute += data.dwFileAttributes & FILE_ATTRIBUTE_READONLY ? 'r' : '-';
+      f.attribute += data.dwFileAttributes & FILE_ATTRIBUTE_ARCHIVE ? 'a' : '-';
+      f.attribute += data.dwFileAttributes & FILE_ATTRIBUTE_COMPRESSED ? 'c' : '-';
+      f.attribute += data.dwFileAttributes & FILE_ATTRIBUTE_ENCRYPTED ? 'e' : '-';
+      
+      v.push_back(f);
+    } while(FindNextFile(h, &data) != 0);
+    
+    FindClose(h);
   }
   
-  virtual void Parse(const char *) = 0;
-};
+  return v;
+}
 
-class Format_Document : public Format {
-public:
-  Format_Document() {}
-  ~Format_Document() {}
-  virtual void Parse(const char *) = 0;
-};
+VectorString split(const std::string& s, char seperator, std::function<void(std::string &s)> f = [] (std::string &s) -> void {})
+{
+   VectorString output;
 
-class Format_Binary_Image : public Format {
-protected:
-  uint16_t architecture;
-public:
-  Format_Binary_Image() {}
-  ~Format_Binary_Image() {}
-  virtual void Parse(const char *) = 0;
-  virtual bool Is64Bit() const = 0;
-};
+    std::string::size_type prev_pos = 0, pos = 0;
 
-class Format_Archiver : public Format {
-public:
-  Format_Archiver() {}
-  ~Format_Archiver() {}
-  virtual void Parse(const char *) = 0;
-};
+    while((pos = s.find(seperator, pos)) != std::string::npos)
+    {
+        std::string substring( s.substr(prev_pos, pos-prev_pos) );
+        
+        f(substring);
 
-class Format_Image : public Format {
-protected:
-  uint64_t width, height;
-  uint16_t planes;
+        output.push_back(substring);
+
+        prev_pos = ++pos;
+    }
+    
+    std::string last = s.substr(prev_pos, pos-prev_pos);
+    f(last);
+    output.push_back(last); // Last word
+
+    return output;
+}
+
+static std::string ToLower(std::string s)
+{
+  for (auto &c : s)
+    c = (char) tolower((unsigned char) c);
   
-public:
-  Format_Image() {}
-  ~Format_Image() {}
+  return s;
+}
+
+static std::string GetEnvironmentString(const char *name)
+{
+  DWORD length = GetEnvironmentVariableA(name, nullptr, 0);
+  if (length == 0)
+    return std::string();
   
-  virtual void Parse(const char *) = 0;
+  std::string value(length, '\0');
+  length = GetEnvironmentVariableA(name, &value[0], length);
+  value.resize(length);
   
-  uint64_t GetWidth() const
-  {
-    return width;
-  }
+  return value;
+}
+
+// Hashed index of every executable reachable through %PATH%. Resolving a command name by probing each PATH directory
+// for each PATHEXT extension is painfully slow on network drives, so the index is built once on a background thread at
+// startup and refreshed lazily: a directory is only enumerated again when its last-write time changed.
+class PathIndex {
+  struct Directory {
+    std::string path;
+    FILETIME modified;
+    VectorString files;
+  };
   
-  uint64_t GetHeight() const
-  {
-    return height;
-  }
+  std::mutex lock;
+  std::condition_variable ready_condition;
+  bool started = false;
+  bool ready = false;
+  
+  std::string path_variable;
+  VectorString extensions;
+  std::vector<Directory> directories;
+  
+  // Lower-cased name (both "notepad" and "notepad.exe") -> full path. The first PATH entry wins, like cmd.exe.
+  std::unordered_map<std::string, std::string> executables;
+  ULONGLONG last_check = 0;
+  
+  static const ULONGLONG CheckInterval = 1000;
   
-  uint16_t GetPlaneCount() const
+  static bool GetModifiedTime(const std::string &path, FILETIME *time)
   {
-    return planes;
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    
+    if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &data))
+      return false;
+    
+    *time = data.ftLastWriteTime;
+    return true;
   }
-};
-
-class Format_PDF : public Format_Document {
-  std::string version;
-public:
-  Format_PDF() {}
-  ~Format_PDF() {}
   
-  std::string GetVersion() const
+  bool HasExecutableExtension(const std::string &name) const
   {
-    return version;
+    auto dot = name.find_last_of('.');
+    if (dot == std::string::npos)
+      return false;
+    
+    return std::find(extensions.begin(), extensions.end(), name.substr(dot)) != extensions.end();
   }
   
-  void Parse(const char *name)
+  void Enumerate(Directory &directory) const
   {
-    if (IsReady())
-      return;
-    
-    // FILE __attribute__((cleanup(Cleanup_FILE))) *f = fopen(name, "rb");
-    FILE *f = fopen(name, "rb");
-    if (!f) {
-      ready = false;
-      return;
-    }
+    directory.files.clear();
     
-    char magic[4];
-    fread(magic, 4, 1, f);
+    WIN32_FIND_DATA data;
+    HANDLE h = FindFirstFileEx((directory.path + "\\*").c_str(), FindExInfoBasic, &data, FindExSearchNameMatch, nullptr, FIND_FIRST_EX_LARGE_FETCH);
     
-    if (magic[0] == '%' && magic[1] == 'P' && magic[2] == 'D' && magic[3] == 'F') {
-      fseek(f, 1, SEEK_CUR);
-      char version[16];
-      if (fgets(version, 16, f) != nullptr) {
-        this->version = version;
-      } else {
-        this->ready = false;
-        return;
-      }
+    if (h != INVALID_HANDLE_VALUE) {
+      do {
+        if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+          continue;
+        
+        auto name = ToLower(data.cFileName);
+        if (HasExecutableExtension(name))
+          directory.files.push_back(name);
+      } while (FindNextFile(h, &data) != 0);
+      
+      FindClose(h);
     }
-    
-    this->size = FileSize(name);
-    this->ready = true;
-
-	fclose(f);
   }
-};
-
-class Format_BMP : public Format_Image {
-  uint16_t bpp;
-public:
-  Format_BMP() {}
-  ~Format_BMP() {}
   
-  uint16_t GetBPP()
+  void Merge()
   {
-    return bpp;
+    executables.clear();
+    
+    for (const auto &directory : directories) {
+      for (const auto &file : directory.files)
+        executables.emplace(file, directory.path + '\\' + file);
+      
+      // Within one directory the bare name goes to the first extension in %PATHEXT% order, not to whichever file the
+      // enumeration returned first ("tool" is tool.exe, not tool.bat, with the default .com;.exe;.bat;.cmd).
+      for (const auto &extension : extensions) {
+        for (const auto &file : directory.files) {
+          auto dot = file.find_last_of('.');
+          if (file.compare(dot, std::string::npos, extension) == 0)
+            executables.emplace(file.substr(0, dot), directory.path + '\\' + file);
+        }
+      }
+    }
   }
   
-  void Parse(const char *name)
+  // Re-reads %PATH%/%PATHEXT% and enumerates every directory. Must be called with the lock held.
+  void Rebuild()
   {
-    if (IsReady())
-      return;
+    path_variable = GetEnvironmentString("PATH");
     
-    // FILE __attribute__((cleanup(Cleanup_FILE))) *f = fopen(name, "rb");
-    FILE *f = fopen(name, "rb");
-    if (!f) {
-      ready = false;
-      return;
-    }
+    auto pathext = GetEnvironmentString("PATHEXT");
+    extensions = split(ToLower(pathext.empty() ? std::string(".com;.exe;.bat;.cmd") : pathext), ';');
+    extensions.erase(std::remove(extensions.begin(), extensions.end(), std::string()), extensions.end());
     
-    // Header structure (14 bytes, 2 for magic, 4 for file size, 4 reserved, 4 for buffer offset)
-    {
-      char magic[2];
-      fread(magic, 2, 1, f);
+    directories.clear();
+    for (auto &path : split(path_variable, ';')) {
+      while (!path.empty() && (path.back() == '\\' || path.back() == '/'))
+        path.pop_back();
       
-      if (magic[0] != 'B' || magic[1] != 'M') {
-        ready = false;
-        return;
-      }
+      if (path.empty())
+        continue;
       
-      fread(&this->size, sizeof(uint32_t), 1, f);
+      Directory directory;
+      directory.path = path;
       
-      // Skips the last two fields
-      fseek(f, 4 * 2, SEEK_CUR);
+      if (!GetModifiedTime(path, &directory.modified))
+        continue;
+      
+      Enumerate(directory);
+      directories.push_back(directory);
     }
     
-    // Info header structure (40 bytes)
-    {
-      fseek(f, 4, SEEK_CUR);    
-      fread(&this->width, sizeof(uint32_t), 1, f);
-      fread(&this->height, sizeof(uint32_t), 1, f);
-      fread(&this->planes, sizeof(uint16_t), 1, f);
-      fread(&this->bpp, sizeof(uint16_t), 1, f);
-    }
-
-	fclose(f);
-  }
-};
-
-class Format_PE : public Format_Binary_Image {
-  std::vector<const char *> properties;
-  uint8_t version[2];
-  uint16_t version_OS[2];
-  uint16_t version_image[2];
-  uint64_t size_stack;
-  uint32_t checksum;
-  uint16_t sections;
-public:
-  Format_PE() {}
-  ~Format_PE() {}
-  
-  std::vector<const char *> GetProperties() const { return properties; }
-  
-  uint8_t GetMajorLinkerVersion() const { return version[0]; }
-  uint8_t GetMinorLinkerVersion() const { return version[1]; }
-  uint16_t GetMajorOSVersion() const { return version_OS[0]; }
-  uint16_t GetMinorOSVersion() const { return version_OS[1]; }
-  uint16_t GetMajorImageVersion() const { return version_image[0]; }
-  uint16_t GetMinorImageVersion() const { return version_image[1]; }
-  uint64_t GetStackSize() const { return size_stack; }
-  uint32_t GetChecksum() const { return checksum; }
-  uint16_t GetSectionCount() const { return sections; }
-  
-  bool Is64Bit() const
-  {
-    return (std::find(properties.begin(), properties.end(), "IMAGE_FILE_MACHINE_AMD64") != properties.end()) && (this->architecture == 0x20b);
+    Merge();
+    last_check = GetTickCount64();
   }
   
-  void Parse(const char *name)
+  // Checks each directory's last-write time and only enumerates the ones that changed. Checks are rate-limited so a
+  // burst of lookups (or tab presses) costs one stat per directory at most once per CheckInterval.
+  void Refresh()
   {
-    if (IsReady())
-      return;
-    
-    // FILE __attribute__((cleanup(Cleanup_FILE))) *f = fopen(name, "rb");
-    FILE *f = fopen(name, "rb");
-    if (!f) {
-      ready = false;
+    auto now = GetTickCount64();
+    if (now - last_check < CheckInterval)
       return;
-    }
-    
-    char magic[4];
-    fread(magic, 2, 1, f);
     
-    // DOS stub is present, which starts with "MZ". Since we've read past the magic identifier, subtract two bytes
-    if (magic[0] == 'M' && magic[1] == 'Z') {
-      fseek(f, 0x80 - 0x2, SEEK_CUR);
-      fread(magic, 4, 1, f);
-    }
+    last_check = now;
     
-    if (magic[0] != 'P' || magic[1] != 'E' || magic[2] != '\0' || magic[3] != '\0') {
-      ready = false;
+    if (GetEnvironmentString("PATH") != path_variable) {
+      Rebuild();
       return;
     }
     
-    // Begin of _IMAGE_FILE_HEADER
-    // Read Machine
-    uint16_t type;
-    fread(&type, 2, 1, f);
-    this->properties.push_back(ImageFileHeader_Machine[type]);
-    
-    // Read NumberOfSections
-    fread(&this->sections, 2, 1, f);
-    
-    // Read TimeDateStamp 
-    uint32_t date;
-    fread(&date, 4, 1, f);
-    
-    // Skip over PointerToSymbolTable + NumberOfSymbols (both 4 bytes each)
-    fseek(f, 8, SEEK_CUR);
-    
-    // Read SizeOfOptionalHeader
-    uint16_t opt_head_size;
-    fread(&opt_head_size, 2, 1, f);
-    
-    // Read Characteristics
-    uint16_t properties;
-    fread(&properties, 2, 1, f);
-    
-    for (const auto &c : ImageFileHeader_Characteristics) {
-      if (properties & c.first)
-        this->properties.push_back(c.second);
+    bool changed = false;
+    for (auto &directory : directories) {
+      FILETIME modified;
+      
+      if (!GetModifiedTime(directory.path, &modified))
+        continue;
+      
+      if (modified.dwLowDateTime != directory.modified.dwLowDateTime || modified.dwHighDateTime != directory.modified.dwHighDateTime) {
+        directory.modified = modified;
+        Enumerate(directory);
+        changed = true;
+      }
     }
     
-    // Optional Header Standard Fields (Image Only)
-    fread(&this->architecture, 2, 1, f);
-    
-    fread(&this->version[0], 1, 1, f);
-    fread(&this->version[1], 1, 1, f);
-    
-    fseek(f,
-      4 + /*SizeOfCode */
-      4 + /*SizeOfInitializedData */
-      4 + /*SizeOfUninitializedData*/
-      4 + /*AddressOfEntryPoint */
-      4, /*BaseOfCode*/
-      SEEK_CUR
-    );
-    
-    if (this->architecture == 0x10b) {
-      fseek(f, 4, SEEK_CUR); /* BaseOfData*/
+    if (changed)
+      Merge();
+  }
+  
+  // Waits for the background build. If nobody started one (scripts only pay for the index once they actually run an
+  // external command), the index is built right here.
+  void WaitUntilReady(std::unique_lock<std::mutex> &guard)
+  {
+    if (!started) {
+      started = true;
+      Rebuild();
+      ready = true;
     }
     
-    DWORD step = (this->architecture == 0x10b) ? 4 : 8;
-    
-    fseek(f, 
-      step + /* ImageBase */
-      (4 * 2), /* SectionAlignment + FileAlignment */
-      SEEK_CUR
-    );
-    
-    fread(&this->version_OS[0], 2, 1, f);
-    fread(&this->version_OS[1], 2, 1, f);
-    
-    fread(&this->version_image[0], 2, 1, f);
-    fread(&this->version_image[1], 2, 1, f);
-    
-    fseek(f,
-      (2 * 2) + /* MajorSubsystemVersion +MinorSubsystemVersion*/
-      (4 * 3), /* Win32VersionValue +SizeOfImage +SizeOfHeaders */
-      SEEK_CUR
-    );
-    
-    fread(&this->checksum, 4, 1, f);
-    
-    uint16_t subsystem;
-    fread(&subsystem, 2, 1, f);
-    if (subsystem >= IMAGE_SUBSYSTEM_NATIVE)
-      this->properties.push_back("IMAGE_SUBSYSTEM_NATIVE");
-    if (subsystem >= IMAGE_SUBSYSTEM_WINDOWS_GUI)
-      this->properties.push_back("IMAGE_SUBSYSTEM_WINDOWS_GUI");
-    if (subsystem >= IMAGE_SUBSYSTEM_WINDOWS_CUI)
-      this->properties.push_back("IMAGE_SUBSYSTEM_WINDOWS_CUI");
-    if (subsystem >= IMAGE_SUBSYSTEM_OS2_CUI)
-      this->properties.push_back("IMAGE_SUBSYSTEM_OS2_CUI");
-    if (subsystem >= IMAGE_SUBSYSTEM_POSIX_CUI)
-      this->properties.push_back("IMAGE_SUBSYSTEM_POSIX_CUI");
-    if (subsystem >= IMAGE_SUBSYSTEM_WINDOWS_CE_GUI)
-      this->properties.push_back("IMAGE_SUBSYSTEM_WINDOWS_CE_GUI");
-    if (subsystem >= IMAGE_SUBSYSTEM_EFI_APPLICATION)
-      this->properties.push_back("IMAGE_SUBSYSTEM_EFI_APPLICATION");
-    
-    fseek(f, 2, SEEK_CUR); /* DllCharacteristics */
-    
-    fread(&this->size_stack, step, 1, f);
-    
-    this->size = FileSize(name);
-    this->ready = true;
-
-	fclose(f);
+    ready_condition.wait(guard, [this] () -> bool { return ready; });
   }
-};
-
-class Format_ZIP : public Format_Archiver {
-protected:
-  uint16_t version;
-  uint16_t flags;
-  uint16_t compression;
-  uint32_t crc32;
-  uint32_t compressed_size;
-  uint32_t uncompressed_size;
-public:
-  Format_ZIP() {}
-  ~Format_ZIP() {}
   
-  uint32_t GetCRC32() const { return crc32; }
-  uint16_t GetVersion() const { return version; }
+public:
+  PathIndex() {}
+  ~PathIndex() {}
   
-  void Parse(const char *name)
+  // Builds the index on a detached thread, so it's usually complete by the time the first command is typed.
+  void BuildAsync()
   {
-    if (IsReady())
-      return;
-    
-    // FILE __attribute__((cleanup(Cleanup_FILE))) *f = fopen(name, "rb");
-    FILE *f = fopen(name, "rb");
-    if (!f) {
-      ready = false;
-      return;
-    }
-    
-    char magic[4];
-    fread(magic, 4, 1, f);
-    
-    if (magic[0] != 'P' || magic[1] != 'K' || magic[2] != 0x03 || magic[3] != 0x04) {
-      ready = false;
-      return;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (started)
+        return;
+      started = true;
     }
     
-    fread(&this->version, 2, 1, f);
-    ConsolePrint("Version = %i\n", this->version);
-    
-    fread(&this->flags, 2, 1, f);
-    fread(&this->compression, 2, 1, f);
-    
-    fseek(f, 4, SEEK_CUR);
-    
-    fread(&this->crc32, 4, 1, f);
-    
-    fread(&this->compressed_size, 4, 1, f);
-    fread(&this->uncompressed_size, 4, 1, f);
+    std::thread([this] () -> void {
+      std::lock_guard<std::mutex> guard(lock);
+      Rebuild();
+      ready = true;
+      ready_condition.notify_all();
+    }).detach();
+  }
+  
+  // Returns the full path of the executable, or an empty string if nothing on %PATH% matches.
+  std::string Find(const std::string &name)
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    WaitUntilReady(guard);
     
-    ConsolePrint("Compressed/Uncompressed: = %i / %i\n", this->compressed_size, this->uncompressed_size);
+    // Misses are rate-limited like hits: a command that isn't there (or a builtin or script name looked up here) must
+    // not cost a stat of every PATH directory each time. A new install shows up within CheckInterval.
+    Refresh();
     
-    this->size = FileSize(name);
-    this->ready = true;
-
-	fclose(f);
+    auto it = executables.find(ToLower(name));
+    return it != executables.end() ? it->second : std::string();
   }
-};
-
-Format_BMP ReadBMP(const char *name)
-{
-  Format_BMP format;
-  format.Parse(name);
-  
-  return format;
-}
-
-Format_PDF ReadPDF(const char *name)
-{
-  Format_PDF format;
-  format.Parse(name);
-  
-  return format;
-}
-
-Format_PE ReadPE(const char *name)
-{
-  Format_PE format;
-  format.Parse(name);
-  
-  return format;
-}
-
-Format_ZIP ReadZIP(const char *name)
-{
-  Format_ZIP format;
-  format.Parse(name);
-  
-  return format;
-}
-
-static VectorFileRecord TraverseDirectory(const char *path) {
-  VectorFileRecord v;
-  
-  WIN32_FIND_DATA data;
-  HANDLE h = FindFirstFileEx(path, FindExInfoStandard, &data, FindExSearchNameMatch, nullptr, 0);
   
-  if (h != INVALID_HANDLE_VALUE) {
-    do {
-      FileRecord f(
-        data.cFileName,
-        (data.nFileSizeHigh * (MAXDWORD + 1)) + data.nFileSizeLow,
-        data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY
-      );
-      
-      f.attribute += data.dwFileAttributes & FILE_ATTRIBUTE_HIDDEN ? 'h' : '-';
-      f.attribute += data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY ? 'd' : '-';
-      f.attribute += data.dwFileAttributes & FILE_ATTRIBUTE_SYSTEM ? 's' : '-';
-      f.attribute += data.dwFileAttributes & FILE_ATTRIBUTE_READONLY ? 'r' : '-';
-      f.attribute += data.dwFileAttributes & FILE_ATTRIBUTE_ARCHIVE ? 'a' : '-';
-      f.attribute += data.dwFileAttributes & FILE_ATTRIBUTE_COMPRESSED ? 'c' : '-';
-      f.attribute += data.dwFileAttributes & FILE_ATTRIBUTE_ENCRYPTED ? 'e' : '-';
-      
-      v.push_back(f);
-    } while(FindNextFile(h, &data) != 0);
+  VectorString Complete(const std::string &prefix)
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    WaitUntilReady(guard);
+    Refresh();
     
-    auto error = GetLastError();
+    auto key = ToLower(prefix);
+    VectorString v;
     
-    if (error == ERROR_NO_MORE_FILES) {
-      FindClose(h);
+    for (const auto &e : executables) {
+      // "notepad.exe" is reachable as "notepad" too, only offer the latter
+      if (e.first.compare(0, key.length(), key) == 0 && !HasExecutableExtension(e.first))
+        v.push_back(e.first);
     }
+    
+    return v;
   }
   
-  return v;
-}
-
-VectorString split(const std::string& s, char seperator, std::function<void(std::string &s)> f = [] (std::string &s) -> void {})
-{
-   VectorString output;
-
-    std::string::size_type prev_pos = 0, pos = 0;
-
-    while((pos = s.find(seperator, pos)) != std::string::npos)
-    {
-        std::string substring( s.substr(prev_pos, pos-prev_pos) );
-        
-        f(substring);
-
-        output.push_back(substring);
-
-        prev_pos = ++pos;
+  // Resolves names containing a path (".\tool", "C:\bin\tool") by trying each PATHEXT extension in place.
+  std::string FindInPlace(const std::string &name)
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    WaitUntilReady(guard);
+    
+    if (GetFileAttributesA(name.c_str()) != INVALID_FILE_ATTRIBUTES && HasExecutableExtension(ToLower(name)))
+      return name;
+    
+    for (const auto &extension : extensions) {
+      auto candidate = name + extension;
+      if (GetFileAttributesA(candidate.c_str()) != INVALID_FILE_ATTRIBUTES)
+        return candidate;
     }
     
-    std::string last = s.substr(prev_pos, pos-prev_pos);
-    f(last);
-    output.push_back(last); // Last word
+    return std::string();
+  }
+};
 
-    return output;
-}
+static PathIndex Executables;
 
 void ConsoleSetTitle(const char *title)
 {
@@ -647,6 +820,8 @@ void ConsoleSetTitle(const char *title)
 
 bool ConsoleSetPosition(int16_t x, int16_t y)
 {
+  TRACE_SCOPE("ConsoleSetPosition");
+  
   if (x > GetUserPrompt().length() + input.length())
     x = GetUserPrompt().length() + input.length();
   else if (x <= GetUserPrompt().length())
@@ -737,678 +912,6408 @@ void ConsoleEraseCharacter(uint16_t x, uint16_t y)
   ConsoleSetPosition(position.first - 1, position.second);
 }
 
+// What the superblock (or boot sector) of a volume says. Counts the format doesn't store in there stay 0.
+struct FileSystemInfo {
+public:
+  std::string type;
+  std::string uuid; // Or the volume serial number on NTFS/FAT/exFAT
+  std::string label;
+  uint32_t block_size = 0; // Cluster size on NTFS/FAT/exFAT
+  uint64_t total_blocks = 0;
+  uint64_t free_blocks = 0;
+  bool usage_known = false; // free_blocks is meaningful
+  uint64_t total_inodes = 0; // ext and XFS only
+  uint64_t free_inodes = 0;
+  std::vector<std::string> features;
+  
+  uint64_t GetTotalBytes() const { return total_blocks * block_size; }
+  uint64_t GetFreeBytes() const { return free_blocks * block_size; }
+  uint64_t GetUsedBytes() const { return total_blocks > free_blocks ? (total_blocks - free_blocks) * block_size : 0; }
+};
+
 struct DriveInfo {
 public:
-  bool GPT;
-  bool MBR_Boot;
+  bool GPT = false;
+  bool MBR_Boot = false;
   std::string GPT_Type;
-  std::string FS;
-  uint32_t number;
-  uint64_t offset;
-  uint64_t size;
-  uint64_t sectors;
-  unsigned disk;
+  FileSystemInfo fs;
+  uint32_t number = 0;
+  uint64_t offset = 0;
+  uint64_t size = 0;
+  uint64_t sectors = 0;
+  unsigned disk = (unsigned) -1; // Stays -1 when the parent disk couldn't be determined
   std::string name;
 };
 
+// An entry of the partition table, as stored on the disk (as opposed to DriveInfo, which is what Windows reports for a
+// mounted volume).
+struct PartitionRecord {
+public:
+  uint32_t index = 0;
+  uint64_t first_lba = 0;
+  uint64_t last_lba = 0;
+  uint64_t attributes = 0;  // GPT only
+  uint8_t mbr_type = 0;     // MBR only
+  bool bootable = false;
+  bool logical = false;     // MBR only, the partition is inside the extended partition
+  std::string type_guid;   // GPT only
+  std::string unique_guid; // GPT only
+  std::string type_name;
+  std::string name;        // GPT only
+  FileSystemInfo fs;
+  
+  // Corrupt or hostile entries can end before they start (or an MBR entry be empty), their size would wrap around
+  bool HasValidRange() const
+  {
+    return last_lba >= first_lba;
+  }
+};
+
 struct DeviceInfo {
 public:
-  bool valid;
-  bool SSD;
-  uint32_t sector_size;
-  uint64_t cylinders;
-  uint64_t sectors;
-  uint16_t number;
+  bool valid = false;
+  bool SSD = false;
+  uint32_t sector_size = 0;
+  uint64_t cylinders = 0;
+  uint64_t sectors = 0;
+  uint16_t number = 0;
+  std::string path; // Set for disk images only
+  std::string scheme; // "GPT", "MBR" or empty when there's no partition table
+  std::string disk_guid;
+  bool GPT_backup = false; // The primary GPT was damaged, the backup copy was used
+  uint64_t cache_hits = 0; // Blocks the probes got from the device's BlockCache, and those that had to be read
+  uint64_t cache_misses = 0;
+  std::vector<PartitionRecord> partition;
   std::vector<DriveInfo> drive;
 };
 
-FILE *DeviceToFileHandle(HANDLE h)
+// CRC-32 (IEEE 802.3, reflected), as used by GPT and ZIP.
+static uint32_t CRC32(const void *data, size_t length, uint32_t crc = 0)
 {
-  int handle = _open_osfhandle((intptr_t) h, _O_RDONLY);
+  static const auto table = [] () -> std::vector<uint32_t> {
+    std::vector<uint32_t> t(256);
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; ++k)
+        c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+      t[i] = c;
+    }
+    return t;
+  }();
   
-  if (handle != -1) {
-    return _fdopen(handle, "rb");
-  }
+  auto p = (const uint8_t *) data;
+  crc = ~crc;
   
-  CloseHandle(h);
-  return nullptr;
+  for (size_t i = 0; i < length; ++i)
+    crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+  
+  return ~crc;
 }
 
-HANDLE FileHandleToDevice(FILE *f)
+// GUIDs are stored mixed-endian: the first three groups little-endian, the last two as plain bytes.
+static bool ParseGUID(const char *text, uint8_t *guid)
 {
-  if (f)
-    return (HANDLE) _get_osfhandle(_fileno(f));
+  static const int order[16] = { 3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15 };
+  int n = 0;
   
-  return nullptr;
+  for (const char *p = text; *p && n < 32; ++p) {
+    if (*p == '-')
+      continue;
+    
+    if (!isxdigit((unsigned char) *p))
+      return false;
+    
+    int nibble = isdigit((unsigned char) *p) ? *p - '0' : (tolower((unsigned char) *p) - 'a' + 10);
+    auto &byte = guid[order[n / 2]];
+    byte = (n % 2 == 0) ? (uint8_t) (nibble << 4) : (uint8_t) (byte | nibble);
+    ++n;
+  }
+  
+  return n == 32;
 }
 
-#define IOCTL_VOLUME_BASE   ((DWORD) 'V')
-#define IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS CTL_CODE(IOCTL_VOLUME_BASE, 0, METHOD_BUFFERED, FILE_ANY_ACCESS)
-
-static /* unsigned  */ void GetPartitionParentDevice(DriveInfo *info, HANDLE h)
+static std::string FormatGUID(const uint8_t *guid)
 {
-  VOLUME_DISK_EXTENTS volumeDiskExtents;
-  DWORD dwBytesReturned = 0;
-  BOOL result = FALSE;
+  char text[40];
+  snprintf(text, sizeof(text), "%08X-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X",
+    LoadLE<uint32_t>(guid), LoadLE<uint16_t>(guid + 4), LoadLE<uint16_t>(guid + 6),
+    guid[8], guid[9], guid[10], guid[11], guid[12], guid[13], guid[14], guid[15]);
   
-  if ((result = DeviceIoControl(h, IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS, nullptr, 0, &volumeDiskExtents, sizeof(volumeDiskExtents), &dwBytesReturned, nullptr)) == TRUE) {
-    for (DWORD n = 0; n < volumeDiskExtents.NumberOfDiskExtents; ++n)
-    {
-      PDISK_EXTENT pDiskExtent = &volumeDiskExtents.Extents[n];
-      info->disk = pDiskExtent->DiskNumber;
-    }
-  }
+  return std::string(text);
 }
 
-static void GetPartitionFSType(DriveInfo *info, const char *header) {
-  if (header) {
-    const auto IsNTFSFS = [&header] () -> bool {
-      return header[3] == 'N' && header[4] == 'T' && header[5] == 'F' && header[6] == 'S' && header[7] == ' ' && header[8] == ' ' && header[9] == ' ' && header[10] == ' ';
-    };
-
-    const auto IsFATFS = [&header] () -> bool {
-      if (header[3] == 'M') {
-        if (header[4] == 'S') {
-          if (header[5] == 'D') { // MSDOS5.0 magic
-            return (header[6] == 'O') && (header[7] == 'S') && (header[8] == '5') && (header[9] == '.') && (header[10] == '0');
-          } else if (header[5] == 'W') { // MSWIN4.0/MSWIN4.1 magic
-            return (header[6] == 'I') && (header[7] == 'N') && (header[8] == '4') && (header[9] == '.') && ((header[10] == '0') || (header[10] == '1'));
-          }
-        } 
-      }
-      
-      return false;
+// Known GPT partition types. Sorted by their on-disk bytes on first use, lookups are a binary search.
+static const char *GetGPTTypeName(const uint8_t *guid)
+{
+  struct Type {
+    uint8_t guid[16];
+    const char *name;
+  };
+  
+  static const auto types = [] () -> std::vector<Type> {
+    static const std::pair<const char *, const char *> known[] = {
+      { "00000000-0000-0000-0000-000000000000", "Unused" },
+      { "024DEE41-33E7-11D3-9D69-0008C781F39F", "MBR partition scheme" },
+      { "C12A7328-F81F-11D2-BA4B-00A0C93EC93B", "EFI System" },
+      { "21686148-6449-6E6F-744E-656564454649", "BIOS boot" },
+      { "E3C9E316-0B5C-4DB8-817D-F92DF00215AE", "Microsoft Reserved" },
+      { "EBD0A0A2-B9E5-4433-87C0-68B6B72699C7", "Microsoft Basic Data" },
+      { "5808C8AA-7E8F-42E0-85D2-E1E90434CFB3", "Windows LDM metadata" },
+      { "AF9B60A0-1431-4F62-BC68-3311714A69AD", "Windows LDM data" },
+      { "DE94BBA4-06D1-4D40-A16A-BFD50179D6AC", "Windows Recovery" },
+      { "E75CAF8F-F680-4CEE-AFA3-B001E56EFC2D", "Windows Storage Spaces" },
+      { "0FC63DAF-8483-4772-8E79-3D69D8477DE4", "Linux filesystem" },
+      { "0657FD6D-A4AB-43C4-84E5-0933C84B4F4F", "Linux swap" },
+      { "E6D6D379-F507-44C2-A23C-238F2A3DF928", "Linux LVM" },
+      { "A19D880F-05FC-4D3B-A006-743F0F84911E", "Linux RAID" },
+      { "933AC7E1-2EB4-4F13-B844-0E14E2AEF915", "Linux /home" },
+      { "3B8F8425-20E0-4F3B-907F-1A25A76F98E8", "Linux /srv" },
+      { "8DA63339-0007-60C0-C436-083AC8230908", "Linux reserved" },
+      { "CA7D7CCB-63ED-4C53-861C-1742536059CC", "Linux LUKS" },
+      { "4F68BCE3-E8CD-4DB1-96E7-FBCAF984B709", "Linux root (x86-64)" },
+      { "44479540-F297-41B2-9AF7-D131D5F0458A", "Linux root (x86)" },
+      { "B921B045-1DF0-41C3-AF44-4C6F280D3FAE", "Linux root (ARM64)" },
+      { "69DAD710-2CE4-4E3C-B16C-21A1D49ABED3", "Linux root (ARM)" },
+      { "BC13C2FF-59E6-4262-A352-B275FD6F7172", "Linux /boot (XBOOTLDR)" },
+      { "48465300-0000-11AA-AA11-00306543ECAC", "Apple HFS+" },
+      { "7C3457EF-0000-11AA-AA11-00306543ECAC", "Apple APFS" },
+      { "426F6F74-0000-11AA-AA11-00306543ECAC", "Apple Boot" },
+      { "516E7CB4-6ECF-11D6-8FF8-00022D09712B", "FreeBSD data" },
+      { "516E7CB5-6ECF-11D6-8FF8-00022D09712B", "FreeBSD swap" },
+      { "516E7CB6-6ECF-11D6-8FF8-00022D09712B", "FreeBSD UFS" },
+      { "516E7CBA-6ECF-11D6-8FF8-00022D09712B", "FreeBSD ZFS" },
+      { "83BD6B9D-7F41-11DC-BE0B-001560B84F0F", "FreeBSD boot" },
+      { "6A898CC3-1DD2-11B2-99A6-080020736631", "Solaris /usr, Apple ZFS" },
+      { "FE3A2A5D-4F32-41A7-B725-ACCC3285A309", "ChromeOS kernel" },
+      { "3CB8E202-3B7E-47DD-8A3C-7FF2A13CFCEC", "ChromeOS root" },
+      { "AA31E02A-400F-11DB-9590-000C2911D1B8", "VMware VMFS" },
+      { "9D275380-40AD-11DB-BF97-000C2911D1B8", "VMware reserved" },
     };
     
-    const auto IsEXFATFS = [&header] () -> bool {
-      return header[3] == 'E' && header[4] == 'X' && header[5] == 'F' && header[6] == 'A' && header[7] == 'T' && header[8] == ' ' && header[9] == ' ' && header[10] == ' ';
-    };
-
-    const auto IsAndroidFS = [&header] () -> bool {
-      if (header[3] == 'a') {
-        if (header[4] == 'n') { // android
-          return (header[5] == 'd') && (header[6] == 'r') && (header[7] == 'o') && (header[8] == 'i') && (header[9] == 'd') && (header[10] == ' ');
-        }
-      }
-      
-      return false;
-    };
+    std::vector<Type> v;
+    for (const auto &k : known) {
+      Type type;
+      type.name = k.second;
+      if (ParseGUID(k.first, type.guid))
+        v.push_back(type);
+    }
     
-    if (IsNTFSFS())
-      info->FS = "NTFS";
-    else if (IsFATFS())
-      info->FS = "FAT12/FAT16/FAT32";
-    else if (IsEXFATFS())
-      info->FS = "exFAT";
-    else if (IsAndroidFS())
-      info->FS = "Android Volume";
-    else
-      info->FS = "???";
-  }
+    std::sort(v.begin(), v.end(), [] (const Type &a, const Type &b) -> bool { return memcmp(a.guid, b.guid, 16) < 0; });
+    return v;
+  }();
+  
+  auto it = std::lower_bound(types.begin(), types.end(), guid, [] (const Type &type, const uint8_t *key) -> bool {
+    return memcmp(type.guid, key, 16) < 0;
+  });
+  
+  return (it != types.end() && memcmp(it->guid, guid, 16) == 0) ? it->name : nullptr;
 }
 
-static void GetPartitionFSData_GUID(DriveInfo *info, HANDLE h)
+static const std::unordered_map<uint8_t, const char *> &MBRPartitionType()
 {
-  FILE *f = DeviceToFileHandle(h);
+  static const std::unordered_map<uint8_t, const char *> table {
+    { 0x01, "FAT12" },
+    { 0x04, "FAT16 (< 32 MiB)" },
+    { 0x05, "Extended (CHS)" },
+    { 0x06, "FAT16" },
+    { 0x07, "NTFS/exFAT/HPFS" },
+    { 0x0b, "FAT32 (CHS)" },
+    { 0x0c, "FAT32 (LBA)" },
+    { 0x0e, "FAT16 (LBA)" },
+    { 0x0f, "Extended (LBA)" },
+    { 0x11, "Hidden FAT12" },
+    { 0x12, "Diagnostics/Recovery" },
+    { 0x17, "Hidden NTFS" },
+    { 0x1b, "Hidden FAT32" },
+    { 0x1c, "Hidden FAT32 (LBA)" },
+    { 0x27, "Windows Recovery" },
+    { 0x42, "Windows LDM" },
+    { 0x82, "Linux swap" },
+    { 0x83, "Linux" },
+    { 0x85, "Linux extended" },
+    { 0x8e, "Linux LVM" },
+    { 0xa5, "FreeBSD" },
+    { 0xa6, "OpenBSD" },
+    { 0xa9, "NetBSD" },
+    { 0xaf, "Apple HFS+" },
+    { 0xee, "GPT protective" },
+    { 0xef, "EFI System" },
+    { 0xfb, "VMware VMFS" },
+    { 0xfd, "Linux RAID" },
+  };
   
-  if (f) {
-    // Get sector size
-    DWORD sector_size;
-    
-    DISK_GEOMETRY surface = {0};
-    DWORD junk;
-    BOOL result = false;
-    
-    if ((result = DeviceIoControl(h, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0, &surface, sizeof(surface), &junk, (LPOVERLAPPED) NULL)) == TRUE) {
-      sector_size = surface.BytesPerSector;
-      // Get other drive info (free space, sectors, etc)
-      info->sectors = info->size / sector_size;
-      
-      // NTFS header
-      char *header = new char[sector_size];
-      
-      fseek(f, 0, SEEK_SET);
-      fread(header, sector_size, 1, f);
-      
-      GetPartitionFSType(info, header);
-
-/*      
-      for (int i = 0; i < 16; ++i) {
-        fread(header, sector_size, 1, f);
-        printf("i = %i, buffer = %s\n", i, header);
-      }
-      */
-
-	  delete[] header;
-    }
-  }
+  return table;
 }
 
-static void GetPartitionFSData_Letter(DriveInfo *info, HANDLE h)
+static bool IsExtendedPartition(uint8_t type)
 {
-  FILE *f = DeviceToFileHandle(h);
+  return type == 0x05 || type == 0x0f || type == 0x85;
+}
+
+// Page-aligned buffers for unbuffered I/O. Released buffers are kept per size and handed out again, so the probes
+// don't go through VirtualAlloc/VirtualFree for every read.
+class AlignedBufferPool {
+  std::mutex lock;
+  std::unordered_map<size_t, std::vector<void *>> available;
+  
+  static const size_t page = 4096;
+  static const size_t kept_per_size = 8;
+  static const size_t kept_max_size = 1024 * 1024;
+  
+public:
+  static size_t RoundUp(size_t size)
+  {
+    return (size + page - 1) / page * page;
+  }
   
-  if (f) {
-    // Get sector size
-    DWORD sector_size;
-    GetDiskFreeSpaceA((info->name + "\\").c_str(), nullptr, &sector_size, nullptr, nullptr);
+  void *Acquire(size_t size)
+  {
+    size = RoundUp(size);
     
-    // Get other drive info (free space, sectors, etc)
-    ULARGE_INTEGER total;
-    GetDiskFreeSpaceExA((info->name + "\\").c_str(), nullptr, &total, nullptr);
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      auto &list = available[size];
+      if (!list.empty()) {
+        auto buffer = list.back();
+        list.pop_back();
+        return buffer;
+      }
+    }
     
-    info->sectors = info->size / (sector_size > 0 ? sector_size : 1);
+    return VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  }
+  
+  void Release(void *buffer, size_t size)
+  {
+    if (buffer == nullptr)
+      return;
     
-    // NTFS header
-	char *header = new char[sector_size];
+    size = RoundUp(size);
     
-    fseek(f, 0, SEEK_SET);
-    fread(header, sector_size, 1, f);
+    if (size <= kept_max_size) {
+      std::lock_guard<std::mutex> guard(lock);
+      auto &list = available[size];
+      if (list.size() < kept_per_size) {
+        list.push_back(buffer);
+        return;
+      }
+    }
     
-    GetPartitionFSType(info, header);
-
-	delete[] header;
+    VirtualFree(buffer, 0, MEM_RELEASE);
   }
+};
+
+static AlignedBufferPool &AlignedBuffers()
+{
+  static AlignedBufferPool pool;
+  return pool;
 }
 
-static void GetAdditionalPartitionInfo(DriveInfo *info, HANDLE h)
+// A buffer from AlignedBuffers(), given back on destruction.
+class AlignedBuffer {
+  void *data = nullptr;
+  size_t size = 0;
+  
+public:
+  AlignedBuffer(size_t size) : data(AlignedBuffers().Acquire(size)), size(size) {}
+  ~AlignedBuffer() { AlignedBuffers().Release(data, size); }
+  
+  AlignedBuffer(const AlignedBuffer &) = delete;
+  AlignedBuffer &operator=(const AlignedBuffer &) = delete;
+  
+  uint8_t *Get() const { return (uint8_t *) data; }
+  size_t GetSize() const { return size; }
+};
+
+// Event for synchronous waits on handles opened with FILE_FLAG_OVERLAPPED (one per thread). The low bit is set so the
+// completion isn't also queued to a completion port the handle may be associated with.
+static HANDLE GetThreadIOEvent()
 {
-  if (h && h != INVALID_HANDLE_VALUE) {
-    PARTITION_INFORMATION_EX block;
-    NTSTATUS status;
-    IO_STATUS_BLOCK iosb;
-    
-    if (0 <= (status = NtDeviceIoControlFile(h, 0, 0, 0, &iosb, IOCTL_DISK_GET_PARTITION_INFO_EX, 0, 0, &block, sizeof(block)))) {
-      switch (block.PartitionStyle)
-      {
-        case PARTITION_STYLE_MBR: {
+  thread_local struct Event {
+    HANDLE handle = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+    ~Event() { if (handle != nullptr) CloseHandle(handle); }
+  } event;
+  
+  return (HANDLE) ((uintptr_t) event.handle | 1);
+}
+
+// DeviceIoControl() that waits for the result whether or not the handle was opened for overlapped I/O
+static BOOL IoControl(HANDLE h, DWORD code, void *in, DWORD in_size, void *out, DWORD out_size, DWORD *returned)
+{
+  OVERLAPPED overlapped = {0};
+  overlapped.hEvent = GetThreadIOEvent();
+  
+  if (DeviceIoControl(h, code, in, in_size, out, out_size, returned, &overlapped))
+    return TRUE;
+  
+  return GetLastError() == ERROR_IO_PENDING && GetOverlappedResult(h, &overlapped, returned, TRUE);
+}
+
+// One read of a batch, see BlockDevice::ReadBatch()
+struct ReadRequest {
+  uint64_t offset;
+  void *buffer;
+  size_t length;
+};
+
+// Least recently used cache of fixed-size, aligned blocks of a device, indexed by block number. The probes read the
+// same few places over and over (LBA 0, the GPT, the start of every partition), this is where the repeats are served.
+// Not thread-safe, like the BlockDevice it belongs to.
+class BlockCache {
+  struct Block {
+    uint64_t index;
+    std::vector<uint8_t> data;
+  };
+  
+  uint32_t block_size;
+  size_t capacity;
+  std::list<Block> blocks; // Most recently used first
+  std::unordered_map<uint64_t, std::list<Block>::iterator> lookup;
+  
+public:
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  
+  BlockCache(uint32_t block_size = 4096, size_t capacity = 256) : block_size(block_size), capacity(capacity) {}
+  
+  uint32_t GetBlockSize() const
+  {
+    return block_size;
+  }
+  
+  // Changing the block size drops everything cached
+  void SetBlockSize(uint32_t size)
+  {
+    if (size != block_size) {
+      blocks.clear();
+      lookup.clear();
+      block_size = size;
+    }
+  }
+  
+  // Counts a hit or a miss (unless the caller does its own counting), the block data is nullptr for the latter
+  const uint8_t *Find(uint64_t index, bool count = true)
+  {
+    auto it = lookup.find(index);
+    if (it == lookup.end()) {
+      misses += count;
+      return nullptr;
+    }
+    
+    hits += count;
+    blocks.splice(blocks.begin(), blocks, it->second);
+    return it->second->data.data();
+  }
+  
+  bool Contains(uint64_t index) const
+  {
+    return lookup.find(index) != lookup.end();
+  }
+  
+  void Insert(uint64_t index, const uint8_t *data)
+  {
+    auto it = lookup.find(index);
+    if (it != lookup.end()) {
+      memcpy(it->second->data.data(), data, block_size);
+      blocks.splice(blocks.begin(), blocks, it->second);
+      return;
+    }
+    
+    // Recycle the least recently used block once full
+    if (blocks.size() >= capacity) {
+      lookup.erase(blocks.back().index);
+      blocks.splice(blocks.begin(), blocks, std::prev(blocks.end()));
+    } else {
+      blocks.push_front(Block());
+      blocks.front().data.resize(block_size);
+    }
+    
+    blocks.front().index = index;
+    memcpy(blocks.front().data.data(), data, block_size);
+    lookup[index] = blocks.begin();
+  }
+  
+  // Reads that large are streaming, not probing, and would only flush the cache
+  size_t GetMaximumRead() const
+  {
+    return capacity / 4 * block_size;
+  }
+};
+
+// Random-access reader over anything that looks like a disk: a PhysicalDrive, a volume or a raw image file. The
+// partition and file system probes only talk to this, so they work the same on live devices and on disk images.
+// Handles are opened unbuffered: every transfer reaching ReadAligned() starts and ends on an `alignment` boundary and
+// lands in a page-aligned buffer, callers get any offset and length through Read(), which widens and copies as needed.
+// Small reads go through a BlockCache, so a probe reading what an earlier one (or ProbeEngine) already read costs
+// nothing.
+class BlockDevice {
+protected:
+  uint32_t sector_size = 512;
+  uint32_t alignment = 512;
+  uint64_t size = 0;
+  
+  // Positional read through the OVERLAPPED offset, the handle's file pointer is never used (or moved). Whatever lies
+  // past the end of the file is zeroed. A short read means end of file: an unbuffered read of an image whose size isn't
+  // a sector multiple returns just the bytes up to the end, and reading on from there would be unaligned and fail with
+  // ERROR_INVALID_PARAMETER instead of reporting EOF. Works on overlapped handles as well, by waiting for the read.
+  static bool ReadAt(HANDLE h, uint64_t offset, void *buffer, size_t length)
+  {
+    size_t done = 0;
+    
+    while (done < length) {
+      OVERLAPPED overlapped = {0};
+      overlapped.Offset = (DWORD) (offset + done);
+      overlapped.OffsetHigh = (DWORD) ((offset + done) >> 32);
+      overlapped.hEvent = GetThreadIOEvent();
+      
+      DWORD read = 0;
+      DWORD chunk = (DWORD) std::min<size_t>(length - done, 1 << 30);
+      
+      BOOL success = ReadFile(h, (char *) buffer + done, chunk, &read, &overlapped);
+      if (!success && GetLastError() == ERROR_IO_PENDING)
+        success = GetOverlappedResult(h, &overlapped, &read, TRUE);
+      
+      if (!success) {
+        if (GetLastError() == ERROR_HANDLE_EOF)
+          break;
+        
+        return false;
+      }
+      
+      done += read;
+      
+      if (read < chunk)
+        break;
+    }
+    
+    memset((char *) buffer + done, 0, length - done);
+    return true;
+  }
+  
+  // `offset` and `length` are multiples of `alignment`, `buffer` is page-aligned
+  virtual bool ReadAligned(uint64_t offset, void *buffer, size_t length) = 0;
+  
+  BlockCache cache;
+  
+  // The cache blocks need to be whole transfers, so they can't be smaller than the alignment
+  void SetAlignment(uint32_t value)
+  {
+    alignment = value;
+    cache.SetBlockSize(std::max<uint32_t>(value, 4096));
+  }
+  
+  // Reads [offset, offset + length) through the cache. The blocks missing are read with one transfer per contiguous
+  // run of them, anything past the end of the device reads as zeroes. `count` is false for ReadBatch(), which has
+  // counted the hits and misses of the whole batch already.
+  bool ReadCached(uint64_t offset, void *buffer, size_t length, bool count = true)
+  {
+    const uint64_t block_size = cache.GetBlockSize();
+    const uint64_t first = offset / block_size;
+    const uint64_t last = (offset + length - 1) / block_size;
+    
+    auto CopyOut = [&] (uint64_t block_offset, const uint8_t *data, uint64_t data_length) {
+      auto from = std::max(offset, block_offset);
+      auto to = std::min(offset + length, block_offset + data_length);
+      memcpy((uint8_t *) buffer + (from - offset), data + (from - block_offset), (size_t) (to - from));
+    };
+    
+    for (uint64_t index = first; index <= last; ) {
+      auto data = cache.Find(index, count);
+      
+      if (data == nullptr) {
+        // Extend the run over the following missing blocks
+        uint64_t end = index + 1;
+        while (end <= last && !cache.Contains(end))
+          ++end;
+        
+        uint64_t start_offset = index * block_size;
+        uint64_t end_offset = end * block_size;
+        if (size != 0)
+          end_offset = std::min<uint64_t>(end_offset, std::max<uint64_t>((size + alignment - 1) / alignment * alignment, start_offset + alignment));
+        
+        AlignedBuffer run((size_t) ((end - index) * block_size));
+        if (run.Get() == nullptr)
+          return false;
+        
+        memset(run.Get() + (end_offset - start_offset), 0, run.GetSize() - (size_t) (end_offset - start_offset));
+        if (!ReadAligned(start_offset, run.Get(), (size_t) (end_offset - start_offset)))
+          return false;
+        
+        for (uint64_t i = index; i < end; ++i)
+          cache.Insert(i, run.Get() + (i - index) * block_size);
+        
+        // The blocks after the first were never looked up, they're misses as well
+        if (count)
+          cache.misses += end - index - 1;
+        
+        CopyOut(start_offset, run.Get(), run.GetSize());
+        index = end;
+        continue;
+      }
+      
+      CopyOut(index * block_size, data, block_size);
+      ++index;
+    }
+    
+    return true;
+  }
+  
+public:
+  BlockDevice() {}
+  virtual ~BlockDevice() {}
+  
+  uint32_t GetSectorSize() const
+  {
+    return sector_size;
+  }
+  
+  uint64_t GetSize() const
+  {
+    return size;
+  }
+  
+  uint32_t GetAlignment() const
+  {
+    return alignment;
+  }
+  
+  // The handle reads go to, for issuing asynchronous reads on it (see ProbeEngine)
+  virtual HANDLE GetHandle() const = 0;
+  
+  const BlockCache &GetCache() const
+  {
+    return cache;
+  }
+  
+  // Puts data read elsewhere (ProbeEngine) into the cache. Only whole cache blocks are kept.
+  void AddPrefetched(uint64_t offset, const uint8_t *data, size_t length)
+  {
+    const uint64_t block_size = cache.GetBlockSize();
+    
+    for (uint64_t index = (offset + block_size - 1) / block_size; (index + 1) * block_size <= offset + length; ++index) {
+      cache.Insert(index, data + (index * block_size - offset));
+      ++cache.misses;
+    }
+  }
+  
+  // Reads exactly `length` bytes at `offset`. Fails if any part of the range can't be read.
+  bool Read(uint64_t offset, void *buffer, size_t length, bool count = true)
+  {
+    if (length == 0)
+      return true;
+    
+    // The size is 0 when the device couldn't report it, reads are then left to fail on their own
+    if (size != 0 && offset + length > size)
+      return false;
+    
+    if (length <= cache.GetMaximumRead())
+      return ReadCached(offset, buffer, length, count);
+    
+    auto start = offset / alignment * alignment;
+    auto end = (offset + length + alignment - 1) / alignment * alignment;
+    
+    if (start == offset && end == offset + length && ((uintptr_t) buffer & 4095) == 0)
+      return ReadAligned(offset, buffer, length);
+    
+    AlignedBuffer bounce((size_t) (end - start));
+    if (bounce.Get() == nullptr || !ReadAligned(start, bounce.Get(), bounce.GetSize()))
+      return false;
+    
+    memcpy(buffer, bounce.Get() + (offset - start), length);
+    return true;
+  }
+  
+  // Reads several ranges with as few transfers as possible: what's cached is served from the cache, and the missing
+  // blocks of all the ranges are read with one transfer per contiguous run. Returns false if any of them failed.
+  // Each block counts once, as a hit if it was cached before the batch (or came up earlier in it), as a miss otherwise.
+  bool ReadBatch(const std::vector<ReadRequest> &requests)
+  {
+    const uint64_t block_size = cache.GetBlockSize();
+    std::vector<uint64_t> missing;
+    
+    for (const auto &request : requests) {
+      if (request.length == 0 || request.length > cache.GetMaximumRead())
+        continue;
+      
+      for (uint64_t index = request.offset / block_size; index <= (request.offset + request.length - 1) / block_size; ++index) {
+        if (!cache.Contains(index))
+          missing.push_back(index);
+        else
+          ++cache.hits;
+      }
+    }
+    
+    std::sort(missing.begin(), missing.end());
+    cache.hits += missing.size();
+    missing.erase(std::unique(missing.begin(), missing.end()), missing.end());
+    cache.hits -= missing.size();
+    cache.misses += missing.size();
+    
+    // Reading the first block of each run fetches (and caches) the whole run
+    for (size_t i = 0; i < missing.size(); ) {
+      size_t j = i + 1;
+      while (j < missing.size() && missing[j] == missing[j - 1] + 1 && (j - i + 1) * block_size <= cache.GetMaximumRead())
+        ++j;
+      
+      if (size == 0 || missing[i] * block_size < size) {
+        AlignedBuffer run((size_t) ((j - i) * block_size));
+        if (run.Get() != nullptr)
+          ReadCached(missing[i] * block_size, run.Get(), run.GetSize(), false);
+      }
+      
+      i = j;
+    }
+    
+    // Served from the cache now, or read directly if too large for it; the blocks of a batch larger than the cache
+    // are read again, those don't count twice either
+    bool success = true;
+    for (const auto &request : requests) {
+      if (!Read(request.offset, request.buffer, request.length, false))
+        success = false;
+    }
+    
+    return success;
+  }
+
+};
+
+// A PhysicalDrive or volume handle opened by someone else (the handle isn't closed here). Raw devices only accept
+// sector-aligned transfers, which Read() takes care of.
+class BlockDevice_Handle : public BlockDevice {
+  HANDLE handle;
+  
+protected:
+  bool ReadAligned(uint64_t offset, void *buffer, size_t length)
+  {
+    return ReadAt(handle, offset, buffer, length);
+  }
+  
+public:
+  BlockDevice_Handle(HANDLE handle, uint32_t sector_size) : handle(handle)
+  {
+    this->sector_size = sector_size > 0 ? sector_size : 512;
+    SetAlignment(this->sector_size);
+    
+    GET_LENGTH_INFORMATION length;
+    DWORD junk;
+    if (IoControl(handle, IOCTL_DISK_GET_LENGTH_INFO, nullptr, 0, &length, sizeof(length), &junk))
+      this->size = length.Length.QuadPart;
+  }
+  ~BlockDevice_Handle() {}
+  
+  HANDLE GetHandle() const
+  {
+    return handle;
+  }
+};
+
+// A raw disk image (.img, dd output). Sparse images are common for VM disks: the allocated ranges are queried once, and
+// reads falling into holes are served as zeroes without touching the file. The image is read unbuffered, so probing a
+// large pile of images doesn't wipe out the file cache; if the file system refuses that, it's read buffered instead.
+class BlockDevice_Image : public BlockDevice {
+  HANDLE handle = INVALID_HANDLE_VALUE;
+  bool sparse = false;
+  std::vector<std::pair<uint64_t, uint64_t>> allocated; // (offset, length), sorted
+  
+  void QueryAllocatedRanges()
+  {
+    FILE_ALLOCATED_RANGE_BUFFER query;
+    query.FileOffset.QuadPart = 0;
+    query.Length.QuadPart = size;
+    
+    std::vector<FILE_ALLOCATED_RANGE_BUFFER> ranges(64);
+    
+    for (;;) {
+      DWORD returned = 0;
+      BOOL success = IoControl(handle, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query), ranges.data(), (DWORD) (ranges.size() * sizeof(ranges[0])), &returned);
+      
+      if (!success && GetLastError() != ERROR_MORE_DATA) {
+        // Can't tell where the holes are, treat the whole file as allocated
+        sparse = false;
+        return;
+      }
+      
+      auto count = returned / sizeof(ranges[0]);
+      for (size_t i = 0; i < count; ++i)
+        allocated.push_back(std::make_pair((uint64_t) ranges[i].FileOffset.QuadPart, (uint64_t) ranges[i].Length.QuadPart));
+      
+      if (success || count == 0)
+        break;
+      
+      // Continue after the last range returned
+      auto last = allocated.back();
+      query.FileOffset.QuadPart = last.first + last.second;
+      query.Length.QuadPart = size - query.FileOffset.QuadPart;
+    }
+  }
+  
+protected:
+  bool ReadAligned(uint64_t offset, void *buffer, size_t length)
+  {
+    if (!sparse)
+      return ReadAt(handle, offset, buffer, length);
+    
+    // Zero everything, then only read the parts overlapping allocated ranges. Allocated ranges are cluster-sized, so
+    // their bounds stay aligned.
+    memset(buffer, 0, length);
+    
+    auto end = offset + length;
+    auto it = std::upper_bound(allocated.begin(), allocated.end(), std::make_pair(offset, UINT64_MAX));
+    if (it != allocated.begin())
+      --it;
+    
+    for (; it != allocated.end() && it->first < end; ++it) {
+      auto first = std::max(offset, it->first);
+      auto last = std::min(end, it->first + it->second);
+      
+      if (first < last && !ReadAt(handle, first, (char *) buffer + (first - offset), last - first))
+        return false;
+    }
+    
+    return true;
+  }
+  
+public:
+  // `flags` is added to the CreateFile() flags, i. e. FILE_FLAG_OVERLAPPED for ProbeEngine
+  BlockDevice_Image(const char *path, DWORD flags = 0)
+  {
+    // 4096 covers the physical sector size of every volume the image could be stored on
+    handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING | flags, nullptr);
+    SetAlignment(4096);
+    
+    if (handle == INVALID_HANDLE_VALUE) {
+      handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | flags, nullptr);
+      SetAlignment(512);
+    }
+    
+    if (handle == INVALID_HANDLE_VALUE)
+      return;
+    
+    LARGE_INTEGER length;
+    if (GetFileSizeEx(handle, &length))
+      size = length.QuadPart;
+    
+    BY_HANDLE_FILE_INFORMATION information;
+    if (GetFileInformationByHandle(handle, &information) && (information.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE)) {
+      sparse = true;
+      QueryAllocatedRanges();
+    }
+    
+    // Images don't carry their logical sector size. 512 unless the GPT header shows up at 4096 instead of 512.
+    char signature[8];
+    if (Read(512, signature, 8) && memcmp(signature, "EFI PART", 8) != 0 && Read(4096, signature, 8) && memcmp(signature, "EFI PART", 8) == 0)
+      sector_size = 4096;
+  }
+  
+  ~BlockDevice_Image()
+  {
+    if (handle != INVALID_HANDLE_VALUE)
+      CloseHandle(handle);
+  }
+  
+  bool IsOpen() const
+  {
+    return handle != INVALID_HANDLE_VALUE;
+  }
+  
+  HANDLE GetHandle() const
+  {
+    return handle;
+  }
+};
+
+#define IOCTL_VOLUME_BASE   ((DWORD) 'V')
+#define IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS CTL_CODE(IOCTL_VOLUME_BASE, 0, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+static /* unsigned  */ void GetPartitionParentDevice(DriveInfo *info, HANDLE h)
+{
+  VOLUME_DISK_EXTENTS volumeDiskExtents;
+  DWORD dwBytesReturned = 0;
+  BOOL result = FALSE;
+  
+  if ((result = DeviceIoControl(h, IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS, nullptr, 0, &volumeDiskExtents, sizeof(volumeDiskExtents), &dwBytesReturned, nullptr)) == TRUE) {
+    for (DWORD n = 0; n < volumeDiskExtents.NumberOfDiskExtents; ++n)
+    {
+      PDISK_EXTENT pDiskExtent = &volumeDiskExtents.Extents[n];
+      info->disk = pDiskExtent->DiskNumber;
+    }
+  }
+}
+
+static std::string FormatUUID(const uint8_t *uuid)
+{
+  char text[40];
+  snprintf(text, sizeof(text), "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+    uuid[0], uuid[1], uuid[2], uuid[3], uuid[4], uuid[5], uuid[6], uuid[7],
+    uuid[8], uuid[9], uuid[10], uuid[11], uuid[12], uuid[13], uuid[14], uuid[15]);
+  
+  return std::string(text);
+}
+
+// Fixed-size, space or zero padded label fields
+static std::string TrimLabel(const uint8_t *data, size_t length)
+{
+  std::string s((const char *) data, strnlen((const char *) data, length));
+  while (!s.empty() && s.back() == ' ')
+    s.pop_back();
+  
+  return s;
+}
+
+static bool IsPowerOfTwo(uint64_t n)
+{
+  return n != 0 && (n & (n - 1)) == 0;
+}
+
+// Appends the names of the set bits of `flags` to `features`
+static void AddFeatures(std::vector<std::string> &features, uint32_t flags, const std::pair<uint32_t, const char *> *names, size_t count)
+{
+  for (size_t i = 0; i < count; ++i) {
+    if (flags & names[i].first)
+      features.push_back(names[i].second);
+  }
+}
+
+// ext2/3/4. `data` is the 1024-byte superblock (1024 bytes into the volume).
+static bool DecodeExt(const uint8_t *data, FileSystemInfo *fs)
+{
+  if (LoadLE<uint16_t>(data + 56) != 0xEF53)
+    return false;
+  
+  auto log_block_size = LoadLE<uint32_t>(data + 24);
+  if (log_block_size > 6)
+    return false;
+  
+  static const std::pair<uint32_t, const char *> compat[] = {
+    { 0x0004, "has_journal" }, { 0x0010, "resize_inode" }, { 0x0020, "dir_index" },
+  };
+  static const std::pair<uint32_t, const char *> incompat[] = {
+    { 0x0002, "filetype" }, { 0x0040, "extents" }, { 0x0080, "64bit" }, { 0x0200, "flex_bg" },
+    { 0x2000, "metadata_csum_seed" }, { 0x8000, "inline_data" }, { 0x10000, "encrypt" }, { 0x20000, "casefold" },
+  };
+  static const std::pair<uint32_t, const char *> ro_compat[] = {
+    { 0x0001, "sparse_super" }, { 0x0002, "large_file" }, { 0x0008, "huge_file" }, { 0x0010, "uninit_bg" },
+    { 0x0020, "dir_nlink" }, { 0x0040, "extra_isize" }, { 0x0400, "metadata_csum" },
+  };
+  
+  auto feature_compat = LoadLE<uint32_t>(data + 92);
+  auto feature_incompat = LoadLE<uint32_t>(data + 96);
+  auto feature_ro_compat = LoadLE<uint32_t>(data + 100);
+  
+  // No journal is ext2, a journal alone is ext3, and anything ext4 introduced is ext4
+  if (feature_incompat & (0x0040 | 0x0080 | 0x0200) || feature_ro_compat & (0x0008 | 0x0010 | 0x0040 | 0x0400))
+    fs->type = "ext4";
+  else if (feature_compat & 0x0004)
+    fs->type = "ext3";
+  else
+    fs->type = "ext2";
+  
+  fs->block_size = 1024 << log_block_size;
+  fs->total_blocks = LoadLE<uint32_t>(data + 4);
+  fs->free_blocks = LoadLE<uint32_t>(data + 12);
+  
+  // The high halves of the block counts are only meaningful on 64bit filesystems
+  if (feature_incompat & 0x0080) {
+    fs->total_blocks |= (uint64_t) LoadLE<uint32_t>(data + 0x150) << 32;
+    fs->free_blocks |= (uint64_t) LoadLE<uint32_t>(data + 0x158) << 32;
+  }
+  
+  fs->usage_known = true;
+  fs->total_inodes = LoadLE<uint32_t>(data + 0);
+  fs->free_inodes = LoadLE<uint32_t>(data + 16);
+  
+  fs->uuid = FormatUUID(data + 104);
+  fs->label = TrimLabel(data + 120, 16);
+  
+  AddFeatures(fs->features, feature_compat, compat, sizeof(compat) / sizeof(compat[0]));
+  AddFeatures(fs->features, feature_incompat, incompat, sizeof(incompat) / sizeof(incompat[0]));
+  AddFeatures(fs->features, feature_ro_compat, ro_compat, sizeof(ro_compat) / sizeof(ro_compat[0]));
+  return true;
+}
+
+// `data` is the primary btrfs superblock, 64 KiB into the volume.
+static bool DecodeBtrfs(const uint8_t *data, FileSystemInfo *fs)
+{
+  if (memcmp(data + 64, "_BHRfS_M", 8) != 0)
+    return false;
+  
+  auto sector_size = LoadLE<uint32_t>(data + 144);
+  if (!IsPowerOfTwo(sector_size))
+    return false;
+  
+  static const std::pair<uint32_t, const char *> incompat[] = {
+    { 0x0001, "mixed_backref" }, { 0x0008, "compress_lzo" }, { 0x0010, "compress_zstd" }, { 0x0040, "extended_iref" },
+    { 0x0080, "raid56" }, { 0x0100, "skinny_metadata" }, { 0x0200, "no_holes" }, { 0x0400, "metadata_uuid" },
+  };
+  
+  auto total_bytes = LoadLE<uint64_t>(data + 112);
+  auto bytes_used = LoadLE<uint64_t>(data + 120);
+  
+  fs->type = "btrfs";
+  fs->uuid = FormatUUID(data + 32);
+  fs->label = TrimLabel(data + 299, 256);
+  fs->block_size = sector_size;
+  fs->total_blocks = total_bytes / sector_size;
+  fs->free_blocks = total_bytes > bytes_used ? (total_bytes - bytes_used) / sector_size : 0;
+  fs->usage_known = true;
+  
+  AddFeatures(fs->features, (uint32_t) LoadLE<uint64_t>(data + 188), incompat, sizeof(incompat) / sizeof(incompat[0]));
+  return true;
+}
+
+// XFS keeps its superblock big-endian at the start of the volume.
+static bool DecodeXFS(const uint8_t *data, FileSystemInfo *fs)
+{
+  if (memcmp(data, "XFSB", 4) != 0)
+    return false;
+  
+  auto block_size = LoadBE<uint32_t>(data + 4);
+  if (!IsPowerOfTwo(block_size))
+    return false;
+  
+  auto version = LoadBE<uint16_t>(data + 100) & 0x000F;
+  
+  fs->type = "XFS";
+  fs->uuid = FormatUUID(data + 32);
+  fs->label = TrimLabel(data + 108, 12);
+  fs->block_size = block_size;
+  fs->total_blocks = LoadBE<uint64_t>(data + 8);
+  fs->free_blocks = LoadBE<uint64_t>(data + 144);
+  fs->usage_known = true;
+  
+  // XFS allocates inodes dynamically, these are the allocated ones and how many of those are unused
+  fs->total_inodes = LoadBE<uint64_t>(data + 128);
+  fs->free_inodes = LoadBE<uint64_t>(data + 136);
+  
+  fs->features.push_back("v" + std::to_string(version));
+  
+  if (version == 5) {
+    static const std::pair<uint32_t, const char *> incompat[] = {
+      { 0x0001, "ftype" }, { 0x0002, "sparse_inodes" }, { 0x0004, "meta_uuid" }, { 0x0008, "bigtime" }, { 0x0020, "nrext64" },
+    };
+    static const std::pair<uint32_t, const char *> ro_compat[] = {
+      { 0x0001, "finobt" }, { 0x0002, "rmapbt" }, { 0x0004, "reflink" }, { 0x0008, "inobtcount" },
+    };
+    
+    AddFeatures(fs->features, LoadBE<uint32_t>(data + 212), ro_compat, sizeof(ro_compat) / sizeof(ro_compat[0]));
+    AddFeatures(fs->features, LoadBE<uint32_t>(data + 216), incompat, sizeof(incompat) / sizeof(incompat[0]));
+  }
+  
+  return true;
+}
+
+// NTFS boot sector. The label and the free cluster count live in $Volume and $Bitmap, not in the BPB.
+static bool DecodeNTFS(const uint8_t *data, FileSystemInfo *fs)
+{
+  if (memcmp(data + 3, "NTFS    ", 8) != 0)
+    return false;
+  
+  auto bytes_per_sector = LoadLE<uint16_t>(data + 11);
+  uint32_t sectors_per_cluster = data[13];
+  
+  // Values above 0x80 are a negative power of two (clusters above 64 KiB)
+  if (sectors_per_cluster > 0x80)
+    sectors_per_cluster = 1u << (256 - sectors_per_cluster);
+  
+  if (!IsPowerOfTwo(bytes_per_sector) || !IsPowerOfTwo(sectors_per_cluster))
+    return false;
+  
+  char serial[20];
+  snprintf(serial, sizeof(serial), "%016" PRIX64, LoadLE<uint64_t>(data + 72));
+  
+  fs->type = "NTFS";
+  fs->uuid = serial;
+  fs->block_size = bytes_per_sector * sectors_per_cluster;
+  fs->total_blocks = LoadLE<uint64_t>(data + 40) / sectors_per_cluster;
+  return true;
+}
+
+// exFAT boot sector. The label is a root directory entry, but the BPB carries the allocation percentage.
+static bool DecodeExFAT(const uint8_t *data, FileSystemInfo *fs)
+{
+  if (memcmp(data + 3, "EXFAT   ", 8) != 0 || data[108] < 9 || data[108] > 12 || data[109] > 25 - data[108])
+    return false;
+  
+  auto serial = LoadLE<uint32_t>(data + 100);
+  char text[12];
+  snprintf(text, sizeof(text), "%04X-%04X", serial >> 16, serial & 0xFFFF);
+  
+  fs->type = "exFAT";
+  fs->uuid = text;
+  fs->block_size = 1u << (data[108] + data[109]);
+  fs->total_blocks = LoadLE<uint32_t>(data + 92);
+  
+  // 0xFF means the percentage isn't known
+  if (data[112] <= 100) {
+    fs->free_blocks = fs->total_blocks * (100 - data[112]) / 100;
+    fs->usage_known = true;
+  }
+  
+  fs->features.push_back("revision " + std::to_string(data[105]) + "." + std::to_string(data[104]));
+  return true;
+}
+
+// FAT12/16/32. There is no signature worth the name, so the BPB has to make sense instead. `length` is how much of
+// the volume start is in `data`, the FAT32 FSInfo sector (free cluster count) is used when it's in there.
+static bool DecodeFAT(const uint8_t *data, size_t length, FileSystemInfo *fs)
+{
+  if (data[510] != 0x55 || data[511] != 0xAA || (data[0] != 0xEB && data[0] != 0xE9))
+    return false;
+  
+  auto bytes_per_sector = LoadLE<uint16_t>(data + 11);
+  auto sectors_per_cluster = data[13];
+  auto reserved_sectors = LoadLE<uint16_t>(data + 14);
+  auto fats = data[16];
+  auto root_entries = LoadLE<uint16_t>(data + 17);
+  
+  if (bytes_per_sector < 512 || bytes_per_sector > 4096 || !IsPowerOfTwo(bytes_per_sector) ||
+      !IsPowerOfTwo(sectors_per_cluster) || reserved_sectors == 0 || fats == 0 || fats > 2)
+    return false;
+  
+  uint32_t total_sectors = LoadLE<uint16_t>(data + 19);
+  if (total_sectors == 0)
+    total_sectors = LoadLE<uint32_t>(data + 32);
+  
+  uint32_t fat_size = LoadLE<uint16_t>(data + 22);
+  bool extended = fat_size == 0; // FAT32 moves everything past the BPB
+  if (extended)
+    fat_size = LoadLE<uint32_t>(data + 36);
+  
+  uint32_t root_sectors = (root_entries * 32 + bytes_per_sector - 1) / bytes_per_sector;
+  uint64_t data_start = reserved_sectors + (uint64_t) fats * fat_size + root_sectors;
+  if (fat_size == 0 || data_start >= total_sectors)
+    return false;
+  
+  // The cluster count alone decides the FAT type
+  uint32_t clusters = (uint32_t) ((total_sectors - data_start) / sectors_per_cluster);
+  fs->type = clusters < 4085 ? "FAT12" : (clusters < 65525 ? "FAT16" : "FAT32");
+  fs->block_size = bytes_per_sector * sectors_per_cluster;
+  fs->total_blocks = clusters;
+  
+  const uint8_t *ebpb = data + (extended ? 64 : 36);
+  if (ebpb[2] == 0x29) {
+    auto serial = LoadLE<uint32_t>(ebpb + 3);
+    char text[12];
+    snprintf(text, sizeof(text), "%04X-%04X", serial >> 16, serial & 0xFFFF);
+    fs->uuid = text;
+    fs->label = TrimLabel(ebpb + 7, 11);
+    if (fs->label == "NO NAME")
+      fs->label.clear();
+  }
+  
+  if (extended) {
+    size_t fsinfo = (size_t) LoadLE<uint16_t>(data + 48) * bytes_per_sector;
+    
+    if (fsinfo != 0 && fsinfo + 512 <= length && LoadLE<uint32_t>(data + fsinfo) == 0x41615252 &&
+        LoadLE<uint32_t>(data + fsinfo + 484) == 0x61417272) {
+      auto free_clusters = LoadLE<uint32_t>(data + fsinfo + 488);
+      if (free_clusters <= clusters) {
+        fs->free_blocks = free_clusters;
+        fs->usage_known = true;
+      }
+    }
+  }
+  
+  return true;
+}
+
+static const size_t FileSystemHeadSize = 4096;
+
+// Identifies the filesystem of the volume starting `offset` bytes into the device. The first 4 KiB hold every boot
+// sector and superblock decoded here except btrfs', so that's one aligned read (skipped when the caller already read
+// them into `head`), and a second one at 64 KiB only when nothing matched.
+static bool ProbeFileSystem(BlockDevice &device, uint64_t offset, FileSystemInfo *fs, const uint8_t *head = nullptr)
+{
+  TRACE_SCOPE("ProbeFileSystem");
+  
+  const size_t region = FileSystemHeadSize;
+  std::vector<uint8_t> data(region);
+  
+  *fs = FileSystemInfo();
+  
+  if (head != nullptr)
+    memcpy(data.data(), head, region);
+  
+  if (head != nullptr || (offset + region <= device.GetSize() && device.Read(offset, data.data(), region))) {
+    if (DecodeNTFS(data.data(), fs) || DecodeExFAT(data.data(), fs) || DecodeXFS(data.data(), fs) ||
+        DecodeExt(data.data() + 1024, fs) || DecodeFAT(data.data(), region, fs))
+      return true;
+    
+    if (memcmp(data.data() + 3, "android ", 8) == 0) {
+      fs->type = "Android Volume";
+      return true;
+    }
+  }
+  
+  if (offset + 65536 + region <= device.GetSize() && device.Read(offset + 65536, data.data(), region)) {
+    if (DecodeBtrfs(data.data(), fs))
+      return true;
+  }
+  
+  *fs = FileSystemInfo();
+  return false;
+}
+
+// For mounted volumes the filesystem driver knows the usage of every filesystem it can mount (NTFS in particular, whose
+// free cluster count isn't in the boot sector), so its numbers take precedence over what the superblock says.
+static void GetMountedUsage(FileSystemInfo *fs, const std::string &root)
+{
+  DWORD sectors_per_cluster = 0, sector_size = 0;
+  ULARGE_INTEGER total, free;
+  
+  if (GetDiskFreeSpaceA(root.c_str(), &sectors_per_cluster, &sector_size, nullptr, nullptr) == FALSE ||
+      GetDiskFreeSpaceExA(root.c_str(), nullptr, &total, &free) == FALSE || sectors_per_cluster * sector_size == 0)
+    return;
+  
+  fs->block_size = sectors_per_cluster * sector_size;
+  fs->total_blocks = total.QuadPart / fs->block_size;
+  fs->free_blocks = free.QuadPart / fs->block_size;
+  fs->usage_known = true;
+}
+
+static void GetPartitionFSData_GUID(DriveInfo *info, HANDLE h)
+{
+  // Get sector size
+  DISK_GEOMETRY surface = {0};
+  DWORD junk;
+  
+  if (DeviceIoControl(h, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0, &surface, sizeof(surface), &junk, (LPOVERLAPPED) NULL) == TRUE) {
+    BlockDevice_Handle device(h, surface.BytesPerSector);
+    
+    info->sectors = info->size / device.GetSectorSize();
+    
+    ProbeFileSystem(device, 0, &info->fs);
+    GetMountedUsage(&info->fs, info->name + "\\");
+  }
+}
+
+static void GetPartitionFSData_Letter(DriveInfo *info, HANDLE h)
+{
+  // Get sector size
+  DWORD sectors_per_cluster = 0, sector_size = 0;
+  if (GetDiskFreeSpaceA((info->name + "\\").c_str(), &sectors_per_cluster, &sector_size, nullptr, nullptr) == FALSE || sector_size == 0)
+    sector_size = 512;
+  
+  BlockDevice_Handle device(h, sector_size);
+  
+  info->sectors = info->size / device.GetSectorSize();
+  
+  ProbeFileSystem(device, 0, &info->fs);
+  GetMountedUsage(&info->fs, info->name + "\\");
+}
+
+static void GetAdditionalPartitionInfo(DriveInfo *info, HANDLE h)
+{
+  if (h && h != INVALID_HANDLE_VALUE) {
+    PARTITION_INFORMATION_EX block;
+    NTSTATUS status;
+    IO_STATUS_BLOCK iosb;
+    
+    if (0 <= (status = NtDeviceIoControlFile(h, 0, 0, 0, &iosb, IOCTL_DISK_GET_PARTITION_INFO_EX, 0, 0, &block, sizeof(block)))) {
+      switch (block.PartitionStyle)
+      {
+        case PARTITION_STYLE_MBR: {
           info->GPT = false;
           info->MBR_Boot = block.Mbr.BootIndicator;
           
           break;
         }
         
-        case PARTITION_STYLE_GPT: {
-          info->GPT = true;
-          
-          if (IsEqualGUID(block.Gpt.PartitionType, PARTITION_ENTRY_UNUSED_GUID)) {
-            info->GPT_Type = "PARTITION_ENTRY_UNUSED_GUID";
-          } else if (IsEqualGUID(block.Gpt.PartitionType, PARTITION_MSFT_RECOVERY_GUID)) {
-            info->GPT_Type = "PARTITION_MSFT_RECOVERY_GUID";
-          } else if (IsEqualGUID(block.Gpt.PartitionType, PARTITION_BASIC_DATA_GUID)) {
-            info->GPT_Type = "PARTITION_BASIC_DATA_GUID";
-          } else if (IsEqualGUID(block.Gpt.PartitionType, PARTITION_SYSTEM_GUID)) {
-            info->GPT_Type = "PARTITION_SYSTEM_GUID";
-          }
-          
-          break;
-        }
+        case PARTITION_STYLE_GPT: {
+          info->GPT = true;
+          
+          auto type_name = GetGPTTypeName((const uint8_t *) &block.Gpt.PartitionType);
+          info->GPT_Type = type_name ? type_name : FormatGUID((const uint8_t *) &block.Gpt.PartitionType);
+          
+          break;
+        }
+        
+        case PARTITION_STYLE_RAW: {
+          /* ?? */
+          break;
+        }
+      }
+      
+      info->size = block.PartitionLength.QuadPart;
+      info->offset = block.StartingOffset.QuadPart;
+      info->number = block.PartitionNumber;
+    }
+  }
+}
+
+DriveInfo GetDriveDataFromGUID(const char *GUID)
+{
+  TRACE_SCOPE("GetDriveDataFromGUID");
+  
+  // CreateFile() doesn't allow the trailing '\\' when opening device(s) as GUID. Strip it out.
+  std::string name(GUID);
+  if (name[name.length() - 1] == '\\')
+    name.pop_back();
+  
+  DriveInfo info;
+  HANDLE handle = CreateFile(name.c_str(), GENERIC_READ, FILE_SHARE_WRITE | FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, nullptr);
+
+  if (handle != INVALID_HANDLE_VALUE) {
+    // Name
+    info.name = name;
+    
+    // info.size, info.offset, info.number, info.GPT will be available after this call
+    GetAdditionalPartitionInfo(&info, handle);
+    
+    // info.sectors, info.fs will be available after this call
+    GetPartitionFSData_GUID(&info, handle);
+    
+    // info.disk will be available after this call
+    GetPartitionParentDevice(&info, handle);
+
+    CloseHandle(handle);
+  }
+  
+  return info;
+}
+
+DriveInfo GetDriveDataFromLetter(const char *p)
+{
+  TRACE_SCOPE("GetDriveDataFromLetter");
+  
+  // Turn the raw drive letter query into something CreateFile() can digest
+  // (i. e. \\?\Volume{GUID_ID}\ -> \\.\\\?\Volume{GUID_ID})
+  auto query = std::string("\\\\.\\") + p;
+  query.pop_back();
+  
+  DriveInfo info;
+  HANDLE handle = CreateFile(query.c_str(), GENERIC_READ, FILE_SHARE_WRITE | FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, nullptr);
+
+  if (handle != INVALID_HANDLE_VALUE) {
+    // Name
+    std::string name(query);
+    name.erase(0, 4);
+    info.name = name;
+    
+    // info.size, info.offset, info.number, info.GPT will be available after this call
+    GetAdditionalPartitionInfo(&info, handle);
+    
+    // info.sectors, info.fs will be available after this call
+    GetPartitionFSData_Letter(&info, handle);
+    
+    // info.disk will be available after this call
+    GetPartitionParentDevice(&info, handle);
+    
+    
+    CloseHandle(handle);
+  }
+  
+  return info;
+}
+
+// Try to extract the "representable" name for the given volume GUID to be used. Returns empty if 
+// the volume doesn't have a letter assigned, or it's the system recovery volume.
+static std::string ExtractDriveNameFromGUID(const char *name)
+{
+  DWORD size = 16;
+  BOOL success = FALSE;
+  uint8_t round = 16;
+  
+  for (uint8_t i = 0; i < round; ++i) {
+    char buffer[16];
+    success = GetVolumePathNamesForVolumeNameA(name, buffer, size, nullptr);
+    if (success == TRUE) {
+      return std::string(buffer);
+    } else {
+      if (GetLastError() == ERROR_MORE_DATA)
+        size *= 2;
+    }
+  }
+  
+  return std::string();
+}
+
+struct GPTHeader {
+  uint64_t current_lba;
+  uint64_t backup_lba;
+  uint64_t first_usable_lba;
+  uint64_t last_usable_lba;
+  uint64_t entries_lba;
+  uint32_t entry_count;
+  uint32_t entry_size;
+  uint32_t entries_crc32;
+  uint8_t disk_guid[16];
+};
+
+// Reads and validates (signature, header CRC, location, entry geometry) the GPT header stored at the given LBA.
+static bool ReadGPTHeader(BlockDevice &device, uint64_t lba, GPTHeader *header)
+{
+  const auto sector_size = device.GetSectorSize();
+  std::vector<uint8_t> buffer(sector_size);
+  
+  if (!device.Read(lba * sector_size, buffer.data(), sector_size) || memcmp(buffer.data(), "EFI PART", 8) != 0)
+    return false;
+  
+  auto header_size = LoadLE<uint32_t>(&buffer[12]);
+  if (header_size < 92 || header_size > sector_size)
+    return false;
+  
+  // The CRC covers the header with its own CRC field zeroed
+  auto crc = LoadLE<uint32_t>(&buffer[16]);
+  memset(&buffer[16], 0, 4);
+  if (CRC32(buffer.data(), header_size) != crc)
+    return false;
+  
+  header->current_lba = LoadLE<uint64_t>(&buffer[24]);
+  header->backup_lba = LoadLE<uint64_t>(&buffer[32]);
+  header->first_usable_lba = LoadLE<uint64_t>(&buffer[40]);
+  header->last_usable_lba = LoadLE<uint64_t>(&buffer[48]);
+  memcpy(header->disk_guid, &buffer[56], 16);
+  header->entries_lba = LoadLE<uint64_t>(&buffer[72]);
+  header->entry_count = LoadLE<uint32_t>(&buffer[80]);
+  header->entry_size = LoadLE<uint32_t>(&buffer[84]);
+  header->entries_crc32 = LoadLE<uint32_t>(&buffer[88]);
+  
+  // Entries are at least 128 bytes and a multiple of 8. Anything beyond a few MiB of entries is corruption.
+  return header->current_lba == lba && header->entry_size >= 128 && header->entry_size % 8 == 0 &&
+    (uint64_t) header->entry_count * header->entry_size <= 4 * 1024 * 1024;
+}
+
+// Reads the whole partition entry array with a single read, and validates its CRC.
+static bool ReadGPTEntries(BlockDevice &device, const GPTHeader &header, std::vector<uint8_t> *entries)
+{
+  entries->resize((size_t) header.entry_count * header.entry_size);
+  
+  return device.Read(header.entries_lba * device.GetSectorSize(), entries->data(), entries->size()) &&
+    CRC32(entries->data(), entries->size()) == header.entries_crc32;
+}
+
+// Decodes the GPT of the device into info.partition. The primary header (LBA 1) is used when it and its entry array
+// pass their CRC checks, otherwise the backup at the end of the disk. Returns false if neither is intact.
+static bool ReadGPT(BlockDevice &device, DeviceInfo &info)
+{
+  TRACE_SCOPE("ReadGPT");
+  
+  const auto sector_size = device.GetSectorSize();
+  const uint64_t last_lba = device.GetSize() / sector_size - 1;
+  
+  GPTHeader header;
+  std::vector<uint8_t> entries;
+  bool primary = ReadGPTHeader(device, 1, &header);
+  
+  if (!primary || !ReadGPTEntries(device, header, &entries)) {
+    // The primary header tells where its backup is. If it's unreadable, the backup is expected on the last LBA.
+    auto backup_lba = primary ? header.backup_lba : last_lba;
+    
+    if (!ReadGPTHeader(device, backup_lba, &header) || !ReadGPTEntries(device, header, &entries))
+      return false;
+    
+    info.GPT_backup = true;
+  }
+  
+  info.scheme = "GPT";
+  info.disk_guid = FormatGUID(header.disk_guid);
+  
+  for (uint32_t i = 0; i < header.entry_count; ++i) {
+    const uint8_t *entry = &entries[(size_t) i * header.entry_size];
+    
+    static const uint8_t unused[16] = {0};
+    if (memcmp(entry, unused, 16) == 0)
+      continue;
+    
+    PartitionRecord partition;
+    partition.index = i + 1;
+    partition.type_guid = FormatGUID(entry);
+    partition.unique_guid = FormatGUID(entry + 16);
+    partition.first_lba = LoadLE<uint64_t>(entry + 32);
+    partition.last_lba = LoadLE<uint64_t>(entry + 40);
+    partition.attributes = LoadLE<uint64_t>(entry + 48);
+    partition.name = UTF16ToUTF8(entry + 56, 36);
+    
+    auto type_name = GetGPTTypeName(entry);
+    partition.type_name = type_name ? type_name : partition.type_guid;
+    
+    // Bit 2 is "legacy BIOS bootable"
+    partition.bootable = (partition.attributes & 4) != 0;
+    
+    info.partition.push_back(partition);
+  }
+  
+  return true;
+}
+
+// Decodes an MBR partition table into info.partition: the four primary entries, then the logical partitions of the
+// extended partition by following its EBR chain. Each EBR links to the next one relative to the start of the extended
+// partition; the walk stops on a repeated or out-of-range link, so a corrupt or cyclic chain cannot hang the probe.
+static void ReadMBR(BlockDevice &device, DeviceInfo &info, const uint8_t *sector)
+{
+  TRACE_SCOPE("ReadMBR");
+  
+  const auto sector_size = device.GetSectorSize();
+  const uint64_t sectors = device.GetSize() / sector_size;
+  
+  info.scheme = "MBR";
+  
+  auto AddPartition = [&] (const uint8_t *entry, uint32_t index, uint64_t base, bool logical) {
+    PartitionRecord partition;
+    partition.index = index;
+    partition.mbr_type = entry[4];
+    partition.bootable = entry[0] == 0x80;
+    partition.logical = logical;
+    partition.first_lba = base + LoadLE<uint32_t>(entry + 8);
+    partition.last_lba = partition.first_lba + LoadLE<uint32_t>(entry + 12) - 1;
+    
+    auto type = MBRPartitionType().find(partition.mbr_type);
+    if (type != MBRPartitionType().end()) {
+      partition.type_name = type->second;
+    } else {
+      char text[16];
+      snprintf(text, sizeof(text), "0x%02x", partition.mbr_type);
+      partition.type_name = text;
+    }
+    
+    info.partition.push_back(partition);
+  };
+  
+  uint64_t extended_lba = 0;
+  uint64_t extended_end = 0;
+  
+  for (uint32_t i = 0; i < 4; ++i) {
+    const uint8_t *entry = sector + 446 + 16 * i;
+    if (entry[4] == 0x00 || LoadLE<uint32_t>(entry + 12) == 0)
+      continue;
+    
+    AddPartition(entry, i + 1, 0, false);
+    
+    if (IsExtendedPartition(entry[4]) && extended_lba == 0) {
+      extended_lba = LoadLE<uint32_t>(entry + 8);
+      extended_end = extended_lba + LoadLE<uint32_t>(entry + 12);
+    }
+  }
+  
+  if (extended_lba == 0)
+    return;
+  
+  // EBRs are usually close together, so they are read through a window of several sectors instead of one read each
+  const uint32_t window_sectors = 64;
+  std::vector<uint8_t> window((size_t) window_sectors * sector_size);
+  uint64_t window_lba = 0;
+  uint64_t window_count = 0;
+  
+  auto ReadSector = [&] (uint64_t lba) -> const uint8_t * {
+    if (lba < window_lba || lba >= window_lba + window_count) {
+      window_count = std::min<uint64_t>(window_sectors, std::min(extended_end, sectors) - lba);
+      window_lba = lba;
+      
+      if (!device.Read(lba * sector_size, window.data(), (size_t) window_count * sector_size)) {
+        window_count = 0;
+        return nullptr;
+      }
+    }
+    
+    return &window[(size_t) (lba - window_lba) * sector_size];
+  };
+  
+  std::unordered_set<uint64_t> visited;
+  uint64_t ebr_lba = extended_lba;
+  uint32_t index = 5; // Logical partitions are numbered from 5, as on Linux
+  
+  // An extended partition can't hold more EBRs than sectors, but cap the walk at something reasonable anyway
+  while (ebr_lba >= extended_lba && ebr_lba < std::min(extended_end, sectors) && visited.size() < 1024) {
+    if (!visited.insert(ebr_lba).second) {
+      ConsolePrint("EBR chain loops back to LBA %" PRIu64 "\n", ebr_lba);
+      break;
+    }
+    
+    const uint8_t *ebr = ReadSector(ebr_lba);
+    if (ebr == nullptr || ebr[510] != 0x55 || ebr[511] != 0xAA)
+      break;
+    
+    // Entry 0 is the logical partition, relative to this EBR
+    const uint8_t *entry = ebr + 446;
+    if (entry[4] != 0x00 && LoadLE<uint32_t>(entry + 12) != 0)
+      AddPartition(entry, index++, ebr_lba, true);
+    
+    // Entry 1 links to the next EBR, relative to the start of the extended partition
+    const uint8_t *next = ebr + 446 + 16;
+    if (!IsExtendedPartition(next[4]) || LoadLE<uint32_t>(next + 8) == 0)
+      break;
+    
+    ebr_lba = extended_lba + LoadLE<uint32_t>(next + 8);
+  }
+}
+
+// Reads the partition table of the given device into info.partition. GPT is told apart from MBR by the protective 0xEE
+// partition, so no device IOCTL is needed and images work as well.
+static void ReadPartitionTable(BlockDevice &device, DeviceInfo &info, const char *drive)
+{
+  TRACE_SCOPE("ReadPartitionTable");
+  
+  const auto sector_size = device.GetSectorSize();
+  std::vector<char> buffer(sector_size);
+  
+  // LBA 0, either the MBR or the protective MBR of a GPT disk
+  if (sector_size < 512 || !device.Read(0, buffer.data(), sector_size))
+    return;
+  
+  bool GPT = false;
+  for (int i = 0; i < 4; ++i) {
+    if ((uint8_t) buffer[446 + (16 * i) + 4] == 0xEE)
+      GPT = true;
+  }
+  
+  if (GPT) {
+    if (!ReadGPT(device, info))
+      ConsolePrint("%s: neither the primary nor the backup GPT is valid\n", drive);
+  } else if ((uint8_t) buffer[510] == 0x55 && (uint8_t) buffer[511] == 0xAA) {
+    ReadMBR(device, info, (const uint8_t *) buffer.data());
+  }
+}
+
+// Identifies the filesystem of every partition in info.partition
+static void ProbePartitionFileSystems(BlockDevice &device, DeviceInfo &info)
+{
+  TRACE_SCOPE("ProbePartitionFileSystems");
+  
+  const auto sector_size = device.GetSectorSize();
+  
+  // The heads of all partitions go out as one batch, so neighbouring small partitions share a transfer
+  std::vector<uint8_t> heads(info.partition.size() * FileSystemHeadSize);
+  std::vector<ReadRequest> requests;
+  std::vector<bool> probed(info.partition.size(), false);
+  
+  for (size_t i = 0; i < info.partition.size(); ++i) {
+    const auto &partition = info.partition[i];
+    if (IsExtendedPartition(partition.mbr_type) || !partition.HasValidRange() || partition.first_lba > device.GetSize() / sector_size ||
+        partition.first_lba * sector_size + FileSystemHeadSize > device.GetSize())
+      continue;
+    
+    requests.push_back({ partition.first_lba * sector_size, &heads[i * FileSystemHeadSize], FileSystemHeadSize });
+    probed[i] = true;
+  }
+  
+  // A failed read leaves zeroes, which no decoder matches
+  device.ReadBatch(requests);
+  
+  for (size_t i = 0; i < info.partition.size(); ++i) {
+    if (probed[i])
+      ProbeFileSystem(device, info.partition[i].first_lba * sector_size, &info.partition[i].fs, &heads[i * FileSystemHeadSize]);
+  }
+}
+
+// Extracts typical device properties from a PhysicalDrive-based query.
+// Probes many devices at once. Rather than walking each device with a chain of synchronous reads, every read a probe
+// is known to need is issued up front as overlapped I/O on a completion port, and devices advance as their reads
+// complete:
+//   1. the first 64 KiB (MBR, GPT header and entries) of every device,
+//   2. once a device's partition table is decoded, the filesystem regions (see ProbeFileSystem()) of all its partitions,
+//   3. once those are in, the filesystems are decoded.
+// Completed reads go to the device's cache with AddPrefetched(), the decoders then run unchanged and only fall back to
+// synchronous reads for what wasn't predicted (EBR chains, a backup GPT). On slow or remote storage the latencies of
+// all devices overlap instead of adding up.
+class ProbeEngine {
+  struct Target {
+    BlockDevice *device;
+    DeviceInfo *info;
+    std::string name;
+    bool async = false;
+    int stage = 0;
+    size_t pending = 0;
+  };
+  
+  struct Request {
+    OVERLAPPED overlapped; // Completions are mapped back to the request from it with CONTAINING_RECORD
+    Target *target;
+    uint64_t offset;
+    std::shared_ptr<AlignedBuffer> buffer;
+  };
+  
+  HANDLE port = nullptr;
+  std::vector<std::unique_ptr<Target>> targets;
+  size_t outstanding = 0;
+  
+  void Submit(Target &target, uint64_t offset, size_t length)
+  {
+    auto &device = *target.device;
+    auto alignment = device.GetAlignment();
+    auto block_size = device.GetCache().GetBlockSize();
+    
+    if (!target.async || offset >= device.GetSize())
+      return;
+    
+    // Whole cache blocks, so all of it can be cached. The last block may be cut short at the end of the device.
+    auto start = offset / block_size * block_size;
+    auto end = std::min<uint64_t>((offset + length + block_size - 1) / block_size * block_size, (device.GetSize() + alignment - 1) / alignment * alignment);
+    
+    auto request = new Request();
+    request->target = &target;
+    request->offset = start;
+    request->buffer = std::make_shared<AlignedBuffer>((size_t) (end - start));
+    request->overlapped.Offset = (DWORD) start;
+    request->overlapped.OffsetHigh = (DWORD) (start >> 32);
+    
+    if (request->buffer->Get() == nullptr ||
+        (!ReadFile(device.GetHandle(), request->buffer->Get(), (DWORD) (end - start), nullptr, &request->overlapped) && GetLastError() != ERROR_IO_PENDING)) {
+      // The decoders will simply read it again synchronously
+      delete request;
+      return;
+    }
+    
+    ++target.pending;
+    ++outstanding;
+  }
+  
+  void Advance(Target &target)
+  {
+    if (target.stage == 0) {
+      target.stage = 1;
+      ReadPartitionTable(*target.device, *target.info, target.name.c_str());
+      
+      for (const auto &partition : target.info->partition) {
+        if (!partition.HasValidRange())
+          continue;
+        
+        auto offset = partition.first_lba * target.device->GetSectorSize();
+        Submit(target, offset, FileSystemHeadSize);
+        Submit(target, offset + 65536, FileSystemHeadSize);
+      }
+      
+      if (target.pending != 0)
+        return;
+    }
+    
+    target.stage = 2;
+    ProbePartitionFileSystems(*target.device, *target.info);
+  }
+  
+public:
+  ProbeEngine()
+  {
+    port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1);
+  }
+  
+  ~ProbeEngine()
+  {
+    if (port != nullptr)
+      CloseHandle(port);
+  }
+  
+  // The device's handle has to be opened with FILE_FLAG_OVERLAPPED to be read asynchronously, otherwise (or when the
+  // handle can't be associated with the port) the device is probed synchronously right away.
+  void Add(BlockDevice &device, DeviceInfo &info, const char *name)
+  {
+    targets.emplace_back(new Target());
+    auto &target = *targets.back();
+    target.device = &device;
+    target.info = &info;
+    target.name = name;
+    target.async = port != nullptr && CreateIoCompletionPort(device.GetHandle(), port, 0, 0) != nullptr;
+    
+    Submit(target, 0, 65536);
+    
+    if (target.pending == 0)
+      Advance(target);
+  }
+  
+  // When the port fails, the reads still in flight are cancelled and their completions collected: the caller closes the
+  // handles and frees the buffers right after Run(), the kernel must be done with every one of them by then. Requests
+  // whose completion doesn't arrive even so are leaked, buffer and all, rather than freed under a pending read.
+  void CancelOutstanding()
+  {
+    for (const auto &target : targets) {
+      if (target->async)
+        CancelIoEx(target->device->GetHandle(), nullptr);
+    }
+    
+    while (outstanding > 0) {
+      DWORD transferred = 0;
+      ULONG_PTR key = 0;
+      LPOVERLAPPED overlapped = nullptr;
+      
+      GetQueuedCompletionStatus(port, &transferred, &key, &overlapped, 5000);
+      if (overlapped == nullptr)
+        break;
+      
+      delete CONTAINING_RECORD(overlapped, Request, overlapped);
+      --outstanding;
+    }
+  }
+  
+  // Processes completions until every device is probed
+  void Run()
+  {
+    TRACE_SCOPE("ProbeEngine::Run");
+    
+    while (outstanding > 0) {
+      DWORD transferred = 0;
+      ULONG_PTR key = 0;
+      LPOVERLAPPED overlapped = nullptr;
+      
+      BOOL success = GetQueuedCompletionStatus(port, &transferred, &key, &overlapped, INFINITE);
+      if (overlapped == nullptr) {
+        CancelOutstanding();
+        return;
+      }
+      
+      auto request = CONTAINING_RECORD(overlapped, Request, overlapped);
+      auto &target = *request->target;
+      --outstanding;
+      
+      // A short read is the end of the file, the rest is zeroes like BlockDevice::Read() would have
+      if (success) {
+        memset(request->buffer->Get() + transferred, 0, request->buffer->GetSize() - transferred);
+        target.device->AddPrefetched(request->offset, request->buffer->Get(), request->buffer->GetSize());
+      }
+      
+      delete request;
+      
+      if (--target.pending == 0)
+        Advance(target);
+    }
+  }
+};
+
+// Opens a PhysicalDrive for ProbeEngine (overlapped and unbuffered) and fills in its geometry. The partitions are
+// probed later on, through the returned handle, which the caller closes.
+static DeviceInfo ExtractDeviceInfoFromQuery(const char *drive, HANDLE *handle)
+{
+  TRACE_SCOPE("ExtractDeviceInfoFromQuery");
+  
+  HANDLE hDevice = INVALID_HANDLE_VALUE;  // handle to the drive to be examined 
+  BOOL result   = FALSE;                 // results flag
+  DWORD junk     = 0;                     // discard results
+  DeviceInfo device;
+  
+  hDevice = CreateFileA(drive, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED, nullptr);
+  *handle = hDevice;
+  
+  if (hDevice != INVALID_HANDLE_VALUE) {
+    
+    // Gather DISK_GEOMETRY data
+    {
+      DISK_GEOMETRY surface;
+      
+      if ((result = IoControl(hDevice, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0, &surface, sizeof(surface), &junk)) == TRUE) {
+        device.sector_size = surface.BytesPerSector;
+        device.cylinders = surface.Cylinders.QuadPart;
+        device.sectors = surface.SectorsPerTrack * surface.TracksPerCylinder * surface.Cylinders.QuadPart;
+      }
+    }
+    
+    // Gather device type. Devices without a seek penalty are solid state, TRIM support tells when that isn't reported.
+    {
+      STORAGE_PROPERTY_QUERY query = {};
+      query.PropertyId = StorageDeviceSeekPenaltyProperty;
+      query.QueryType = PropertyStandardQuery;
+      
+      DEVICE_SEEK_PENALTY_DESCRIPTOR seek_penalty = {0};
+      DEVICE_TRIM_DESCRIPTOR trim = {0};
+      
+      if (IoControl(hDevice, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query), &seek_penalty, sizeof(seek_penalty), &junk) && junk >= sizeof(seek_penalty)) {
+        device.SSD = !seek_penalty.IncursSeekPenalty;
+      } else {
+        query.PropertyId = StorageDeviceTrimProperty;
+        if (IoControl(hDevice, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query), &trim, sizeof(trim), &junk) && junk >= sizeof(trim))
+          device.SSD = trim.TrimEnabled;
+      }
+    }
+    
+    device.valid = true;
+  } else {
+    device.valid = false;
+  }
+  
+  return device;
+}
+
+// Probes the partitions and filesystems of PhysicalDrives (`images` false) or raw disk image files, all at once through
+// ProbeEngine. The result has one entry per path, invalid for the ones that couldn't be opened.
+static std::vector<DeviceInfo> ProbeDevices(const VectorString &paths, bool images)
+{
+  TRACE_SCOPE("ProbeDevices");
+  
+  std::vector<DeviceInfo> devices(paths.size());
+  std::vector<std::unique_ptr<BlockDevice>> readers(paths.size());
+  std::vector<HANDLE> handles;
+  ProbeEngine engine;
+  
+  for (size_t i = 0; i < paths.size(); ++i) {
+    auto &device = devices[i];
+    
+    if (images) {
+      auto image = new BlockDevice_Image(paths[i].c_str(), FILE_FLAG_OVERLAPPED);
+      readers[i].reset(image);
+      
+      if (!image->IsOpen())
+        continue;
+      
+      device.sector_size = image->GetSectorSize();
+      device.sectors = image->GetSize() / image->GetSectorSize();
+      device.path = paths[i];
+      device.valid = true;
+    } else {
+      HANDLE handle;
+      device = ExtractDeviceInfoFromQuery(paths[i].c_str(), &handle);
+      
+      if (!device.valid)
+        continue;
+      
+      handles.push_back(handle);
+      readers[i].reset(new BlockDevice_Handle(handle, device.sector_size));
+    }
+    
+    engine.Add(*readers[i], device, paths[i].c_str());
+  }
+  
+  engine.Run();
+  
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (readers[i]) {
+      devices[i].cache_hits = readers[i]->GetCache().hits;
+      devices[i].cache_misses = readers[i]->GetCache().misses;
+    }
+  }
+  
+  for (auto handle : handles)
+    CloseHandle(handle);
+  
+  return devices;
+}
+
+// Lists the PhysicalDrives along with their volumes. Every volume is enumerated and probed exactly once and grouped by
+// its parent disk number, instead of re-enumerating (and re-opening) every volume for every drive. The drive and volume
+// probes are all independent, so they run concurrently on the worker pool. EFI system partitions aren't listed yet.
+std::vector<DeviceInfo> ListDisk()
+{
+  TRACE_SCOPE("ListDisk");
+  
+  const int drive_count = 16;
+  
+  // Volume GUID paths, i. e. \\?\Volume{7b1b4990-1a6a-01d4-c824-8c1d350dea00}\ (with the trailing backslash)
+  VectorString volumes;
+  
+  {
+    char buffer[256];
+    HANDLE h = FindFirstVolumeA(buffer, 256);
+    
+    if (h != INVALID_HANDLE_VALUE) {
+      do {
+        auto length = strlen(buffer);
+        
+        // Verify if the GUID is actually in the correct format
+        if (buffer[0] == '\\' && buffer[1] == '\\' && buffer[2] == '?' && buffer[3] == '\\' && buffer[length - 1] == '\\')
+          volumes.push_back(buffer);
+      } while (FindNextVolumeA(h, buffer, 256) == TRUE);
+      
+      FindVolumeClose(h);
+    }
+  }
+  
+  VectorString paths;
+  for (int i = 0; i < drive_count; ++i)
+    paths.push_back(std::string("\\\\.\\PhysicalDrive") + std::to_string(i));
+  
+  std::vector<DeviceInfo> devices;
+  std::vector<DriveInfo> drives(volumes.size());
+  
+  // Item 0 probes all the PhysicalDrives (they're asynchronous already), the rest probe one volume each
+  Workers().ParallelFor(1 + volumes.size(), [&devices, &drives, &volumes, &paths] (size_t i) -> void {
+    if (i == 0) {
+      devices = ProbeDevices(paths, false);
+      return;
+    }
+    
+    const auto &volume = volumes[i - 1];
+    
+    // Try to get the partition's drive letter (F:\, E:\, A:\), etc. from GUID. A named, fully functional, healthy
+    // partition is queried by its letter, anything else (i. e. system partition) by its GUID.
+    auto drive_letter = ExtractDriveNameFromGUID(volume.c_str());
+    
+    if (drive_letter != std::string())
+      drives[i - 1] = GetDriveDataFromLetter(drive_letter.c_str());
+    else
+      drives[i - 1] = GetDriveDataFromGUID(volume.c_str());
+  });
+  
+  std::unordered_map<unsigned, std::vector<DriveInfo>> by_disk;
+  for (auto &drive : drives)
+    by_disk[drive.disk].push_back(std::move(drive));
+  
+  std::vector<DeviceInfo> v;
+  for (int i = 0; i < drive_count; ++i) {
+    if (!devices[i].valid)
+      continue;
+    
+    auto it = by_disk.find(i);
+    if (it != by_disk.end())
+      devices[i].drive = std::move(it->second);
+    
+    devices[i].number = i;
+    v.push_back(std::move(devices[i]));
+  }
+  
+  return v;
+}
+
+// CPU features the hashing kernels are picked by, queried once
+struct CPUFeatures {
+  bool SSE2 = false;
+  bool SSSE3 = false;
+  bool SSE41 = false;
+  bool SHA = false;
+};
+
+static const CPUFeatures &GetCPUFeatures()
+{
+  static const CPUFeatures features = [] () -> CPUFeatures {
+    CPUFeatures f;
+    int regs[4] = {0};
+    
+    auto CPUID = [&regs] (int leaf, int subleaf) -> void {
+#ifdef _MSC_VER
+      __cpuidex(regs, leaf, subleaf);
+#else
+      unsigned a, b, c, d;
+      __cpuid_count(leaf, subleaf, a, b, c, d);
+      regs[0] = (int) a; regs[1] = (int) b; regs[2] = (int) c; regs[3] = (int) d;
+#endif
+    };
+    
+    CPUID(0, 0);
+    int max_leaf = regs[0];
+    
+    CPUID(1, 0);
+    f.SSE2 = (regs[3] & (1 << 26)) != 0;
+    f.SSSE3 = (regs[2] & (1 << 9)) != 0;
+    f.SSE41 = (regs[2] & (1 << 19)) != 0;
+    
+    if (max_leaf >= 7) {
+      CPUID(7, 0);
+      f.SHA = (regs[1] & (1 << 29)) != 0;
+    }
+    
+    return f;
+  }();
+  
+  return features;
+}
+
+// GCC and Clang only emit SIMD instructions in functions marked for them, MSVC needs nothing
+#ifdef _MSC_VER
+#define TARGET(features)
+#else
+#define TARGET(features) __attribute__((target(features)))
+#endif
+
+static const uint32_t SHA256_K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+// Also BLAKE3's IV
+static const uint32_t SHA256_IV[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static inline uint32_t RotateRight(uint32_t x, int n)
+{
+  return (x >> n) | (x << (32 - n));
+}
+
+static void SHA256_Compress_Scalar(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+  for (; blocks > 0; --blocks, data += 64) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i)
+      w[i] = LoadBE<uint32_t>(data + 4 * i);
+    
+    for (int i = 16; i < 64; ++i) {
+      uint32_t s0 = RotateRight(w[i - 15], 7) ^ RotateRight(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = RotateRight(w[i - 2], 17) ^ RotateRight(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+    
+    for (int i = 0; i < 64; ++i) {
+      uint32_t t1 = h + (RotateRight(e, 6) ^ RotateRight(e, 11) ^ RotateRight(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+      uint32_t t2 = (RotateRight(a, 2) ^ RotateRight(a, 13) ^ RotateRight(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      h = g; g = f; f = e; e = d + t1;
+      d = c; c = b; b = a; a = t1 + t2;
+    }
+    
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+  }
+}
+
+// SHA extensions (Goldmont, Zen and later): two rounds per instruction, the message schedule in hardware as well
+TARGET("sha,ssse3,sse4.1")
+static void SHA256_Compress_SHANI(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+  const __m128i byteswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  
+  // The instructions want the state as ABEF and CDGH
+  __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[0]), 0xB1);
+  __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[4]), 0x1B);
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+  
+  for (; blocks > 0; --blocks, data += 64) {
+    __m128i abef = state0;
+    __m128i cdgh = state1;
+    __m128i message[4];
+    
+    for (int i = 0; i < 4; ++i)
+      message[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16 * i)), byteswap);
+    
+    // 16 groups of 4 rounds. Group i + 4's message words are derived from those of groups i to i + 3.
+    for (int i = 0; i < 16; ++i) {
+      __m128i m = _mm_add_epi32(message[i & 3], _mm_loadu_si128((const __m128i *) &SHA256_K[4 * i]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(m, 0x0E));
+      
+      if (i < 12) {
+        __m128i w = _mm_sha256msg1_epu32(message[i & 3], message[(i + 1) & 3]);
+        w = _mm_add_epi32(w, _mm_alignr_epi8(message[(i + 3) & 3], message[(i + 2) & 3], 4));
+        message[i & 3] = _mm_sha256msg2_epu32(w, message[(i + 3) & 3]);
+      }
+    }
+    
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+  }
+  
+  tmp = _mm_shuffle_epi32(state0, 0x1B);
+  state1 = _mm_shuffle_epi32(state1, 0xB1);
+  _mm_storeu_si128((__m128i *) &state[0], _mm_blend_epi16(tmp, state1, 0xF0));
+  _mm_storeu_si128((__m128i *) &state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+
+class SHA256 {
+  uint32_t state[8];
+  uint8_t block[64];
+  size_t block_length = 0;
+  uint64_t length = 0;
+  void (*compress)(uint32_t *, const uint8_t *, size_t);
+  
+public:
+  SHA256()
+  {
+    memcpy(state, SHA256_IV, sizeof(state));
+    compress = GetCPUFeatures().SHA && GetCPUFeatures().SSE41 ? SHA256_Compress_SHANI : SHA256_Compress_Scalar;
+  }
+  
+  const char *GetImplementation() const
+  {
+    return compress == SHA256_Compress_SHANI ? "SHA-NI" : "scalar";
+  }
+  
+  void Update(const uint8_t *data, size_t size)
+  {
+    length += size;
+    
+    if (block_length > 0) {
+      auto take = std::min(size, 64 - block_length);
+      memcpy(block + block_length, data, take);
+      block_length += take;
+      data += take;
+      size -= take;
+      
+      if (block_length < 64)
+        return;
+      
+      compress(state, block, 1);
+      block_length = 0;
+    }
+    
+    compress(state, data, size / 64);
+    data += size / 64 * 64;
+    size %= 64;
+    
+    memcpy(block, data, size);
+    block_length = size;
+  }
+  
+  void Final(uint8_t digest[32])
+  {
+    uint64_t bits = length * 8;
+    uint8_t padding[72] = { 0x80 };
+    size_t pad = (block_length < 56 ? 56 : 120) - block_length;
+    
+    for (int i = 0; i < 8; ++i)
+      padding[pad + i] = (uint8_t) (bits >> (56 - 8 * i));
+    
+    Update(padding, pad + 8);
+    
+    for (int i = 0; i < 8; ++i) {
+      for (int j = 0; j < 4; ++j)
+        digest[4 * i + j] = (uint8_t) (state[i] >> (24 - 8 * j));
+    }
+  }
+};
+
+// BLAKE3 (hash mode, 32-byte output). The input is split into 1 KiB chunks hashed independently, and their chaining
+// values are combined as a binary tree, so large inputs hash on all cores and several chunks per SIMD register.
+namespace Blake3 {
+  const size_t ChunkSize = 1024;
+  const size_t SubtreeChunks = 64; // What one worker hashes at once, 64 KiB
+  
+  enum {
+    CHUNK_START = 1,
+    CHUNK_END = 2,
+    PARENT = 4,
+    ROOT = 8,
+  };
+  
+  static const uint8_t Permutation[16] = { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 };
+  
+  // The message schedule of each of the 7 rounds, i. e. the permutation applied 0 to 6 times
+  static const uint8_t *GetSchedule()
+  {
+    static const auto schedule = [] () -> std::vector<uint8_t> {
+      std::vector<uint8_t> s(7 * 16);
+      for (int i = 0; i < 16; ++i)
+        s[i] = (uint8_t) i;
+      
+      for (int r = 1; r < 7; ++r) {
+        for (int i = 0; i < 16; ++i)
+          s[16 * r + i] = s[16 * (r - 1) + Permutation[i]];
+      }
+      
+      return s;
+    }();
+    
+    return schedule.data();
+  }
+  
+  static inline void G(uint32_t *v, int a, int b, int c, int d, uint32_t x, uint32_t y)
+  {
+    v[a] = v[a] + v[b] + x;
+    v[d] = RotateRight(v[d] ^ v[a], 16);
+    v[c] = v[c] + v[d];
+    v[b] = RotateRight(v[b] ^ v[c], 12);
+    v[a] = v[a] + v[b] + y;
+    v[d] = RotateRight(v[d] ^ v[a], 8);
+    v[c] = v[c] + v[d];
+    v[b] = RotateRight(v[b] ^ v[c], 7);
+  }
+  
+  // Compresses one 64-byte block into `cv`. The whole 16-word state is left in `out` when it's given.
+  static void Compress(uint32_t cv[8], const uint8_t block[64], uint64_t counter, uint32_t block_length, uint32_t flags, uint32_t *out = nullptr)
+  {
+    uint32_t m[16];
+    for (int i = 0; i < 16; ++i)
+      m[i] = LoadLE<uint32_t>(block + 4 * i);
+    
+    uint32_t v[16] = {
+      cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+      SHA256_IV[0], SHA256_IV[1], SHA256_IV[2], SHA256_IV[3],
+      (uint32_t) counter, (uint32_t) (counter >> 32), block_length, flags,
+    };
+    
+    const uint8_t *s = GetSchedule();
+    for (int r = 0; r < 7; ++r, s += 16) {
+      G(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+      G(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+      G(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+      G(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+      G(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+      G(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+      G(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+      G(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+    
+    if (out != nullptr) {
+      for (int i = 0; i < 8; ++i) {
+        out[i] = v[i] ^ v[i + 8];
+        out[i + 8] = v[i + 8] ^ cv[i];
+      }
+    }
+    
+    for (int i = 0; i < 8; ++i)
+      cv[i] = v[i] ^ v[i + 8];
+  }
+  
+  static void ParentCV(const uint32_t left[8], const uint32_t right[8], uint32_t flags, uint32_t out[8])
+  {
+    uint8_t block[64];
+    memcpy(block, left, 32);
+    memcpy(block + 32, right, 32);
+    
+    memcpy(out, SHA256_IV, 32);
+    Compress(out, block, 0, 64, PARENT | flags);
+  }
+  
+  static void ChunkCV_Scalar(const uint8_t *chunk, uint64_t counter, uint32_t out[8])
+  {
+    memcpy(out, SHA256_IV, 32);
+    for (int i = 0; i < 16; ++i)
+      Compress(out, chunk + 64 * i, counter, 64, (i == 0 ? CHUNK_START : 0) | (i == 15 ? CHUNK_END : 0));
+  }
+  
+  TARGET("sse2")
+  static inline __m128i Rotate16(__m128i x)
+  {
+    return _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xB1), 0xB1);
+  }
+  
+  TARGET("sse2")
+  static inline __m128i RotateRight4(__m128i x, int n)
+  {
+    return _mm_or_si128(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32 - n));
+  }
+  
+  TARGET("sse2")
+  static inline void G4(__m128i *v, int a, int b, int c, int d, __m128i x, __m128i y)
+  {
+    v[a] = _mm_add_epi32(_mm_add_epi32(v[a], v[b]), x);
+    v[d] = Rotate16(_mm_xor_si128(v[d], v[a]));
+    v[c] = _mm_add_epi32(v[c], v[d]);
+    v[b] = RotateRight4(_mm_xor_si128(v[b], v[c]), 12);
+    v[a] = _mm_add_epi32(_mm_add_epi32(v[a], v[b]), y);
+    v[d] = RotateRight4(_mm_xor_si128(v[d], v[a]), 8);
+    v[c] = _mm_add_epi32(v[c], v[d]);
+    v[b] = RotateRight4(_mm_xor_si128(v[b], v[c]), 7);
+  }
+  
+  TARGET("sse2")
+  static inline void Transpose(__m128i &a, __m128i &b, __m128i &c, __m128i &d)
+  {
+    __m128i ab_low = _mm_unpacklo_epi32(a, b);
+    __m128i ab_high = _mm_unpackhi_epi32(a, b);
+    __m128i cd_low = _mm_unpacklo_epi32(c, d);
+    __m128i cd_high = _mm_unpackhi_epi32(c, d);
+    
+    a = _mm_unpacklo_epi64(ab_low, cd_low);
+    b = _mm_unpackhi_epi64(ab_low, cd_low);
+    c = _mm_unpacklo_epi64(ab_high, cd_high);
+    d = _mm_unpackhi_epi64(ab_high, cd_high);
+  }
+  
+  // Four consecutive full chunks at once, one per 32-bit lane
+  TARGET("sse2")
+  static void ChunkCV_SSE2(const uint8_t *chunks, uint64_t counter, uint32_t out[4][8])
+  {
+    __m128i cv[8];
+    for (int i = 0; i < 8; ++i)
+      cv[i] = _mm_set1_epi32((int) SHA256_IV[i]);
+    
+    const __m128i counter_low = _mm_set_epi32((int) (uint32_t) (counter + 3), (int) (uint32_t) (counter + 2), (int) (uint32_t) (counter + 1), (int) (uint32_t) counter);
+    const __m128i counter_high = _mm_set_epi32((int) (uint32_t) ((counter + 3) >> 32), (int) (uint32_t) ((counter + 2) >> 32), (int) (uint32_t) ((counter + 1) >> 32), (int) (uint32_t) (counter >> 32));
+    
+    for (int block = 0; block < 16; ++block) {
+      // Word w of the block of every chunk, one chunk per lane
+      __m128i m[16];
+      for (int i = 0; i < 16; i += 4) {
+        for (int lane = 0; lane < 4; ++lane)
+          m[i + lane] = _mm_loadu_si128((const __m128i *) (chunks + lane * ChunkSize + block * 64 + i * 4));
+        Transpose(m[i], m[i + 1], m[i + 2], m[i + 3]);
+      }
+      
+      uint32_t flags = (block == 0 ? CHUNK_START : 0) | (block == 15 ? CHUNK_END : 0);
+      __m128i v[16] = {
+        cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+        _mm_set1_epi32((int) SHA256_IV[0]), _mm_set1_epi32((int) SHA256_IV[1]), _mm_set1_epi32((int) SHA256_IV[2]), _mm_set1_epi32((int) SHA256_IV[3]),
+        counter_low, counter_high, _mm_set1_epi32(64), _mm_set1_epi32((int) flags),
+      };
+      
+      const uint8_t *s = GetSchedule();
+      for (int r = 0; r < 7; ++r, s += 16) {
+        G4(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+        G4(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+        G4(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+        G4(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+        G4(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+        G4(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+        G4(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+        G4(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+      }
+      
+      for (int i = 0; i < 8; ++i)
+        cv[i] = _mm_xor_si128(v[i], v[i + 8]);
+    }
+    
+    // Back to one chaining value per chunk
+    Transpose(cv[0], cv[1], cv[2], cv[3]);
+    Transpose(cv[4], cv[5], cv[6], cv[7]);
+    
+    for (int lane = 0; lane < 4; ++lane) {
+      _mm_storeu_si128((__m128i *) &out[lane][0], cv[lane]);
+      _mm_storeu_si128((__m128i *) &out[lane][4], cv[lane + 4]);
+    }
+  }
+  
+  // Chaining value of the full subtree of `chunks` (a power of two) chunks starting at chunk `counter`. Never the root.
+  static void SubtreeCV(const uint8_t *data, size_t chunks, uint64_t counter, uint32_t out[8])
+  {
+    std::vector<uint32_t> cvs(chunks * 8);
+    size_t i = 0;
+    
+    if (GetCPUFeatures().SSE2) {
+      for (; i + 4 <= chunks; i += 4)
+        ChunkCV_SSE2(data + i * ChunkSize, counter + i, (uint32_t (*)[8]) &cvs[i * 8]);
+    }
+    
+    for (; i < chunks; ++i)
+      ChunkCV_Scalar(data + i * ChunkSize, counter + i, &cvs[i * 8]);
+    
+    for (; chunks > 1; chunks /= 2) {
+      for (size_t j = 0; j < chunks / 2; ++j)
+        ParentCV(&cvs[16 * j], &cvs[16 * j + 8], 0, &cvs[8 * j]);
+    }
+    
+    memcpy(out, cvs.data(), 32);
+  }
+}
+
+class BLAKE3 {
+  // The chunk being hashed
+  uint32_t chunk_cv[8];
+  uint64_t chunk_counter = 0;
+  uint8_t block[64];
+  size_t block_length = 0;
+  size_t blocks_compressed = 0;
+  
+  // Chaining values of completed subtrees, in the order they cover the input (54 levels is 2^64 bytes)
+  uint32_t stack[54][8];
+  size_t stack_length = 0;
+  
+  void ResetChunk()
+  {
+    memcpy(chunk_cv, SHA256_IV, 32);
+    block_length = 0;
+    blocks_compressed = 0;
+  }
+  
+  size_t GetChunkLength() const
+  {
+    return blocks_compressed * 64 + block_length;
+  }
+  
+  // Merges the stack down to one entry per set bit of the number of chunks it covers. Done lazily (before pushing,
+  // not after), so the last subtree is still on its own when Final() needs to mark the top of the tree as the root.
+  void MergeStack(uint64_t total_chunks)
+  {
+    size_t target = 0;
+    for (auto n = total_chunks; n != 0; n &= n - 1)
+      ++target;
+    
+    while (stack_length > target) {
+      ParentCV(stack[stack_length - 2], stack[stack_length - 1], 0, stack[stack_length - 2]);
+      --stack_length;
+    }
+  }
+  
+  static void ParentCV(const uint32_t left[8], const uint32_t right[8], uint32_t flags, uint32_t out[8])
+  {
+    uint32_t cv[8];
+    Blake3::ParentCV(left, right, flags, cv);
+    memcpy(out, cv, 32);
+  }
+  
+  void Push(const uint32_t cv[8], uint64_t chunks_before)
+  {
+    MergeStack(chunks_before);
+    memcpy(stack[stack_length++], cv, 32);
+  }
+  
+  void UpdateChunk(const uint8_t *data, size_t size)
+  {
+    while (size > 0) {
+      if (block_length == 64) {
+        Blake3::Compress(chunk_cv, block, chunk_counter, 64, blocks_compressed == 0 ? Blake3::CHUNK_START : 0);
+        ++blocks_compressed;
+        block_length = 0;
+      }
+      
+      auto take = std::min(size, 64 - block_length);
+      memcpy(block + block_length, data, take);
+      block_length += take;
+      data += take;
+      size -= take;
+    }
+  }
+  
+public:
+  BLAKE3()
+  {
+    ResetChunk();
+  }
+  
+  const char *GetImplementation() const
+  {
+    return GetCPUFeatures().SSE2 ? "SSE2 4-way" : "scalar";
+  }
+  
+  void Update(const uint8_t *data, size_t size)
+  {
+    while (size > 0) {
+      // A full chunk is only finished once more input shows up, the last one has to be compressed as CHUNK_END | ROOT
+      if (GetChunkLength() == Blake3::ChunkSize) {
+        uint32_t cv[8];
+        memcpy(cv, chunk_cv, 32);
+        Blake3::Compress(cv, block, chunk_counter, 64, Blake3::CHUNK_END | (blocks_compressed == 0 ? Blake3::CHUNK_START : 0));
+        Push(cv, chunk_counter);
+        ++chunk_counter;
+        ResetChunk();
+      }
+      
+      auto take = std::min(size, Blake3::ChunkSize - GetChunkLength());
+      UpdateChunk(data, take);
+      data += take;
+      size -= take;
+    }
+  }
+  
+  // Update() for large inputs: whole 64 KiB subtrees are hashed concurrently on the worker pool, as long as the hasher
+  // sits on a subtree boundary. `last` tells whether the input ends with this data, the final chunk is left to Final().
+  void UpdateParallel(const uint8_t *data, size_t size, bool last)
+  {
+    const size_t subtree = Blake3::SubtreeChunks * Blake3::ChunkSize;
+    
+    size_t subtrees = 0;
+    if (GetChunkLength() == 0 && chunk_counter % Blake3::SubtreeChunks == 0)
+      subtrees = (last ? (size > 0 ? size - 1 : 0) : size) / subtree;
+    
+    if (subtrees > 1) {
+      std::vector<uint32_t> cvs(subtrees * 8);
+      const uint64_t counter = chunk_counter;
+      
+      Workers().ParallelFor(subtrees, [&cvs, data, counter, subtree] (size_t i) -> void {
+        Blake3::SubtreeCV(data + i * subtree, Blake3::SubtreeChunks, counter + i * Blake3::SubtreeChunks, &cvs[i * 8]);
+      });
+      
+      for (size_t i = 0; i < subtrees; ++i) {
+        Push(&cvs[i * 8], chunk_counter);
+        chunk_counter += Blake3::SubtreeChunks;
+      }
+      
+      data += subtrees * subtree;
+      size -= subtrees * subtree;
+    }
+    
+    Update(data, size);
+  }
+  
+  void Final(uint8_t digest[32])
+  {
+    MergeStack(chunk_counter);
+    
+    // The output node: the current chunk, then rolled up through the stack. Whichever is last is the root.
+    uint32_t cv[8];
+    memcpy(cv, chunk_cv, 32);
+    
+    uint8_t node[64] = {0};
+    memcpy(node, block, block_length);
+    uint64_t counter = chunk_counter;
+    uint32_t length = (uint32_t) block_length;
+    uint32_t flags = Blake3::CHUNK_END | (blocks_compressed == 0 ? Blake3::CHUNK_START : 0);
+    
+    for (size_t i = stack_length; i > 0; --i) {
+      Blake3::Compress(cv, node, counter, length, flags);
+      memcpy(node, stack[i - 1], 32);
+      memcpy(node + 32, cv, 32);
+      memcpy(cv, SHA256_IV, 32);
+      counter = 0;
+      length = 64;
+      flags = Blake3::PARENT;
+    }
+    
+    Blake3::Compress(cv, node, counter, length, flags | Blake3::ROOT);
+    
+    for (int i = 0; i < 8; ++i) {
+      for (int j = 0; j < 4; ++j)
+        digest[4 * i + j] = (uint8_t) (cv[i] >> (8 * j));
+    }
+  }
+};
+
+// Reads the file or device at `path` front to back in 4 MiB unbuffered reads, two of them alternating so the next read
+// is in flight while `consume` works on the previous one. `consume(data, size, last)` gets every buffer in order, an
+// empty file gets a single empty, last one.
+static bool ReadStream(const char *path, const std::function<void(const uint8_t *, size_t, bool)> &consume)
+{
+  TRACE_SCOPE("ReadStream");
+  
+  const size_t chunk = 4 * 1024 * 1024;
+  
+  HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (handle == INVALID_HANDLE_VALUE)
+    handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  
+  if (handle == INVALID_HANDLE_VALUE)
+    return false;
+  
+  // Devices have no file size
+  uint64_t size = 0;
+  LARGE_INTEGER length;
+  if (GetFileSizeEx(handle, &length) && length.QuadPart > 0)
+    size = length.QuadPart;
+  else
+    size = BlockDevice_Handle(handle, 512).GetSize();
+  
+  if (size == 0) {
+    CloseHandle(handle);
+    consume(nullptr, 0, true);
+    return true;
+  }
+  
+  AlignedBuffer first(chunk), second(chunk);
+  AlignedBuffer *buffers[2] = { &first, &second };
+  OVERLAPPED overlapped[2] = {};
+  
+  for (int i = 0; i < 2; ++i)
+    overlapped[i].hEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+  
+  auto Issue = [&] (int i, uint64_t offset) -> bool {
+    overlapped[i].Offset = (DWORD) offset;
+    overlapped[i].OffsetHigh = (DWORD) (offset >> 32);
+    
+    // Unbuffered reads are in whole sectors, the last one runs past the end of the file and comes back short
+    auto length = (DWORD) std::min<uint64_t>(chunk, (size - offset + 4095) / 4096 * 4096);
+    return ReadFile(handle, buffers[i]->Get(), length, nullptr, &overlapped[i]) || GetLastError() == ERROR_IO_PENDING;
+  };
+  
+  bool success = first.Get() != nullptr && second.Get() != nullptr && overlapped[0].hEvent != nullptr &&
+    overlapped[1].hEvent != nullptr && Issue(0, 0);
+  bool pending[2] = { success, false };
+  
+  for (uint64_t position = 0; success && position < size; ) {
+    int current = (int) ((position / chunk) & 1);
+    
+    DWORD read = 0;
+    pending[current] = false;
+    if (!GetOverlappedResult(handle, &overlapped[current], &read, TRUE) || read == 0) {
+      success = false;
+      break;
+    }
+    
+    auto available = (size_t) std::min<uint64_t>(read, size - position);
+    bool last = position + available >= size;
+    
+    // Short reads only happen at the end
+    if (!last && available != chunk) {
+      success = false;
+      break;
+    }
+    
+    if (!last) {
+      if (!Issue(current ^ 1, position + chunk)) {
+        success = false;
+        break;
+      }
+      
+      pending[current ^ 1] = true;
+    }
+    
+    consume(buffers[current]->Get(), available, last);
+    position += available;
+  }
+  
+  // Don't free buffers a read is still writing to
+  for (int i = 0; i < 2; ++i) {
+    DWORD read;
+    if (pending[i]) {
+      CancelIo(handle);
+      GetOverlappedResult(handle, &overlapped[i], &read, TRUE);
+    }
+    
+    if (overlapped[i].hEvent != nullptr)
+      CloseHandle(overlapped[i].hEvent);
+  }
+  
+  CloseHandle(handle);
+  return success;
+}
+
+static std::string ToHex(const uint8_t *data, size_t size)
+{
+  static const char digits[] = "0123456789abcdef";
+  std::string s(size * 2, ' ');
+  
+  for (size_t i = 0; i < size; ++i) {
+    s[2 * i] = digits[data[i] >> 4];
+    s[2 * i + 1] = digits[data[i] & 15];
+  }
+  
+  return s;
+}
+
+// Reads `length` bytes at `offset` of a file opened for synchronous or overlapped I/O
+static bool ReadFileAt(HANDLE h, uint64_t offset, void *buffer, DWORD length)
+{
+  OVERLAPPED overlapped = {0};
+  overlapped.Offset = (DWORD) offset;
+  overlapped.OffsetHigh = (DWORD) (offset >> 32);
+  overlapped.hEvent = GetThreadIOEvent();
+  
+  DWORD read = 0;
+  BOOL success = ReadFile(h, buffer, length, &read, &overlapped);
+  if (!success && GetLastError() == ERROR_IO_PENDING)
+    success = GetOverlappedResult(h, &overlapped, &read, TRUE);
+  
+  return success && read == length;
+}
+
+// Every file below `directory` (full paths and sizes), without following junctions or symbolic links. Directories
+// are read a level at a time, all of a level's directories concurrently.
+static VectorFileRecord TraverseDirectoryTree(const std::string &directory)
+{
+  TRACE_SCOPE("TraverseDirectoryTree");
+  
+  VectorFileRecord files;
+  VectorString level { directory };
+  
+  while (!level.empty()) {
+    std::vector<VectorFileRecord> found(level.size());
+    std::vector<VectorString> subdirectories(level.size());
+    
+    Workers().ParallelFor(level.size(), [&level, &found, &subdirectories] (size_t i) -> void {
+      auto base = level[i];
+      if (!base.empty() && base.back() != '\\' && base.back() != '/')
+        base += '\\';
+      
+      for (auto &record : TraverseDirectory((base + "*").c_str())) {
+        if (record.name == "." || record.name == ".." || (record.attributes & FILE_ATTRIBUTE_REPARSE_POINT))
+          continue;
+        
+        record.name = base + record.name;
+        
+        if (record.directory)
+          subdirectories[i].push_back(std::move(record.name));
+        else
+          found[i].push_back(std::move(record));
+      }
+    });
+    
+    level.clear();
+    for (size_t i = 0; i < found.size(); ++i) {
+      std::move(found[i].begin(), found[i].end(), std::back_inserter(files));
+      std::move(subdirectories[i].begin(), subdirectories[i].end(), std::back_inserter(level));
+    }
+  }
+  
+  return files;
+}
+
+// Finds files with identical contents below `directory`, reading as little as possible:
+//   1. files of a size no other file has can't have a duplicate, they're never opened,
+//   2. the first and last 4 KiB of the rest are hashed, which tells most files of the same size apart,
+//   3. the files still sharing size and partial hash are hashed completely (BLAKE3), concurrently.
+// Hard links of one file are the same file, they are counted once. Empty files are ignored. Returns the sets of
+// duplicates along with their file size, the most space to reclaim first.
+static std::vector<std::pair<uint64_t, VectorString>> FindDuplicates(const std::string &directory)
+{
+  TRACE_SCOPE("FindDuplicates");
+  
+  const uint32_t edge = 4096;
+  
+  std::unordered_map<uint64_t, VectorString> by_size;
+  for (auto &file : TraverseDirectoryTree(directory)) {
+    if (file.size != 0)
+      by_size[file.size].push_back(std::move(file.name));
+  }
+  
+  // Groups of possibly identical files, refined by each step
+  std::vector<std::pair<uint64_t, VectorString>> groups;
+  for (auto &bucket : by_size) {
+    if (bucket.second.size() > 1)
+      groups.push_back(std::make_pair(bucket.first, std::move(bucket.second)));
+  }
+  
+  // Splits every group by a key computed (concurrently) for each of its files, dropping the groups left with one file.
+  // Files the key can't be computed for (gone, locked) are dropped with an empty key.
+  auto Refine = [&groups] (const std::function<std::string(const std::string &, uint64_t)> &key) -> void {
+    std::vector<std::pair<size_t, size_t>> files; // (group, index in the group)
+    for (size_t i = 0; i < groups.size(); ++i) {
+      for (size_t j = 0; j < groups[i].second.size(); ++j)
+        files.push_back(std::make_pair(i, j));
+    }
+    
+    std::vector<std::string> keys(files.size());
+    Workers().ParallelFor(files.size(), [&] (size_t i) -> void {
+      const auto &group = groups[files[i].first];
+      keys[i] = key(group.second[files[i].second], group.first);
+    });
+    
+    std::vector<std::pair<uint64_t, VectorString>> refined;
+    std::unordered_map<std::string, size_t> index;
+    
+    for (size_t i = 0; i < files.size(); ++i) {
+      if (keys[i].empty())
+        continue;
+      
+      // Keys are only compared within a group
+      auto size = groups[files[i].first].first;
+      auto it = index.insert(std::make_pair(std::to_string(files[i].first) + ":" + keys[i], refined.size()));
+      if (it.second)
+        refined.push_back(std::make_pair(size, VectorString()));
+      
+      refined[it.first->second].second.push_back(std::move(groups[files[i].first].second[files[i].second]));
+    }
+    
+    groups.clear();
+    for (auto &group : refined) {
+      if (group.second.size() > 1)
+        groups.push_back(std::move(group));
+    }
+  };
+  
+  // Hard links: the volume and file ID identify the file, the first path of each is kept. The IDs of all files of all
+  // groups are looked up in one go, like Refine() does.
+  {
+    std::vector<std::pair<size_t, size_t>> files; // (group, index in the group)
+    for (size_t i = 0; i < groups.size(); ++i) {
+      for (size_t j = 0; j < groups[i].second.size(); ++j)
+        files.push_back(std::make_pair(i, j));
+    }
+    
+    std::vector<std::string> ids(files.size());
+    Workers().ParallelFor(files.size(), [&] (size_t i) -> void {
+      const auto &path = groups[files[i].first].second[files[i].second];
+      HANDLE h = CreateFileA(path.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr);
+      BY_HANDLE_FILE_INFORMATION information;
+      
+      if (h != INVALID_HANDLE_VALUE && GetFileInformationByHandle(h, &information)) {
+        char id[40];
+        snprintf(id, sizeof(id), "%08lx:%08lx%08lx", (unsigned long) information.dwVolumeSerialNumber, (unsigned long) information.nFileIndexHigh, (unsigned long) information.nFileIndexLow);
+        ids[i] = id;
+      }
+      
+      if (h != INVALID_HANDLE_VALUE)
+        CloseHandle(h);
+    });
+    
+    // `files` runs through the groups in order, a group's files are consecutive
+    std::vector<std::pair<uint64_t, VectorString>> unique;
+    std::unordered_set<std::string> seen;
+    VectorString paths;
+    
+    for (size_t i = 0; i < files.size(); ++i) {
+      auto &group = groups[files[i].first];
+      if (ids[i].empty() || seen.insert(ids[i]).second)
+        paths.push_back(std::move(group.second[files[i].second]));
+      
+      // Last file of the group
+      if (i + 1 == files.size() || files[i + 1].first != files[i].first) {
+        if (paths.size() > 1)
+          unique.push_back(std::make_pair(group.first, std::move(paths)));
+        
+        paths.clear();
+        seen.clear();
+      }
+    }
+    
+    groups = std::move(unique);
+  }
+  
+  Refine([edge] (const std::string &path, uint64_t size) -> std::string {
+    HANDLE h = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+    if (h == INVALID_HANDLE_VALUE)
+      return std::string();
+    
+    // Small files are read whole, which settles them here already
+    uint8_t buffer[2 * edge];
+    auto head = (DWORD) std::min<uint64_t>(size, edge);
+    auto tail = (DWORD) std::min<uint64_t>(size - head, edge);
+    
+    bool success = ReadFileAt(h, 0, buffer, head) && (tail == 0 || ReadFileAt(h, size - tail, buffer + head, tail));
+    CloseHandle(h);
+    
+    if (!success)
+      return std::string();
+    
+    uint8_t digest[32];
+    BLAKE3 hasher;
+    hasher.Update(buffer, head + tail);
+    hasher.Final(digest);
+    return ToHex(digest, 16);
+  });
+  
+  Refine([edge] (const std::string &path, uint64_t size) -> std::string {
+    // Already read completely in the previous step
+    if (size <= 2 * edge)
+      return "-";
+    
+    uint8_t digest[32];
+    BLAKE3 hasher;
+    bool success = ReadStream(path.c_str(), [&hasher] (const uint8_t *data, size_t size, bool last) -> void {
+      hasher.UpdateParallel(data, size, last);
+    });
+    
+    if (!success)
+      return std::string();
+    
+    hasher.Final(digest);
+    return ToHex(digest, sizeof(digest));
+  });
+  
+  // Most space to reclaim first
+  std::sort(groups.begin(), groups.end(), [] (const std::pair<uint64_t, VectorString> &a, const std::pair<uint64_t, VectorString> &b) -> bool {
+    return a.first * (a.second.size() - 1) > b.first * (b.second.size() - 1);
+  });
+  
+  for (auto &group : groups)
+    std::sort(group.second.begin(), group.second.end());
+  
+  return groups;
+}
+
+static inline unsigned CountTrailingZeros(uint32_t x)
+{
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward(&index, x);
+  return (unsigned) index;
+#else
+  return (unsigned) __builtin_ctz(x);
+#endif
+}
+
+static size_t FindBytes_Scalar(const uint8_t *data, size_t size, const uint8_t *pattern, size_t length)
+{
+  for (size_t i = 0; i + length <= size; ++i) {
+    auto p = (const uint8_t *) memchr(data + i, pattern[0], size - length + 1 - i);
+    if (p == nullptr)
+      break;
+    
+    i = p - data;
+    if (memcmp(p, pattern, length) == 0)
+      return i;
+  }
+  
+  return size;
+}
+
+// 16 positions at a time are compared against the pattern's first and last byte, which rules out nearly all of them;
+// only the positions left are compared in full
+TARGET("sse2")
+static size_t FindBytes_SSE2(const uint8_t *data, size_t size, const uint8_t *pattern, size_t length)
+{
+  const __m128i first = _mm_set1_epi8((char) pattern[0]);
+  const __m128i last = _mm_set1_epi8((char) pattern[length - 1]);
+  size_t i = 0;
+  
+  for (; i + length - 1 + 16 <= size; i += 16) {
+    __m128i head = _mm_loadu_si128((const __m128i *) (data + i));
+    __m128i tail = _mm_loadu_si128((const __m128i *) (data + i + length - 1));
+    uint32_t mask = (uint32_t) _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last)));
+    
+    while (mask != 0) {
+      auto position = i + CountTrailingZeros(mask);
+      if (memcmp(data + position, pattern, length) == 0)
+        return position;
+      
+      mask &= mask - 1;
+    }
+  }
+  
+  return i + FindBytes_Scalar(data + i, size - i, pattern, length);
+}
+
+// Offset of the first occurrence of `pattern` in `data`, `size` if there is none
+static size_t FindBytes(const uint8_t *data, size_t size, const uint8_t *pattern, size_t length)
+{
+  if (length == 0 || length > size)
+    return length == 0 ? 0 : size;
+  
+  return GetCPUFeatures().SSE2 ? FindBytes_SSE2(data, size, pattern, length) : FindBytes_Scalar(data, size, pattern, length);
+}
+
+// Random access to the bytes of a file, image or device, without reading anything up front. Files are memory-mapped a
+// window at a time, so a 100 GB image opens as fast as an empty one and only the pages looked at are ever read.
+// Devices can't be mapped, they're read through their BlockDevice (and its cache) instead.
+class ByteSource {
+  static const uint64_t WindowSize = 64 * 1024 * 1024;
+  static const size_t DeviceWindowSize = 1024 * 1024;
+  
+  HANDLE file = INVALID_HANDLE_VALUE;
+  HANDLE mapping = nullptr;
+  std::unique_ptr<BlockDevice> device;
+  uint64_t size = 0;
+  
+  // The window mapped (or read, for devices) last
+  const uint8_t *view = nullptr;
+  uint64_t view_offset = 0;
+  uint64_t view_length = 0;
+  std::vector<uint8_t> buffer;
+  
+  void Unmap()
+  {
+    if (view != nullptr && mapping != nullptr)
+      UnmapViewOfFile(view);
+    
+    view = nullptr;
+    view_length = 0;
+  }
+  
+  // Views have to start at a multiple of this
+  static uint64_t GetGranularity()
+  {
+    static const uint64_t granularity = [] () -> uint64_t {
+      SYSTEM_INFO information;
+      GetSystemInfo(&information);
+      return information.dwAllocationGranularity;
+    }();
+    
+    return granularity;
+  }
+  
+public:
+  // The most Get() returns at once. Half a window, so the range always fits into one window whatever its alignment.
+  static const size_t MaximumLength = (size_t) WindowSize / 2;
+  
+  explicit ByteSource(const char *path)
+  {
+    file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+      return;
+    
+    LARGE_INTEGER length;
+    if (GetFileSizeEx(file, &length) && length.QuadPart > 0) {
+      size = length.QuadPart;
+      mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+      
+      // Files that can't be mapped are read like images
+      if (mapping == nullptr)
+        device.reset(new BlockDevice_Image(path));
+      
+      return;
+    }
+    
+    // Disks and volumes report no file size
+    DISK_GEOMETRY geometry;
+    DWORD junk;
+    uint32_t sector_size = 512;
+    if (IoControl(file, IOCTL_DISK_GET_DRIVE_GEOMETRY, nullptr, 0, &geometry, sizeof(geometry), &junk))
+      sector_size = geometry.BytesPerSector;
+    
+    device.reset(new BlockDevice_Handle(file, sector_size));
+    size = device->GetSize();
+  }
+  
+  ~ByteSource()
+  {
+    Unmap();
+    device.reset();
+    
+    if (mapping != nullptr)
+      CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE)
+      CloseHandle(file);
+  }
+  
+  ByteSource(const ByteSource &) = delete;
+  ByteSource &operator=(const ByteSource &) = delete;
+  
+  bool IsOpen() const
+  {
+    return file != INVALID_HANDLE_VALUE;
+  }
+  
+  uint64_t GetSize() const
+  {
+    return size;
+  }
+  
+  // The bytes [offset, offset + length), valid until the next call. `length` is cut at the end of the source and at
+  // MaximumLength; nullptr (and 0) past the end or when reading fails.
+  const uint8_t *Get(uint64_t offset, size_t &length)
+  {
+    if (offset >= size) {
+      length = 0;
+      return nullptr;
+    }
+    
+    length = (size_t) std::min<uint64_t>(std::min<uint64_t>(length, size - offset), MaximumLength);
+    
+    if (view != nullptr && offset >= view_offset && offset + length <= view_offset + view_length)
+      return view + (offset - view_offset);
+    
+    Unmap();
+    
+    if (mapping != nullptr) {
+      view_offset = offset / GetGranularity() * GetGranularity();
+      view_length = std::min<uint64_t>(WindowSize, size - view_offset);
+      view = (const uint8_t *) MapViewOfFile(mapping, FILE_MAP_READ, (DWORD) (view_offset >> 32), (DWORD) view_offset, (SIZE_T) view_length);
+    } else if (device != nullptr) {
+      view_offset = offset;
+      view_length = std::min<uint64_t>(std::max(length, DeviceWindowSize), size - offset);
+      buffer.resize((size_t) view_length);
+      
+      if (device->Read(view_offset, buffer.data(), (size_t) view_length))
+        view = buffer.data();
+    }
+    
+    if (view == nullptr) {
+      view_length = 0;
+      length = 0;
+      return nullptr;
+    }
+    
+    return view + (offset - view_offset);
+  }
+  
+  // All of [offset, offset + length) at once, for parsers that need an object in one piece: a view of just that range,
+  // or on devices the range read into memory. Valid until the next call, nullptr unless the whole range is there.
+  const uint8_t *GetWhole(uint64_t offset, uint64_t length)
+  {
+    if (length == 0 || offset > size || length > size - offset)
+      return nullptr;
+    
+    if (length <= MaximumLength) {
+      size_t got = (size_t) length;
+      auto data = Get(offset, got);
+      return got == length ? data : nullptr;
+    }
+    
+    Unmap();
+    
+    if (mapping != nullptr) {
+      view_offset = offset / GetGranularity() * GetGranularity();
+      view_length = offset + length - view_offset;
+      if (view_length <= SIZE_MAX)
+        view = (const uint8_t *) MapViewOfFile(mapping, FILE_MAP_READ, (DWORD) (view_offset >> 32), (DWORD) view_offset, (SIZE_T) view_length);
+    } else if (device != nullptr && length <= SIZE_MAX) {
+      view_offset = offset;
+      view_length = length;
+      buffer.resize((size_t) view_length);
+      
+      if (device->Read(view_offset, buffer.data(), (size_t) view_length))
+        view = buffer.data();
+    }
+    
+    if (view == nullptr) {
+      view_length = 0;
+      return nullptr;
+    }
+    
+    return view + (offset - view_offset);
+  }
+  
+  // Offset of the first occurrence of `pattern` at or after `offset`, UINT64_MAX if there is none. The source is scanned
+  // in pieces overlapping by the pattern length, so matches straddling two pieces are found as well.
+  uint64_t Find(const std::string &pattern, uint64_t offset)
+  {
+    const size_t piece = 16 * 1024 * 1024;
+    
+    if (pattern.empty() || pattern.length() > piece)
+      return UINT64_MAX;
+    
+    while (offset + pattern.length() <= size) {
+      size_t length = piece;
+      auto data = Get(offset, length);
+      if (data == nullptr)
+        break;
+      
+      auto position = FindBytes(data, length, (const uint8_t *) pattern.data(), pattern.length());
+      if (position < length)
+        return offset + position;
+      
+      if (offset + length >= size)
+        break;
+      
+      offset += length - (pattern.length() - 1);
+    }
+    
+    return UINT64_MAX;
+  }
+};
+
+// Search patterns as typed: hex bytes after "0x" (spaces allowed, "0x4d 5a 90"), text otherwise. Empty when the hex
+// is malformed.
+static std::string ParseBytePattern(const std::string &text)
+{
+  if (text.length() < 2 || text[0] != '0' || (text[1] != 'x' && text[1] != 'X'))
+    return text;
+  
+  std::string digits, bytes;
+  for (size_t i = 2; i < text.length(); ++i) {
+    if (isxdigit((unsigned char) text[i]))
+      digits += text[i];
+    else if (text[i] != ' ')
+      return std::string();
+  }
+  
+  if (digits.length() % 2 != 0)
+    return std::string();
+  
+  for (size_t i = 0; i < digits.length(); i += 2)
+    bytes += (char) strtoul(digits.substr(i, 2).c_str(), nullptr, 16);
+  
+  return bytes;
+}
+
+// The classic 16 bytes per line layout: offset, hex bytes, printable characters
+static void FormatHexLines(std::string &out, uint64_t offset, const uint8_t *data, size_t length, bool wide_offsets)
+{
+  static const char digits[] = "0123456789abcdef";
+  
+  for (size_t line = 0; line < length; line += 16) {
+    char address[24];
+    snprintf(address, sizeof(address), wide_offsets ? "%012" PRIx64 "  " : "%08" PRIx64 "  ", offset + line);
+    out += address;
+    
+    auto count = std::min<size_t>(16, length - line);
+    for (size_t i = 0; i < 16; ++i) {
+      if (i < count) {
+        out += digits[data[line + i] >> 4];
+        out += digits[data[line + i] & 15];
+        out += ' ';
+      } else {
+        out += "   ";
+      }
+      
+      if (i == 7)
+        out += ' ';
+    }
+    
+    out += " |";
+    for (size_t i = 0; i < count; ++i)
+      out += isprint(data[line + i]) ? (char) data[line + i] : '.';
+    out += "|\n";
+  }
+}
+
+// Reads a line typed after `prompt`, without echoing it to the shell's input line. Escape cancels (empty result).
+static std::string ReadViewerLine(const char *prompt)
+{
+  std::string line;
+  ConsolePrint("\n%s", prompt);
+  
+  for (;;) {
+    int c = _getch();
+    
+    if (c == '\r')
+      return line;
+    if (c == 27)
+      return std::string();
+    
+    if (c == 0 || c == 224) {
+      _getch();
+    } else if (c == '\b') {
+      if (!line.empty()) {
+        line.pop_back();
+        ConsolePrint("\b \b");
+      }
+    } else if (isprint(c)) {
+      line += (char) c;
+      ConsolePrint("%c", c);
+    }
+  }
+}
+
+// Full-screen pager over a ByteSource. Every redraw reads only the rows on screen.
+static void ViewBytes(ByteSource &source, const std::string &name, uint64_t offset)
+{
+  const uint64_t size = source.GetSize();
+  const bool wide_offsets = size > UINT32_MAX;
+  
+  std::string pattern, message;
+  uint64_t match = UINT64_MAX;
+  
+  for (;;) {
+    CONSOLE_SCREEN_BUFFER_INFO screen;
+    int rows = 24;
+    if (GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &screen))
+      rows = screen.srWindow.Bottom - screen.srWindow.Top + 1;
+    
+    // Header and status line
+    const uint64_t page = (uint64_t) std::max(rows - 3, 1) * 16;
+    const uint64_t last_page = size > page ? (size - page + 15) / 16 * 16 : 0;
+    offset = std::min(offset / 16 * 16, last_page);
+    
+    std::string text = name + " (" + std::to_string(size) + " bytes)\n";
+    size_t length = (size_t) page;
+    auto data = source.Get(offset, length);
+    if (data != nullptr)
+      FormatHexLines(text, offset, data, length, wide_offsets);
+    else
+      text += "(unable to read)\n";
+    
+    char status[160];
+    snprintf(status, sizeof(status), "%" PRIu64 "/%" PRIu64 "  arrows PgUp PgDn Home End, g offset, / find, n next, q quit  %s", offset, size, message.c_str());
+    text += status;
+    message.clear();
+    
+    ConsoleClear();
+    ConsolePrint("%s", text.c_str());
+    
+    int c = _getch();
+    
+    if (c == 'q' || c == 27 || c == CTRL('c')) {
+      ConsolePrint("\n");
+      return;
+    } else if (c == 0 || c == 224) {
+      switch (_getch()) {
+        case 'H': offset = offset >= 16 ? offset - 16 : 0; break;
+        case 'P': offset += 16; break;
+        case 'I': offset = offset >= page ? offset - page : 0; break;
+        case 'Q': offset += page; break;
+        case 'G': offset = 0; break;
+        case 'O': offset = last_page; break;
+      }
+    } else if (c == 'g') {
+      auto line = ReadViewerLine("offset: ");
+      if (!line.empty())
+        offset = strtoull(line.c_str(), nullptr, 0);
+    } else if (c == '/' || c == 'n') {
+      if (c == '/') {
+        pattern = ParseBytePattern(ReadViewerLine("find (text or 0x hex bytes): "));
+        match = UINT64_MAX;
+      }
+      
+      if (pattern.empty())
+        continue;
+      
+      // From the previous match on, or from the top of the page for a new pattern
+      auto found = source.Find(pattern, match != UINT64_MAX ? match + 1 : offset);
+      if (found != UINT64_MAX) {
+        match = found;
+        offset = found;
+        message = "match at " + std::to_string(found);
+      } else {
+        message = "not found";
+      }
+    }
+  }
+}
+
+// Format plugins in the "plugins" directory next to the executable (see format_plugin.hpp). The directory is scanned
+// on first use, and only the .magic files are read; a plugin's DLL is loaded when a file first matches one of its
+// magics. Plugins that fail to load are not tried again.
+class FormatPlugins {
+  // Magics further into a file are ignored, so matching never needs more than the first megabyte
+  static const uint64_t MaximumMagicEnd = 1024 * 1024;
+  
+  struct Plugin {
+    std::string name;
+    std::string library;
+    std::vector<std::pair<uint64_t, std::string>> magics;
+    HMODULE module = nullptr;
+    const ShellFormatPlugin *description = nullptr;
+    bool failed = false;
+  };
+  
+  std::vector<Plugin> plugins;
+  uint64_t header_length = 0;
+  std::mutex lock;
+  
+  // "name <format name>" and "magic <offset> <bytes>" lines, '#' starts a comment
+  static bool ReadMagicFile(const std::string &path, Plugin &plugin)
+  {
+    FILE *f = fopen(path.c_str(), "r");
+    if (f == nullptr)
+      return false;
+    
+    char buffer[1024];
+    while (fgets(buffer, sizeof(buffer), f) != nullptr) {
+      std::string line(buffer);
+      while (!line.empty() && isspace((unsigned char) line.back()))
+        line.pop_back();
+      
+      if (line.compare(0, 5, "name ") == 0) {
+        plugin.name = line.substr(5);
+      } else if (line.compare(0, 6, "magic ") == 0) {
+        char *end;
+        uint64_t offset = strtoull(line.c_str() + 6, &end, 0);
+        auto bytes = ParseBytePattern(std::string(end + strspn(end, " \t")));
+        
+        if (end != line.c_str() + 6 && !bytes.empty() && offset + bytes.length() <= MaximumMagicEnd)
+          plugin.magics.emplace_back(offset, bytes);
+      }
+    }
+    
+    Cleanup_FILE(&f);
+    return !plugin.magics.empty();
+  }
+  
+  static bool Load(Plugin &plugin)
+  {
+    TRACE_SCOPE("FormatPlugins::Load");
+    
+    plugin.module = LoadLibraryA(plugin.library.c_str());
+    auto entry = plugin.module != nullptr ? (ShellGetFormatPluginFunction) GetProcAddress(plugin.module, SHELL_FORMAT_PLUGIN_ENTRY) : nullptr;
+    auto description = entry != nullptr ? entry(SHELL_FORMAT_PLUGIN_VERSION) : nullptr;
+    
+    // Plugins built against a later version than the shell's are refused, earlier ones have to have Parse at least
+    if (description == nullptr || description->version == 0 || description->version > SHELL_FORMAT_PLUGIN_VERSION ||
+        description->size < offsetof(ShellFormatPlugin, Parse) + sizeof(description->Parse) || description->Parse == nullptr) {
+      if (plugin.module != nullptr)
+        FreeLibrary(plugin.module);
+      
+      plugin.module = nullptr;
+      plugin.failed = true;
+      return false;
+    }
+    
+    plugin.description = description;
+    return true;
+  }
+  
+  FormatPlugins()
+  {
+    TRACE_SCOPE("FormatPlugins::Scan");
+    
+    char executable[MAX_PATH];
+    DWORD length = GetModuleFileNameA(nullptr, executable, MAX_PATH);
+    if (length == 0 || length == MAX_PATH)
+      return;
+    
+    std::string directory(executable, length);
+    directory = directory.substr(0, directory.find_last_of('\\') + 1) + "plugins\\";
+    
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA((directory + "*.magic").c_str(), &data);
+    if (find == INVALID_HANDLE_VALUE)
+      return;
+    
+    do {
+      std::string base = directory + std::string(data.cFileName, strlen(data.cFileName) - 6);
+      
+      Plugin plugin;
+      plugin.library = base + ".dll";
+      if (!ReadMagicFile(base + ".magic", plugin))
+        continue;
+      
+      if (plugin.name.empty())
+        plugin.name = std::string(data.cFileName, strlen(data.cFileName) - 6);
+      
+      for (const auto &magic : plugin.magics)
+        header_length = std::max(header_length, magic.first + magic.second.length());
+      
+      plugins.push_back(std::move(plugin));
+    } while (FindNextFileA(find, &data));
+    
+    FindClose(find);
+  }
+  
+public:
+  static FormatPlugins &Get()
+  {
+    static FormatPlugins *registry = new FormatPlugins();
+    return *registry;
+  }
+  
+  // How much of a file's start Find() needs to see every magic, 0 without plugins
+  uint64_t GetHeaderLength() const
+  {
+    return header_length;
+  }
+  
+  // The plugin for a file starting with `data`, loaded if it isn't yet. nullptr when no magic matches, or only ones
+  // of plugins that can't be loaded.
+  const ShellFormatPlugin *Find(const uint8_t *data, size_t length)
+  {
+    for (auto &plugin : plugins) {
+      bool match = std::any_of(plugin.magics.begin(), plugin.magics.end(), [data, length] (const std::pair<uint64_t, std::string> &magic) -> bool {
+        return magic.first + magic.second.length() <= length && memcmp(data + magic.first, magic.second.data(), magic.second.length()) == 0;
+      });
+      
+      if (!match)
+        continue;
+      
+      std::lock_guard<std::mutex> guard(lock);
+      if (plugin.description == nullptr && !plugin.failed)
+        Load(plugin);
+      if (plugin.description != nullptr)
+        return plugin.description;
+    }
+    
+    return nullptr;
+  }
+  
+  // Lists the plugins with their format, DLL and state
+  void Print()
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    
+    for (const auto &plugin : plugins) {
+      const char *state = plugin.description != nullptr ? "loaded" : plugin.failed ? "unusable" : "not loaded";
+      ConsolePrint("%-24s %-10s %zu magic%s  %s\n", plugin.name.c_str(), state, plugin.magics.size(), plugin.magics.size() == 1 ? "" : "s", plugin.library.c_str());
+    }
+  }
+};
+
+// The plugin for a file, judged by its first bytes
+static const ShellFormatPlugin *FindFormatPlugin(const char *path)
+{
+  auto &registry = FormatPlugins::Get();
+  if (registry.GetHeaderLength() == 0)
+    return nullptr;
+  
+  ByteSource source(path);
+  size_t length = (size_t) registry.GetHeaderLength();
+  auto data = source.IsOpen() ? source.Get(0, length) : nullptr;
+  
+  return data != nullptr ? registry.Find(data, length) : nullptr;
+}
+
+// Finds any of a set of byte patterns in one pass. With SSSE3 this is Teddy (from Hyperscan): the patterns are spread
+// over 8 buckets, and for each of the first 1-3 pattern bytes two 16-entry tables (indexed by the low and high nibble)
+// hold the buckets having a pattern with that byte there. Two PSHUFB per byte position then yield, for 16 start
+// positions at once, the buckets that could match; only those patterns are compared. Without SSSE3, positions are
+// filtered by a first-byte table.
+class MultiPatternMatcher {
+  VectorString patterns;
+  size_t minimum_length = SIZE_MAX;
+  size_t maximum_length = 0;
+  
+  // Teddy
+  size_t fingerprint_length = 0;
+  uint8_t low[3][16];
+  uint8_t high[3][16];
+  std::vector<size_t> buckets[8];
+  
+  // Scalar
+  std::vector<size_t> by_first_byte[256];
+  
+  bool Verify(const uint8_t *data, size_t size, size_t position, size_t limit, size_t index, const std::function<void(size_t, size_t)> &found) const
+  {
+    const auto &pattern = patterns[index];
+    if (position >= limit || position + pattern.length() > size || memcmp(data + position, pattern.data(), pattern.length()) != 0)
+      return false;
+    
+    found(position, index);
+    return true;
+  }
+  
+  void Scan_Scalar(const uint8_t *data, size_t size, size_t start, size_t limit, const std::function<void(size_t, size_t)> &found) const
+  {
+    for (size_t i = start; i < limit && i + minimum_length <= size; ++i) {
+      for (auto index : by_first_byte[data[i]])
+        Verify(data, size, i, limit, index, found);
+    }
+  }
+  
+  TARGET("ssse3")
+  void Scan_Teddy(const uint8_t *data, size_t size, size_t limit, const std::function<void(size_t, size_t)> &found) const
+  {
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    __m128i low_table[3], high_table[3];
+    for (size_t k = 0; k < fingerprint_length; ++k) {
+      low_table[k] = _mm_loadu_si128((const __m128i *) low[k]);
+      high_table[k] = _mm_loadu_si128((const __m128i *) high[k]);
+    }
+    
+    size_t i = 0;
+    for (; i < limit && i + 16 + fingerprint_length - 1 <= size; i += 16) {
+      __m128i candidates = _mm_set1_epi8(-1);
+      
+      for (size_t k = 0; k < fingerprint_length; ++k) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (data + i + k));
+        __m128i by_low = _mm_shuffle_epi8(low_table[k], _mm_and_si128(x, nibble));
+        __m128i by_high = _mm_shuffle_epi8(high_table[k], _mm_and_si128(_mm_srli_epi16(x, 4), nibble));
+        candidates = _mm_and_si128(candidates, _mm_and_si128(by_low, by_high));
+      }
+      
+      uint32_t mask = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(candidates, _mm_setzero_si128())) ^ 0xffff;
+      if (mask == 0)
+        continue;
+      
+      uint8_t lanes[16];
+      _mm_storeu_si128((__m128i *) lanes, candidates);
+      
+      for (; mask != 0; mask &= mask - 1) {
+        auto lane = CountTrailingZeros(mask);
+        
+        for (uint32_t bits = lanes[lane]; bits != 0; bits &= bits - 1) {
+          for (auto index : buckets[CountTrailingZeros(bits)])
+            Verify(data, size, i + lane, limit, index, found);
+        }
+      }
+    }
+    
+    Scan_Scalar(data, size, i, limit, found);
+  }
+  
+public:
+  explicit MultiPatternMatcher(const VectorString &patterns) : patterns(patterns)
+  {
+    memset(low, 0, sizeof(low));
+    memset(high, 0, sizeof(high));
+    
+    for (size_t i = 0; i < patterns.size(); ++i) {
+      minimum_length = std::min(minimum_length, patterns[i].length());
+      maximum_length = std::max(maximum_length, patterns[i].length());
+      by_first_byte[(uint8_t) patterns[i][0]].push_back(i);
+    }
+    
+    if (patterns.empty())
+      return;
+    
+    fingerprint_length = std::min<size_t>(minimum_length, 3);
+    
+    // Patterns next to each other in sorted order share their first bytes, and so share buckets without making the
+    // bucket match more often
+    std::vector<size_t> order(patterns.size());
+    for (size_t i = 0; i < order.size(); ++i)
+      order[i] = i;
+    std::sort(order.begin(), order.end(), [&patterns] (size_t a, size_t b) -> bool { return patterns[a] < patterns[b]; });
+    
+    for (size_t rank = 0; rank < order.size(); ++rank) {
+      auto bucket = rank * 8 / order.size();
+      const auto &pattern = patterns[order[rank]];
+      buckets[bucket].push_back(order[rank]);
+      
+      for (size_t k = 0; k < fingerprint_length; ++k) {
+        low[k][(uint8_t) pattern[k] & 15] |= (uint8_t) (1 << bucket);
+        high[k][(uint8_t) pattern[k] >> 4] |= (uint8_t) (1 << bucket);
+      }
+    }
+  }
+  
+  size_t GetMaximumLength() const
+  {
+    return maximum_length;
+  }
+  
+  const std::string &GetPattern(size_t index) const
+  {
+    return patterns[index];
+  }
+  
+  // Calls found(position, pattern index) for every match starting before `limit` and ending within `size`, in order
+  // of position
+  void Scan(const uint8_t *data, size_t size, size_t limit, const std::function<void(size_t, size_t)> &found) const
+  {
+    if (patterns.empty())
+      return;
+    
+    if (GetCPUFeatures().SSSE3)
+      Scan_Teddy(data, size, std::min(limit, size), found);
+    else
+      Scan_Scalar(data, size, 0, std::min(limit, size), found);
+  }
+};
+
+struct SearchMatch {
+  uint64_t offset;
+  size_t pattern;
+};
+
+// All matches starting in [begin, end) of the source, up to `maximum` of them. The source is scanned in pieces
+// overlapping by the longest pattern, so matches straddling two pieces are found (once).
+static void SearchSource(ByteSource &source, const MultiPatternMatcher &matcher, uint64_t begin, uint64_t end, size_t maximum, std::vector<SearchMatch> &matches)
+{
+  const size_t overlap = matcher.GetMaximumLength() - 1;
+  const size_t piece = 16 * 1024 * 1024;
+  
+  end = std::min(end, source.GetSize());
+  
+  for (uint64_t offset = begin; offset < end && matches.size() < maximum; ) {
+    size_t length = (size_t) std::min<uint64_t>(piece + overlap, source.GetSize() - offset);
+    auto data = source.Get(offset, length);
+    if (data == nullptr)
+      break;
+    
+    auto limit = (size_t) std::min<uint64_t>(end - offset, piece);
+    matcher.Scan(data, length, limit, [&matches, offset] (size_t position, size_t index) -> void {
+      matches.push_back(SearchMatch { offset + position, index });
+    });
+    
+    offset += limit;
+  }
+  
+  if (matches.size() > maximum)
+    matches.resize(maximum);
+}
+
+// Patterns are printed the way they would be typed
+static std::string FormatBytePattern(const std::string &pattern)
+{
+  bool printable = std::all_of(pattern.begin(), pattern.end(), [] (char c) -> bool { return isprint((unsigned char) c) != 0; });
+  return printable ? pattern : "0x" + ToHex((const uint8_t *) pattern.data(), pattern.length());
+}
+
+// The formats `carve` recovers, found by their magic. Where an object ends is told by its header (read by its parser),
+// or by an end marker the scan pairs with the magic: a PDF runs to the last "%%EOF" whose startxref points back into it,
+// a ZIP to the end of central directory record pointing back at its start. Objects told by their markers are only
+// candidates until their parser has read them as a whole.
+struct CarveFormat {
+  enum Ending { Header, Trailer, Directory };
+  
+  const char *magic;
+  size_t magic_length;
+  Ending ending;
+  const char *end; // The end marker, nullptr for Header
+  size_t end_length;
+  const char *extension;
+  std::unique_ptr<Format> (*create)(); // The parser reading the header, for Header
+  bool (*check)(const uint8_t *data, size_t length); // Whether the parser takes a candidate, for Trailer and Directory
+};
+
+static const std::vector<CarveFormat> &CarveFormats()
+{
+  static const std::vector<CarveFormat> formats = {
+    // A PDF is taken once its cross-reference data loads, a ZIP once its end of central directory record is the one
+    // ending the candidate
+    { "%PDF-", 5, CarveFormat::Trailer, "%%EOF", 5, "pdf", nullptr, [] (const uint8_t *data, size_t length) -> bool {
+      Format_PDF pdf;
+      return pdf.ParseWhole(data, length) && pdf.HasCrossReference();
+    } },
+    { "BM", 2, CarveFormat::Header, nullptr, 0, "bmp", [] () -> std::unique_ptr<Format> { return std::unique_ptr<Format>(new Format_BMP()); }, nullptr },
+    { "MZ", 2, CarveFormat::Header, nullptr, 0, "exe", [] () -> std::unique_ptr<Format> { return std::unique_ptr<Format>(new Format_PE()); }, nullptr },
+    { "PK\3\4", 4, CarveFormat::Directory, "PK\5\6", 4, "zip", nullptr, [] (const uint8_t *data, size_t length) -> bool {
+      Format_ZIP zip;
+      return zip.ParseWhole(data, length) && zip.GetSize() == length;
+    } },
+  };
+  
+  return formats;
+}
+
+struct CarvedObject {
+  uint64_t offset = 0;
+  uint64_t size = 0;
+  size_t format = 0;
+  bool truncated = false; // Runs past the end of the image, only what's there is recovered
+  std::string path;
+};
+
+// The bytes CarveScan has at hand around a match: before it for a PDF's startxref and a ZIP64 locator, from it on for
+// a BMP's or a PE's headers
+static const size_t CarveBefore = 1024 + 128;
+static const size_t CarveAfter = 64 * 1024;
+
+// How far past its start (or its last end found) a PDF stays open: a "%%EOF" further away belongs to something else,
+// and a stray "%PDF-1." in some binary doesn't turn the gigabytes up to one into a document
+static const uint64_t CarvePDFReach = 256 * 1024 * 1024;
+
+// The single pass `carve` makes over an image: every format's magic and end marker are found by one multi-pattern scan
+// of the buffers ReadStream hands over, and handled in order of offset with the bytes around them at hand. Buffers
+// are only joined around their boundaries: matches near the end of one wait for the next.
+class CarveScan {
+  const std::vector<CarveFormat> &formats;
+  MultiPatternMatcher matcher;
+  std::vector<std::pair<size_t, bool>> patterns; // (format, end marker) of each pattern
+  
+  std::string tail;      // The last CarveBefore + CarveAfter bytes before the current buffer
+  uint64_t tail_offset = 0;
+  uint64_t done = 0;     // Matches before this offset are handled
+  uint64_t length = 0;   // Of the image, as far as it's read
+  
+  // The PDF open: where it starts and where its last "%%EOF" with a startxref pointing into it ends (0 before one)
+  uint64_t pdf = UINT64_MAX;
+  uint64_t pdf_end = 0;
+  
+  // ZIP local headers not inside an archive found already, the candidates for an archive's start
+  std::vector<uint64_t> zip_starts;
+  
+  std::vector<CarvedObject> objects;
+  
+  static VectorString Patterns(const std::vector<CarveFormat> &formats)
+  {
+    VectorString patterns;
+    for (const auto &format : formats)
+      patterns.push_back(std::string(format.magic, format.magic_length));
+    for (const auto &format : formats) {
+      if (format.end != nullptr)
+        patterns.push_back(std::string(format.end, format.end_length));
+    }
+    
+    return patterns;
+  }
+  
+  void Add(uint64_t offset, uint64_t size, size_t format)
+  {
+    CarvedObject object;
+    object.offset = offset;
+    object.size = size;
+    object.format = format;
+    objects.push_back(std::move(object));
+  }
+  
+  // A PDF without a "%%EOF" its startxref points back from isn't one
+  void ClosePDF(size_t format)
+  {
+    if (pdf != UINT64_MAX && pdf_end != 0)
+      Add(pdf, pdf_end - pdf, format);
+    
+    pdf = UINT64_MAX;
+  }
+  
+  // A "%%EOF" at `offset` ends the open PDF if the startxref before it points into the document; incremental updates
+  // append more of them, the last such one is the document's end
+  void TrailerEnd(uint64_t offset, const uint8_t *at, size_t before, size_t after, size_t format)
+  {
+    if (pdf == UINT64_MAX)
+      return;
+    
+    if (offset - (pdf_end != 0 ? pdf_end : pdf) > CarvePDFReach) {
+      ClosePDF(format);
+      return;
+    }
+    
+    // Along with its end of line
+    uint64_t end = offset + 5;
+    for (size_t i = 5; i < 7 && i < after && (at[i] == '\r' || at[i] == '\n'); ++i)
+      ++end;
+    
+    const size_t back = (size_t) std::min<uint64_t>(std::min(before, (size_t) 1024), offset - pdf);
+    const uint8_t *keyword = nullptr;
+    for (auto p = at - back; p + 9 <= at; ++p) {
+      if (memcmp(p, "startxref", 9) == 0)
+        keyword = p;
+    }
+    
+    if (keyword == nullptr)
+      return;
+    
+    auto p = keyword + 9;
+    while (p < at && isspace(*p))
+      ++p;
+    
+    uint64_t xref = 0;
+    int digits = 0;
+    for (; p < at && isdigit(*p) && digits < 19; ++p, ++digits)
+      xref = xref * 10 + (*p - '0');
+    
+    if (digits > 0 && xref < offset - pdf)
+      pdf_end = end;
+  }
+  
+  // An end of central directory record at `offset` ends the archive whose start it points back at: its central
+  // directory ends right where the record (or its ZIP64 counterpart) starts. Records of archives inside another one
+  // point at the inner archive. The ZIP64 record is taken to be right before its locator, there's no extensible data
+  // in practice.
+  void DirectoryEnd(uint64_t offset, const uint8_t *at, size_t before, size_t after, size_t format)
+  {
+    if (after < 22)
+      return;
+    
+    uint64_t count = LoadLE<uint16_t>(at + 10);
+    uint64_t directory_size = LoadLE<uint32_t>(at + 12);
+    uint64_t directory_offset = LoadLE<uint32_t>(at + 16);
+    uint64_t end = offset + 22 + LoadLE<uint16_t>(at + 20);
+    uint64_t directory_end = offset;
+    
+    if (directory_offset == 0xffffffff || directory_size == 0xffffffff || count == 0xffff) {
+      if (before < 20 + 56 || LoadLE<uint32_t>(at - 20) != 0x07064b50 || LoadLE<uint32_t>(at - 76) != 0x06064b50)
+        return;
+      
+      directory_end = offset - 76;
+      directory_size = LoadLE<uint64_t>(at - 76 + 40);
+      directory_offset = LoadLE<uint64_t>(at - 76 + 48);
+      
+      // Where the locator says the ZIP64 record is, relative to the archive's start
+      if (directory_size > directory_end || LoadLE<uint64_t>(at - 20 + 8) != directory_offset + directory_size)
+        return;
+    }
+    
+    if (directory_size > directory_end || directory_offset > directory_end - directory_size)
+      return;
+    
+    auto start = directory_end - directory_size - directory_offset;
+    auto it = std::lower_bound(zip_starts.begin(), zip_starts.end(), start);
+    if (it == zip_starts.end() || *it != start)
+      return;
+    
+    // The archive's own local headers (and those of archives stored in it) start nothing
+    zip_starts.erase(it, zip_starts.end());
+    Add(start, end - start, format);
+  }
+  
+  void Match(uint64_t offset, size_t pattern, const uint8_t *at, size_t before, size_t after)
+  {
+    auto index = patterns[pattern].first;
+    const auto &format = formats[index];
+    
+    if (patterns[pattern].second) {
+      if (format.ending == CarveFormat::Trailer)
+        TrailerEnd(offset, at, before, after, index);
+      else
+        DirectoryEnd(offset, at, before, after, index);
+      return;
+    }
+    
+    switch (format.ending) {
+      case CarveFormat::Header: {
+        auto parser = format.create();
+        if (parser->Parse(at, after) && parser->GetSize() > 0)
+          Add(offset, parser->GetSize(), index);
+        break;
+      }
+      
+      // "%PDF-1.7", the next PDF ends the one before
+      case CarveFormat::Trailer:
+        if (after >= 8 && isdigit(at[5]) && at[6] == '.') {
+          ClosePDF(index);
+          pdf = offset;
+          pdf_end = 0;
+        }
+        break;
+      
+      case CarveFormat::Directory:
+        zip_starts.push_back(offset);
+        break;
+    }
+  }
+  
+public:
+  explicit CarveScan(const std::vector<CarveFormat> &formats) : formats(formats), matcher(Patterns(formats))
+  {
+    for (size_t i = 0; i < formats.size(); ++i)
+      patterns.push_back(std::make_pair(i, false));
+    for (size_t i = 0; i < formats.size(); ++i) {
+      if (formats[i].end != nullptr)
+        patterns.push_back(std::make_pair(i, true));
+    }
+  }
+  
+  // The buffer at `position` of the image, buffers have to come in order
+  void Consume(const uint8_t *data, size_t size, uint64_t position, bool last)
+  {
+    if (size == 0)
+      return;
+    
+    // Matches are handled once CarveAfter bytes from them are at hand, or the image ends
+    length = position + size;
+    uint64_t ready = last ? length : length - std::min<uint64_t>(length, CarveAfter);
+    
+    // Those up to CarveBefore bytes into this buffer, with the end of the previous one in front of them
+    size_t joined = std::min(size, CarveBefore + CarveAfter);
+    uint64_t boundary = joined == size ? ready : std::min(position + CarveBefore, ready);
+    std::string joint = tail + std::string((const char *) data, joined);
+    
+    if (boundary > tail_offset) {
+      matcher.Scan((const uint8_t *) joint.data(), joint.length(), (size_t) (boundary - tail_offset), [&] (size_t at, size_t pattern) -> void {
+        if (tail_offset + at >= done)
+          Match(tail_offset + at, pattern, (const uint8_t *) joint.data() + at, at, joint.length() - at);
+      });
+    }
+    
+    if (ready > boundary) {
+      matcher.Scan(data, size, (size_t) (ready - position), [&] (size_t at, size_t pattern) -> void {
+        if (position + at >= boundary)
+          Match(position + at, pattern, data + at, at, size - at);
+      });
+    }
+    
+    done = std::max(done, ready);
+    
+    const size_t keep = CarveBefore + CarveAfter;
+    if (size >= keep) {
+      tail.assign((const char *) data + size - keep, keep);
+    } else {
+      tail.append((const char *) data, size);
+      if (tail.length() > keep)
+        tail.erase(0, tail.length() - keep);
+    }
+    tail_offset = length - tail.length();
+  }
+  
+  // Every object found, in order of offset and cut at the end of the image. Objects inside others are still there:
+  // which ones stay is up to OutermostObjects(), once the candidates have been checked.
+  std::vector<CarvedObject> Finish()
+  {
+    for (size_t i = 0; i < formats.size(); ++i) {
+      if (formats[i].ending == CarveFormat::Trailer)
+        ClosePDF(i);
+    }
+    
+    std::stable_sort(objects.begin(), objects.end(), [] (const CarvedObject &a, const CarvedObject &b) -> bool {
+      return a.offset < b.offset;
+    });
+    
+    std::vector<CarvedObject> found;
+    for (auto &object : objects) {
+      if (object.offset >= length)
+        continue;
+      
+      object.truncated = object.size > length - object.offset;
+      object.size = std::min(object.size, length - object.offset);
+      found.push_back(std::move(object));
+    }
+    
+    return found;
+  }
+};
+
+// The objects (in order of offset) not inside another one: a BMP in a PE's resources or a ZIP stored in another is
+// left to the object holding it
+static std::vector<CarvedObject> OutermostObjects(std::vector<CarvedObject> &objects)
+{
+  std::vector<CarvedObject> outermost;
+  uint64_t end = 0;
+  
+  for (auto &object : objects) {
+    if (object.offset < end)
+      continue;
+    
+    end = object.offset + object.size;
+    outermost.push_back(std::move(object));
+  }
+  
+  return outermost;
+}
+
+// Copies [offset, offset + size) of the source to a new file
+static bool WriteSourceRange(ByteSource &source, uint64_t offset, uint64_t size, const std::string &path)
+{
+  HANDLE file = CreateFileA(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+    return false;
+  
+  bool success = true;
+  for (uint64_t done = 0; success && done < size; ) {
+    size_t length = (size_t) std::min<uint64_t>(size - done, 4 * 1024 * 1024);
+    auto data = source.Get(offset + done, length);
+    
+    DWORD written = 0;
+    success = data != nullptr && WriteFile(file, data, (DWORD) length, &written, nullptr) && written == length;
+    done += length;
+  }
+  
+  CloseHandle(file);
+  
+  if (!success)
+    DeleteFileA(path.c_str());
+  return success;
+}
+
+// Recovers the PDF, BMP, PE and ZIP files in a disk image (or device) into `directory`, named by their offset:
+//   1. the image is streamed once by CarveScan, which finds every format's magic and end marker in a single
+//      multi-pattern scan and pairs them (or has the parser read the header) as it goes, so objects can be any size,
+//   2. the candidates paired by their markers are read as a whole by their parser, and those it rejects are dropped,
+//   3. the objects left are written out, concurrently.
+static std::vector<CarvedObject> CarveImage(const char *path, const std::string &directory, bool &success)
+{
+  TRACE_SCOPE("CarveImage");
+  
+  const auto &formats = CarveFormats();
+  CarveScan scan(formats);
+  uint64_t position = 0;
+  
+  success = ReadStream(path, [&] (const uint8_t *data, size_t size, bool last) -> void {
+    scan.Consume(data, size, position, last);
+    position += size;
+  });
+  if (!success)
+    return std::vector<CarvedObject>();
+  
+  // Groups of consecutive objects share a ByteSource (and mostly its mapped window)
+  const size_t group = 64;
+  
+  auto candidates = scan.Finish();
+  std::vector<char> valid(candidates.size(), 1);
+  Workers().ParallelFor((candidates.size() + group - 1) / group, [&] (size_t g) -> void {
+    ByteSource source(path);
+    
+    for (size_t i = g * group; i < std::min(candidates.size(), (g + 1) * group); ++i) {
+      const auto &object = candidates[i];
+      auto check = formats[object.format].check;
+      if (check == nullptr)
+        continue;
+      
+      auto data = source.GetWhole(object.offset, object.size);
+      valid[i] = data != nullptr && check(data, (size_t) object.size);
+    }
+  });
+  
+  std::vector<CarvedObject> checked;
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    if (valid[i])
+      checked.push_back(std::move(candidates[i]));
+  }
+  
+  auto found = OutermostObjects(checked);
+  for (auto &object : found) {
+    char name[32];
+    snprintf(name, sizeof(name), "%012" PRIx64 ".%s", object.offset, formats[object.format].extension);
+    object.path = directory + "\\" + name;
+  }
+  
+  if (!found.empty() && !CreateDirectoryA(directory.c_str(), nullptr) && GetLastError() != ERROR_ALREADY_EXISTS) {
+    success = false;
+    return found;
+  }
+  
+  std::vector<char> written(found.size(), 0);
+  Workers().ParallelFor((found.size() + group - 1) / group, [&] (size_t g) -> void {
+    ByteSource source(path);
+    
+    for (size_t i = g * group; i < std::min(found.size(), (g + 1) * group); ++i)
+      written[i] = WriteSourceRange(source, found[i].offset, found[i].size, found[i].path);
+  });
+  
+  for (size_t i = 0; i < found.size(); ++i) {
+    if (!written[i])
+      found[i].path.clear();
+  }
+  
+  return found;
+}
+
+// One color channel of a bitfield pixel, scaled to 8 bits. A channel without a mask (alpha, mostly) reads as 255.
+struct BitfieldChannel {
+  uint32_t mask = 0;
+  uint32_t shift = 0;
+  uint32_t maximum = 0;
+  
+  BitfieldChannel() {}
+  explicit BitfieldChannel(uint32_t mask) : mask(mask)
+  {
+    if (mask != 0) {
+      shift = CountTrailingZeros(mask);
+      maximum = mask >> shift;
+    }
+  }
+  
+  uint8_t Get(uint32_t pixel) const
+  {
+    return maximum == 0 ? 255 : (uint8_t) ((uint64_t) ((pixel & mask) >> shift) * 255 / maximum);
+  }
+};
+
+// 4 pixels per 16-byte load (12 bytes used), so the last 5 pixels of a row are left to the caller: a load there would
+// read past the row
+TARGET("ssse3")
+static uint32_t ConvertRow_BGR24_SSSE3(const uint8_t *row, uint8_t *rgba, uint32_t width)
+{
+  const __m128i shuffle = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+  const __m128i alpha = _mm_set1_epi32((int) 0xff000000);
+  uint32_t x = 0;
+  
+  for (; x + 6 <= width; x += 4) {
+    __m128i pixels = _mm_loadu_si128((const __m128i *) (row + 3 * x));
+    _mm_storeu_si128((__m128i *) (rgba + 4 * x), _mm_or_si128(_mm_shuffle_epi8(pixels, shuffle), alpha));
+  }
+  
+  return x;
+}
+
+TARGET("ssse3")
+static uint32_t ConvertRow_BGRA32_SSSE3(const uint8_t *row, uint8_t *rgba, uint32_t width, bool has_alpha)
+{
+  const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+  const __m128i alpha = _mm_set1_epi32(has_alpha ? 0 : (int) 0xff000000);
+  uint32_t x = 0;
+  
+  for (; x + 4 <= width; x += 4) {
+    __m128i pixels = _mm_loadu_si128((const __m128i *) (row + 4 * x));
+    _mm_storeu_si128((__m128i *) (rgba + 4 * x), _mm_or_si128(_mm_shuffle_epi8(pixels, shuffle), alpha));
+  }
+  
+  return x;
+}
+
+// Converts the stored rows of one bitmap to RGBA. 24-bit and 8-8-8(-8) 32-bit rows, the bulk of large bitmaps, go
+// through SSSE3 byte shuffles; palettes, 16 bits and odd bitfields are converted a pixel at a time.
+class BMPRowConverter {
+  const Format_BMP &bmp;
+  BitfieldChannel channels[4];
+  bool bgra = false;
+  
+public:
+  explicit BMPRowConverter(const Format_BMP &bmp) : bmp(bmp)
+  {
+    const uint32_t *masks = bmp.GetMasks();
+    for (int i = 0; i < 4; ++i)
+      channels[i] = BitfieldChannel(masks[i]);
+    
+    bgra = bmp.GetBPP() == 32 && masks[0] == 0x00ff0000 && masks[1] == 0x0000ff00 && masks[2] == 0x000000ff &&
+      (masks[3] == 0 || masks[3] == 0xff000000);
+  }
+  
+  void Convert(const uint8_t *row, uint8_t *rgba, uint32_t width) const
+  {
+    const auto bpp = bmp.GetBPP();
+    const auto &palette = bmp.GetPalette();
+    uint32_t x = 0;
+    
+    if (GetCPUFeatures().SSSE3) {
+      if (bpp == 24)
+        x = ConvertRow_BGR24_SSSE3(row, rgba, width);
+      else if (bgra)
+        x = ConvertRow_BGRA32_SSSE3(row, rgba, width, bmp.GetMasks()[3] != 0);
+    }
+    
+    for (; x < width; ++x) {
+      uint32_t color;
+      
+      if (bpp <= 8) {
+        // Leftmost pixel in the highest bits
+        uint32_t bit = x * bpp;
+        uint32_t index = (row[bit / 8] >> (8 - bpp - bit % 8)) & ((1u << bpp) - 1);
+        color = index < palette.size() ? palette[index] : 0xff000000;
+      } else if (bpp == 24) {
+        color = row[3 * x + 2] | (row[3 * x + 1] << 8) | (row[3 * x] << 16) | 0xff000000u;
+      } else {
+        uint32_t pixel = bpp == 16 ? LoadLE<uint16_t>(row + 2 * x) : LoadLE<uint32_t>(row + 4 * x);
+        color = channels[0].Get(pixel) | (channels[1].Get(pixel) << 8) | (channels[2].Get(pixel) << 16) | ((uint32_t) channels[3].Get(pixel) << 24);
+      }
+      
+      memcpy(rgba + 4 * x, &color, 4);
+    }
+  }
+};
+
+// Sequential reads through a ByteSource, a byte at a time, for the RLE decoder
+struct ByteCursor {
+  ByteSource &source;
+  uint64_t position;
+  uint64_t end;
+  const uint8_t *data = nullptr;
+  size_t available = 0;
+  bool failed = false;
+  
+  ByteCursor(ByteSource &source, uint64_t position, uint64_t end) : source(source), position(position), end(end) {}
+  
+  uint8_t Next()
+  {
+    if (available == 0) {
+      size_t length = (size_t) std::min<uint64_t>(end - std::min(position, end), 1024 * 1024);
+      data = length != 0 ? source.Get(position, length) : nullptr;
+      
+      if (data == nullptr || length == 0) {
+        failed = true;
+        return 0;
+      }
+      
+      available = length;
+    }
+    
+    ++position;
+    --available;
+    return *data++;
+  }
+};
+
+// RLE8/RLE4: runs of one palette index, literal runs, and escapes to end a line, end the bitmap or skip ahead. Pixels
+// skipped are left transparent. Always stored bottom-up.
+static bool DecodeBMP_RLE(const Format_BMP &bmp, ByteSource &source, uint64_t offset, const std::function<void(uint32_t, const uint8_t *)> &row)
+{
+  const uint32_t width = (uint32_t) bmp.GetWidth(), height = (uint32_t) bmp.GetHeight();
+  const bool rle4 = bmp.GetCompression() == BI_RLE4;
+  const auto &palette = bmp.GetPalette();
+  
+  if (bmp.IsTopDown())
+    return false;
+  
+  std::vector<uint8_t> rgba((size_t) width * 4, 0);
+  ByteCursor cursor(source, offset + bmp.GetPixelOffset(), std::min(offset + bmp.GetSize(), source.GetSize()));
+  uint32_t x = 0, y = 0;
+  
+  auto Put = [&] (uint8_t index) -> void {
+    if (x < width) {
+      uint32_t color = index < palette.size() ? palette[index] : 0xff000000;
+      memcpy(&rgba[4 * x], &color, 4);
+    }
+    ++x;
+  };
+  
+  auto Flush = [&] () -> void {
+    row(height - 1 - y, rgba.data());
+    std::fill(rgba.begin(), rgba.end(), 0);
+    ++y;
+  };
+  
+  while (y < height) {
+    uint8_t count = cursor.Next();
+    uint8_t value = cursor.Next();
+    if (cursor.failed)
+      return false;
+    
+    if (count > 0) {
+      // RLE4 runs alternate between the two nibbles
+      for (uint32_t i = 0; i < count; ++i)
+        Put(rle4 ? (i & 1 ? value & 15 : value >> 4) : value);
+    } else if (value == 0) {
+      Flush();
+      x = 0;
+    } else if (value == 1) {
+      while (y < height)
+        Flush();
+    } else if (value == 2) {
+      uint8_t dx = cursor.Next();
+      uint8_t dy = cursor.Next();
+      
+      x += dx;
+      for (uint32_t i = 0; i < dy && y < height; ++i)
+        Flush();
+    } else {
+      // Literal run, padded to 16 bits
+      uint8_t byte = 0;
+      for (uint32_t i = 0; i < value; ++i) {
+        if (!rle4 || i % 2 == 0)
+          byte = cursor.Next();
+        Put(rle4 ? (i & 1 ? byte & 15 : byte >> 4) : byte);
+      }
+      
+      if ((rle4 ? (value + 1) / 2 : value) % 2 != 0)
+        cursor.Next();
+    }
+  }
+  
+  return true;
+}
+
+// Decodes the rows [top, bottom) (counted from the top) of an uncompressed bitmap, in the order they're stored
+static bool DecodeBMPRows(const Format_BMP &bmp, ByteSource &source, uint64_t offset, uint32_t top, uint32_t bottom, const std::function<void(uint32_t, const uint8_t *)> &row)
+{
+  if (bmp.GetCompression() != BI_RGB && bmp.GetCompression() != BI_BITFIELDS && bmp.GetCompression() != Format_BMP::BI_ALPHABITFIELDS)
+    return false;
+  
+  const uint32_t width = (uint32_t) bmp.GetWidth(), height = (uint32_t) bmp.GetHeight();
+  const uint64_t stride = bmp.GetStride();
+  const size_t used = (size_t) ((bmp.GetWidth() * bmp.GetBPP() + 7) / 8);
+  
+  BMPRowConverter converter(bmp);
+  std::vector<uint8_t> rgba((size_t) width * 4);
+  
+  bottom = std::min(bottom, height);
+  for (uint32_t i = top; i < bottom; ++i) {
+    // Stored row `stored` is at distance y from the top
+    uint32_t stored = bmp.IsTopDown() ? i : height - bottom + (i - top);
+    uint32_t y = bmp.IsTopDown() ? stored : height - 1 - stored;
+    
+    size_t length = (size_t) stride;
+    auto data = source.Get(offset + bmp.GetPixelOffset() + stored * stride, length);
+    if (data == nullptr || length < used)
+      return false;
+    
+    converter.Convert(data, rgba.data(), width);
+    row(y, rgba.data());
+  }
+  
+  return true;
+}
+
+// Decodes a BMP's pixels to RGBA a row at a time, in the order they're stored (bottom row first for bottom-up
+// bitmaps): `row(y, rgba)` gets each row's distance from the top and its width * 4 bytes. Only one row is held in
+// memory, so a bitmap of any size decodes in constant memory; `offset` is where the BMP starts in the source (0 for
+// a file, a carved object's offset in a disk image). False for JPEG/PNG-compressed and truncated bitmaps, the rows
+// decoded up to that point have been delivered.
+static bool DecodeBMP(const Format_BMP &bmp, ByteSource &source, uint64_t offset, const std::function<void(uint32_t, const uint8_t *)> &row)
+{
+  TRACE_SCOPE("DecodeBMP");
+  
+  if (bmp.GetCompression() == BI_RLE8 || bmp.GetCompression() == BI_RLE4)
+    return DecodeBMP_RLE(bmp, source, offset, row);
+  
+  return DecodeBMPRows(bmp, source, offset, 0, (uint32_t) bmp.GetHeight(), row);
+}
+
+struct RGBAImage {
+  uint32_t width = 0;
+  uint32_t height = 0;
+  std::vector<uint8_t> pixels; // Rows top to bottom, 4 bytes (R, G, B, A) per pixel
+};
+
+// Per-channel sums over `count` RGBA pixels. Channels are widened to 16 bits and summed two pixels per lane, 128
+// loads at a time (2 * 128 * 255 still fits), before going into the 32-bit totals.
+TARGET("sse2")
+static void SumPixels_SSE2(const uint8_t *rgba, uint32_t count, uint32_t sums[4])
+{
+  const __m128i zero = _mm_setzero_si128();
+  __m128i total = zero;
+  uint32_t x = 0;
+  
+  while (x + 4 <= count) {
+    __m128i partial = zero;
+    for (uint32_t end = std::min(count & ~3u, x + 4 * 128); x < end; x += 4) {
+      __m128i pixels = _mm_loadu_si128((const __m128i *) (rgba + 4 * x));
+      partial = _mm_add_epi16(partial, _mm_add_epi16(_mm_unpacklo_epi8(pixels, zero), _mm_unpackhi_epi8(pixels, zero)));
+    }
+    
+    // Even pixels in the low half, odd ones in the high half
+    total = _mm_add_epi32(total, _mm_add_epi32(_mm_unpacklo_epi16(partial, zero), _mm_unpackhi_epi16(partial, zero)));
+  }
+  
+  _mm_storeu_si128((__m128i *) sums, total);
+  for (; x < count; ++x) {
+    for (int c = 0; c < 4; ++c)
+      sums[c] += rgba[4 * x + c];
+  }
+}
+
+static void SumPixels_Scalar(const uint8_t *rgba, uint32_t count, uint32_t sums[4])
+{
+  sums[0] = sums[1] = sums[2] = sums[3] = 0;
+  for (uint32_t x = 0; x < count; ++x) {
+    for (int c = 0; c < 4; ++c)
+      sums[c] += rgba[4 * x + c];
+  }
+}
+
+// Box-filter downscaling fed one source row at a time, in any order: each thumbnail pixel is the average of the
+// source pixels falling into it. Only the thumbnail's sums are kept, never the source. Rows belonging to different
+// thumbnail rows (see GetSourceRows) may be added concurrently.
+class Thumbnailer {
+  uint32_t source_width, source_height;
+  RGBAImage image;
+  std::vector<uint32_t> column_starts; // First source column of each thumbnail column, and the source width
+  std::vector<uint32_t> row_counts;    // Source rows added per thumbnail row
+  std::vector<uint64_t> sums;
+  
+public:
+  // The thumbnail fits into maximum_width x maximum_height, with the source's aspect ratio. Sources already small
+  // enough keep their size.
+  Thumbnailer(uint32_t source_width, uint32_t source_height, uint32_t maximum_width, uint32_t maximum_height)
+    : source_width(source_width), source_height(source_height)
+  {
+    double scale = std::min(1.0, std::min((double) maximum_width / source_width, (double) maximum_height / source_height));
+    image.width = std::max<uint32_t>(1, (uint32_t) (source_width * scale + 0.5));
+    image.height = std::max<uint32_t>(1, (uint32_t) (source_height * scale + 0.5));
+    
+    // Source column x goes into thumbnail column x * width / source_width
+    column_starts.resize(image.width + 1);
+    for (uint32_t x = 0; x <= image.width; ++x)
+      column_starts[x] = (uint32_t) (((uint64_t) x * source_width + image.width - 1) / image.width);
+    
+    row_counts.resize(image.height, 0);
+    sums.resize((size_t) image.width * image.height * 4, 0);
+  }
+  
+  uint32_t GetWidth() const { return image.width; }
+  uint32_t GetHeight() const { return image.height; }
+  
+  // The source rows [first, last) averaged into thumbnail row `y`
+  void GetSourceRows(uint32_t y, uint32_t &first, uint32_t &last) const
+  {
+    first = (uint32_t) (((uint64_t) y * source_height + image.height - 1) / image.height);
+    last = (uint32_t) (((uint64_t) (y + 1) * source_height + image.height - 1) / image.height);
+  }
+  
+  void AddRow(uint32_t y, const uint8_t *rgba)
+  {
+    if (y >= source_height)
+      return;
+    
+    auto ty = (uint32_t) ((uint64_t) y * image.height / source_height);
+    auto target = &sums[(size_t) ty * image.width * 4];
+    const bool sse2 = GetCPUFeatures().SSE2;
+    ++row_counts[ty];
+    
+    for (uint32_t x = 0; x < image.width; ++x) {
+      uint32_t sum[4];
+      auto first = column_starts[x], count = column_starts[x + 1] - first;
+      
+      if (sse2)
+        SumPixels_SSE2(rgba + 4 * (size_t) first, count, sum);
+      else
+        SumPixels_Scalar(rgba + 4 * (size_t) first, count, sum);
+      
+      for (int c = 0; c < 4; ++c)
+        target[4 * x + c] += sum[c];
+    }
+  }
+  
+  // Rows never added (a truncated bitmap) stay transparent
+  RGBAImage Finish()
+  {
+    image.pixels.resize(sums.size());
+    
+    for (uint32_t y = 0; y < image.height; ++y) {
+      for (uint32_t x = 0; x < image.width; ++x) {
+        uint64_t count = (uint64_t) row_counts[y] * (column_starts[x + 1] - column_starts[x]);
+        size_t at = ((size_t) y * image.width + x) * 4;
+        
+        for (int c = 0; c < 4; ++c)
+          image.pixels[at + c] = count != 0 ? (uint8_t) ((sums[at + c] + count / 2) / count) : 0;
+      }
+    }
+    
+    return std::move(image);
+  }
+};
+
+// A BMP file (or one at `offset` in an image or device) decoded into a thumbnail no larger than maximum_width x
+// maximum_height. Large uncompressed bitmaps are split into bands of thumbnail rows decoded concurrently, each band
+// reading through its own ByteSource. False when it can't be decoded completely, what could be decoded is in `image`
+// then; `image` is left empty for files that aren't BMPs and bitmaps with (undecodable) JPEG or PNG contents.
+static bool MakeBMPThumbnail(const char *path, uint64_t offset, uint32_t maximum_width, uint32_t maximum_height, RGBAImage &image)
+{
+  TRACE_SCOPE("MakeBMPThumbnail");
+  
+  ByteSource source(path);
+  if (!source.IsOpen())
+    return false;
+  
+  // The headers and the palette are in the first few kilobytes
+  size_t length = 64 * 1024;
+  auto data = source.Get(offset, length);
+  
+  Format_BMP bmp;
+  if (data == nullptr || !bmp.Parse(data, length) || bmp.GetCompression() == BI_JPEG || bmp.GetCompression() == BI_PNG)
+    return false;
+  
+  Thumbnailer thumbnailer((uint32_t) bmp.GetWidth(), (uint32_t) bmp.GetHeight(), maximum_width, maximum_height);
+  auto AddRow = [&thumbnailer] (uint32_t y, const uint8_t *rgba) -> void {
+    thumbnailer.AddRow(y, rgba);
+  };
+  
+  bool success;
+  const bool compressed = bmp.GetCompression() == BI_RLE8 || bmp.GetCompression() == BI_RLE4;
+  
+  if (compressed || bmp.GetStride() * bmp.GetHeight() < 16 * 1024 * 1024) {
+    success = DecodeBMP(bmp, source, offset, AddRow);
+  } else {
+    const uint32_t height = thumbnailer.GetHeight();
+    const size_t bands = std::min<size_t>(height, Workers().GetThreadCount() * 2);
+    std::atomic<bool> complete{true};
+    
+    Workers().ParallelFor(bands, [&] (size_t band) -> void {
+      uint32_t first, last, unused;
+      thumbnailer.GetSourceRows((uint32_t) (band * height / bands), first, unused);
+      thumbnailer.GetSourceRows((uint32_t) ((band + 1) * height / bands) - 1, unused, last);
+      
+      ByteSource band_source(path);
+      if (!DecodeBMPRows(bmp, band_source, offset, first, last, AddRow))
+        complete = false;
+    });
+    
+    success = complete;
+  }
+  
+  image = thumbnailer.Finish();
+  return success;
+}
+
+// Nearest color of the xterm 256-color palette: the 6x6x6 cube (levels 0, 95, 135, ..., 255) or the 24-step gray ramp
+static uint8_t ToXterm256(uint8_t r, uint8_t g, uint8_t b)
+{
+  auto Level = [] (uint8_t v) -> int { return v < 48 ? 0 : v < 115 ? 1 : (v - 35) / 40; };
+  auto Value = [] (int level) -> int { return level == 0 ? 0 : 55 + 40 * level; };
+  auto Distance = [r, g, b] (int cr, int cg, int cb) -> int {
+    return (r - cr) * (r - cr) + (g - cg) * (g - cg) + (b - cb) * (b - cb);
+  };
+  
+  int lr = Level(r), lg = Level(g), lb = Level(b);
+  int gray = std::min(23, std::max(0, ((r + g + b) / 3 - 3) / 10));
+  int gv = 8 + 10 * gray;
+  
+  if (Distance(gv, gv, gv) < Distance(Value(lr), Value(lg), Value(lb)))
+    return (uint8_t) (232 + gray);
+  
+  return (uint8_t) (16 + 36 * lr + 6 * lg + lb);
+}
+
+// Renders an image as rows of upper half blocks (U+2580), the foreground color painting the top pixel and the
+// background the bottom one, so every character cell shows two square-ish pixels. Colors are VT sequences, 24-bit or
+// the 256-color palette, sent only when they change. Transparency is blended over black.
+static std::string RenderHalfBlocks(const RGBAImage &image, bool truecolor)
+{
+  TRACE_SCOPE("RenderHalfBlocks");
+  
+  std::string out;
+  out.reserve((size_t) image.width * (image.height + 1) / 2 * (truecolor ? 24 : 12));
+  
+  auto Pixel = [&image] (uint32_t x, uint32_t y) -> uint32_t {
+    auto p = &image.pixels[((size_t) y * image.width + x) * 4];
+    return (p[0] * p[3] / 255) | (p[1] * p[3] / 255) << 8 | (p[2] * p[3] / 255) << 16;
+  };
+  
+  // `color` is 0xBBGGRR, or a palette index
+  auto Color = [&out, truecolor] (int layer, uint32_t color) -> void {
+    char sequence[32];
+    
+    if (truecolor)
+      snprintf(sequence, sizeof(sequence), "\x1b[%i;2;%u;%u;%um", layer, color & 0xff, (color >> 8) & 0xff, color >> 16);
+    else
+      snprintf(sequence, sizeof(sequence), "\x1b[%i;5;%um", layer, color);
+    
+    out += sequence;
+  };
+  
+  for (uint32_t y = 0; y < image.height; y += 2) {
+    uint32_t foreground = UINT32_MAX, background = UINT32_MAX;
+    
+    // An odd last row has nothing below it, it keeps the console's own background
+    const bool single = y + 1 == image.height;
+    if (single)
+      out += "\x1b[49m";
+    
+    for (uint32_t x = 0; x < image.width; ++x) {
+      uint32_t top = Pixel(x, y), bottom = single ? background : Pixel(x, y + 1);
+      
+      // The 256-color palette maps neighbouring colors to one index, compare what is actually sent
+      if (!truecolor) {
+        top = ToXterm256(top & 0xff, (top >> 8) & 0xff, top >> 16);
+        bottom = single ? background : ToXterm256(bottom & 0xff, (bottom >> 8) & 0xff, bottom >> 16);
+      }
+      
+      if (top != foreground)
+        Color(38, top);
+      if (bottom != background)
+        Color(48, bottom);
+      
+      foreground = top;
+      background = bottom;
+      out += "\xe2\x96\x80";
+    }
+    
+    out += "\x1b[0m\n";
+  }
+  
+  return out;
+}
+
+// Writes a UTF-8 frame containing VT sequences in one call. The console has to be switched to VT processing for it;
+// captured or redirected output gets the bytes unchanged.
+static void WriteFrame(const std::string &frame)
+{
+  HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
+  DWORD mode;
+  
+  if (ConsoleCapture != nullptr || !GetConsoleMode(console, &mode)) {
+    ConsolePrint("%s", frame.c_str());
+    return;
+  }
+  
+  std::wstring wide(MultiByteToWideChar(CP_UTF8, 0, frame.data(), (int) frame.length(), nullptr, 0), L'\0');
+  MultiByteToWideChar(CP_UTF8, 0, frame.data(), (int) frame.length(), &wide[0], (int) wide.length());
+  
+  fflush(stdout);
+  SetConsoleMode(console, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+  WriteConsoleW(console, wide.data(), (DWORD) wide.length(), nullptr, nullptr);
+  SetConsoleMode(console, mode);
+}
+
+struct BenchResult {
+  uint64_t operations = 0;
+  uint64_t bytes = 0;
+  double milliseconds = 0;
+  std::vector<double> latency; // Per read, in microseconds, sorted
+  
+  double GetPercentile(double p) const
+  {
+    if (latency.empty())
+      return 0;
+    
+    return latency[std::min(latency.size() - 1, (size_t) (p / 100.0 * latency.size()))];
+  }
+};
+
+// Reads `block_size` blocks from the device for `seconds`, keeping `queue_depth` reads in flight through a completion
+// port. Sequential runs wrap around at the end of the device, random ones pick any block-aligned offset. The handle
+// must be open with FILE_FLAG_OVERLAPPED and FILE_FLAG_NO_BUFFERING (so the file cache doesn't answer for the device).
+static bool RunBenchmark(HANDLE handle, uint64_t size, uint32_t block_size, uint32_t queue_depth, bool random, double seconds, BenchResult *result)
+{
+  TRACE_SCOPE("RunBenchmark");
+  
+  struct Request {
+    OVERLAPPED overlapped; // Completions are mapped back to the request from it with CONTAINING_RECORD
+    double start;
+    std::unique_ptr<AlignedBuffer> buffer;
+  };
+  
+  const uint64_t blocks = size / block_size;
+  if (blocks == 0)
+    return false;
+  
+  HANDLE port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1);
+  if (port == nullptr)
+    return false;
+  
+  // A handle stays associated with a port until it's closed, so the benchmark gets a handle of its own
+  HANDLE h = ReOpenFile(handle, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING);
+  if (h == INVALID_HANDLE_VALUE || CreateIoCompletionPort(h, port, 0, 0) == nullptr) {
+    if (h != INVALID_HANDLE_VALUE)
+      CloseHandle(h);
+    CloseHandle(port);
+    return false;
+  }
+  
+  // xorshift64, the quality doesn't matter but the cost does
+  uint64_t state = (uint64_t) GetMilliseconds() | 1;
+  uint64_t next_block = 0;
+  
+  auto NextOffset = [&] () -> uint64_t {
+    if (random) {
+      state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+      return (state % blocks) * block_size;
+    }
+    
+    auto offset = next_block * block_size;
+    next_block = (next_block + 1) % blocks;
+    return offset;
+  };
+  
+  auto Submit = [&] (Request *request) -> bool {
+    auto offset = NextOffset();
+    memset(&request->overlapped, 0, sizeof(request->overlapped));
+    request->overlapped.Offset = (DWORD) offset;
+    request->overlapped.OffsetHigh = (DWORD) (offset >> 32);
+    request->start = GetMilliseconds();
+    
+    return ReadFile(h, request->buffer->Get(), block_size, nullptr, &request->overlapped) || GetLastError() == ERROR_IO_PENDING;
+  };
+  
+  std::vector<Request> requests(queue_depth);
+  uint32_t outstanding = 0;
+  bool success = true;
+  
+  const double start = GetMilliseconds();
+  const double stop = start + seconds * 1000.0;
+  
+  for (auto &request : requests) {
+    request.buffer.reset(new AlignedBuffer(block_size));
+    if (request.buffer->Get() == nullptr || !Submit(&request)) {
+      success = false;
+      break;
+    }
+    
+    ++outstanding;
+  }
+  
+  while (outstanding > 0) {
+    DWORD transferred = 0;
+    ULONG_PTR key = 0;
+    LPOVERLAPPED overlapped = nullptr;
+    
+    BOOL completed = GetQueuedCompletionStatus(port, &transferred, &key, &overlapped, INFINITE);
+    if (overlapped == nullptr) {
+      // The port failed. The reads in flight are cancelled and collected before the buffers go away; any that don't
+      // complete even so keep their requests (moving the vector keeps them in place), leaked rather than freed.
+      success = false;
+      CancelIoEx(h, nullptr);
+      
+      while (outstanding > 0 && (GetQueuedCompletionStatus(port, &transferred, &key, &overlapped, 5000) || overlapped != nullptr))
+        --outstanding;
+      
+      if (outstanding > 0)
+        new std::vector<Request>(std::move(requests));
+      break;
+    }
+    
+    auto request = CONTAINING_RECORD(overlapped, Request, overlapped);
+    auto now = GetMilliseconds();
+    --outstanding;
+    
+    if (!completed || transferred != block_size) {
+      success = false;
+      continue;
+    }
+    
+    result->operations += 1;
+    result->bytes += block_size;
+    result->latency.push_back((now - request->start) * 1000.0);
+    
+    if (success && now < stop) {
+      if (Submit(request))
+        ++outstanding;
+      else
+        success = false;
+    }
+  }
+  
+  result->milliseconds = GetMilliseconds() - start;
+  std::sort(result->latency.begin(), result->latency.end());
+  
+  CloseHandle(h);
+  CloseHandle(port);
+  return success && result->operations > 0;
+}
+
+static void PrintBenchResult(const char *name, const BenchResult &result)
+{
+  auto seconds = result.milliseconds / 1000.0;
+  
+  ConsolePrint("%-22s %9.1f MiB/s %9.0f IOPS   lat us: p50 %7.0f  p90 %7.0f  p99 %7.0f  p99.9 %7.0f  max %7.0f\n", name,
+    result.bytes / 1024.0 / 1024.0 / seconds, result.operations / seconds, result.GetPercentile(50), result.GetPercentile(90),
+    result.GetPercentile(99), result.GetPercentile(99.9), result.latency.empty() ? 0 : result.latency.back());
+}
+
+static void PrintFileSystem(const FileSystemInfo &fs)
+{
+  if (fs.type.empty()) {
+    ConsolePrint("    FS: ???\n");
+    return;
+  }
+  
+  ConsolePrint("    FS: %s\n", fs.type.c_str());
+  if (!fs.label.empty())
+    ConsolePrint("      Label: %s\n", fs.label.c_str());
+  if (!fs.uuid.empty())
+    ConsolePrint("      UUID: %s\n", fs.uuid.c_str());
+  ConsolePrint("      Block size: %u bytes\n", fs.block_size);
+  ConsolePrint("      Blocks: %" PRIu64 " (%" PRIu64 " MiB)\n", fs.total_blocks, fs.GetTotalBytes() / 1024 / 1024);
+  
+  if (fs.usage_known) {
+    ConsolePrint("      Used: %" PRIu64 " MiB (%i%%)\n", fs.GetUsedBytes() / 1024 / 1024,
+      fs.total_blocks ? (int) ((fs.total_blocks - std::min(fs.free_blocks, fs.total_blocks)) * 100 / fs.total_blocks) : 0);
+    ConsolePrint("      Free: %" PRIu64 " MiB\n", fs.GetFreeBytes() / 1024 / 1024);
+  }
+  
+  if (fs.total_inodes != 0)
+    ConsolePrint("      Inodes: %" PRIu64 ", %" PRIu64 " free\n", fs.total_inodes, fs.free_inodes);
+  
+  if (!fs.features.empty()) {
+    std::string features;
+    for (const auto &feature : fs.features)
+      features += (features.empty() ? "" : " ") + feature;
+    ConsolePrint("      Features: %s\n", features.c_str());
+  }
+}
+
+static void PrintDevice(const DeviceInfo &device)
+{
+  if (!device.valid)
+    return;
+  
+  if (!device.path.empty())
+    ConsolePrint("Image: %s\n", device.path.c_str());
+  else
+    ConsolePrint("ID: #%i\n", device.number);
+  
+  ConsolePrint("SSD: %i\n", device.SSD);
+  ConsolePrint("Cylinders: %i\n", device.cylinders);
+  ConsolePrint("Sector size: %i bytes\n", device.sector_size);
+  ConsolePrint("Size: %" PRIu64 " GiB\n", (device.sectors * device.sector_size) / 1024 / 1024 / 1024);
+  
+  if (!device.scheme.empty()) {
+    ConsolePrint("Partition table: %s%s\n", device.scheme.c_str(), device.GPT_backup ? " (primary damaged, using backup)" : "");
+    if (!device.disk_guid.empty())
+      ConsolePrint("Disk GUID: %s\n", device.disk_guid.c_str());
+  }
+  
+  if (device.cache_hits + device.cache_misses != 0)
+    ConsolePrint("Block cache: %" PRIu64 " hits, %" PRIu64 " misses\n", device.cache_hits, device.cache_misses);
+  
+  for (const auto &partition : device.partition) {
+    ConsolePrint("  Partition #%u: %s%s\n", partition.index, partition.type_name.c_str(), partition.logical ? " (logical)" : "");
+    if (!partition.name.empty())
+      ConsolePrint("    Name: %s\n", partition.name.c_str());
+    if (!partition.unique_guid.empty())
+      ConsolePrint("    GUID: %s\n", partition.unique_guid.c_str());
+    if (partition.HasValidRange())
+      ConsolePrint("    LBA: %" PRIu64 " - %" PRIu64 " (%" PRIu64 " MiB)\n", partition.first_lba, partition.last_lba,
+        (partition.last_lba - partition.first_lba + 1) * device.sector_size / 1024 / 1024);
+    else
+      ConsolePrint("    LBA: %" PRIu64 " - %" PRIu64 " (invalid, ends before it starts)\n", partition.first_lba, partition.last_lba);
+    if (partition.attributes != 0)
+      ConsolePrint("    Attributes: 0x%016" PRIx64 "\n", partition.attributes);
+    ConsolePrint("    Bootable: %i\n", partition.bootable);
+    PrintFileSystem(partition.fs);
+  }
+  
+  for (const auto &drive : device.drive) {
+    ConsolePrint("  Name: %s\n", drive.name.c_str());
+    ConsolePrint("    Parent: #%i\n", drive.disk);
+    ConsolePrint("    Number: #%i\n", drive.number);
+    PrintFileSystem(drive.fs);
+    ConsolePrint("    GPT: %i\n", drive.GPT);
+    ConsolePrint("    Sectors: %i\n", drive.sectors);
+    ConsolePrint("    Starting Offset: %" PRIu64 " \n", drive.offset);
+    ConsolePrint("    Size: %" PRIu64 " bytes (%" PRIu64 " MiB)\n", drive.size, drive.size / 1024 / 1024);
+    
+    if (drive.GPT) {
+      ConsolePrint("      GPT type: %s\n", drive.GPT_Type.c_str());
+    } else {
+      ConsolePrint("      MBR boot: %i\n", drive.MBR_Boot);
+    }
+  }
+}
+
+static void PrintBMP(const Format_BMP &BMPFile)
+{
+  ConsolePrint("BMP Size: %i\n", BMPFile.GetSize());
+  ConsolePrint("BMP Width/Height: %ix%i\n", BMPFile.GetWidth(), BMPFile.GetHeight());
+  ConsolePrint("BMP Planes: %i\n", BMPFile.GetPlaneCount());
+  ConsolePrint("BMP BPP: %i\n", BMPFile.GetBPP());
+  
+  static const char *compressions[] = { "none", "RLE8", "RLE4", "bitfields", "JPEG", "PNG", "bitfields with alpha" };
+  ConsolePrint("BMP Compression: %s\n", compressions[BMPFile.GetCompression()]);
+  ConsolePrint("BMP Rows: %s\n", BMPFile.IsTopDown() ? "top-down" : "bottom-up");
+  if (!BMPFile.GetPalette().empty())
+    ConsolePrint("BMP Palette: %zu colors\n", BMPFile.GetPalette().size());
+}
+
+static void PrintPDF(const Format_PDF &PDFFile)
+{
+  ConsolePrint("PDF Size: %i\n", PDFFile.GetSize());
+  ConsolePrint("PDF Version: %s\n", PDFFile.GetVersion().c_str());
+  
+  if (!PDFFile.HasCrossReference()) {
+    ConsolePrint("PDF Cross-reference: damaged or missing\n");
+    return;
+  }
+  
+  ConsolePrint("PDF Objects: %zu\n", PDFFile.GetObjectCount());
+  if (PDFFile.GetPageCount() >= 0)
+    ConsolePrint("PDF Pages: %" PRId64 "\n", PDFFile.GetPageCount());
+  ConsolePrint("PDF Encrypted: %s\n", PDFFile.IsEncrypted() ? "yes" : "no");
+  for (const auto &entry : PDFFile.GetInfo())
+    ConsolePrint("PDF %s: %s\n", entry.first.c_str(), entry.second.c_str());
+}
+
+static void PrintPE(const Format_PE &PEFile)
+{
+  ConsolePrint("PE Checksum: 0x%02hhx\n", PEFile.GetChecksum());
+  ConsolePrint("PE Section Count: %i\n", PEFile.GetSectionCount());
+  ConsolePrint("PE 32-bit: %i\n", !PEFile.Is64Bit());
+  ConsolePrint("PE Linker Version: %i.%i\n", PEFile.GetMajorLinkerVersion(), PEFile.GetMinorLinkerVersion());
+  ConsolePrint("PE Required OS Version: %i.%i\n", PEFile.GetMajorOSVersion(), PEFile.GetMinorOSVersion());
+  ConsolePrint("PE Image Version: %i.%i\n", PEFile.GetMajorImageVersion(), PEFile.GetMinorImageVersion());
+  ConsolePrint("PE Stack Size: %i KiB\n", PEFile.GetStackSize() / 1024 ^ 2);
+  ConsolePrint("PE Properties:\n");
+  for (const auto &c : PEFile.GetProperties())
+    ConsolePrint("  %s\n", c);
+  ConsolePrint("\n");
+}
+
+static void PrintZIP(const Format_ZIP &ZIPFile)
+{
+  ConsolePrint("ZIP Version: %i\n", ZIPFile.GetVersion());
+  ConsolePrint("ZIP Entries: %" PRIu64 "\n", ZIPFile.GetEntryCount());
+  ConsolePrint("ZIP Compressed/Uncompressed: %u / %u\n", ZIPFile.GetCompressedSize(), ZIPFile.GetUncompressedSize());
+  ConsolePrint("ZIP CRC32: 0x%02hhx\n", ZIPFile.GetCRC32());
+}
+
+static void PrintPlugin(const Format_Plugin &PluginFile)
+{
+  if (!PluginFile.IsReady()) {
+    ConsolePrint("%s: unable to parse\n", PluginFile.GetName());
+    return;
+  }
+  
+  ConsolePrint("%s Size: %" PRIu64 "\n", PluginFile.GetName(), PluginFile.GetSize());
+  for (const auto &property : PluginFile.GetProperties())
+    ConsolePrint("%s %s: %s\n", PluginFile.GetName(), property.first.c_str(), property.second.c_str());
+}
+
+static void PrintDirectory(const char *directory)
+{
+  ConsolePrint("\nDirectory contents of %s\n", directory);
+  uint32_t n = 0;
+  for (const auto &v : TraverseDirectory(directory)) {
+    ConsolePrint("%s %s ", v.attribute.c_str(), v.name.c_str());
+    if (!v.directory) {
+      ConsolePrint("Size: %i\n", v.size);
+    } else {
+      ConsolePrint("\n");
+    }
+    ++n;
+  }
+
+  ConsolePrint("%i files.\n", n);
+}
+
+// CPU time (in 100 ns units) and I/O of a process, or of the external commands a thread has run.
+struct ResourceUsage {
+  uint64_t kernel = 0;
+  uint64_t user = 0;
+  uint64_t read_bytes = 0;
+  uint64_t read_operations = 0;
+  uint64_t write_operations = 0;
+  uint64_t other_operations = 0;
+};
+
+thread_local ResourceUsage ChildUsage;
+
+static ResourceUsage GetResourceUsage()
+{
+  ResourceUsage usage = ChildUsage;
+  
+  FILETIME creation, exit, kernel, user;
+  if (GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user)) {
+    usage.kernel += ((uint64_t) kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+    usage.user += ((uint64_t) user.dwHighDateTime << 32) | user.dwLowDateTime;
+  }
+  
+  IO_COUNTERS io;
+  if (GetProcessIoCounters(GetCurrentProcess(), &io)) {
+    usage.read_bytes += io.ReadTransferCount;
+    usage.read_operations += io.ReadOperationCount;
+    usage.write_operations += io.WriteOperationCount;
+    usage.other_operations += io.OtherOperationCount;
+  }
+  
+  return usage;
+}
+
+// Held from creating an inheritable handle meant for one child until our copy is closed again after CreateProcess().
+// Children inherit every inheritable handle of the shell, so without it a child started meanwhile (by another job, or in
+// the foreground) would keep a job's pipe write end open, and the job wouldn't see the end of its output until that
+// unrelated child exited.
+static std::mutex InheritLock;
+
+// Runs a program found through the PATH index (or by an explicit path) and waits for it to finish. Returns the exit
+// code of the process, or 9009 if the command couldn't be resolved (same as cmd.exe).
+static DWORD RunExternalCommand(const std::string &line, const VectorString &args)
+{
+  std::string path;
+  
+  if (args[0].find_first_of("\\/:") != std::string::npos)
+    path = Executables.FindInPlace(args[0]);
+  else
+    path = Executables.Find(args[0]);
+  
+  if (path.empty()) {
+    ConsolePrint("%s: command not found\n", args[0].c_str());
+    return 9009;
+  }
+  
+  // Batch files can't be started by CreateProcess() directly, they need to go through the command interpreter
+  std::string application = path;
+  std::string command_line = line;
+  auto extension = ToLower(path.substr(path.find_last_of('.')));
+  
+  if (extension == ".bat" || extension == ".cmd") {
+    application = GetEnvironmentString("ComSpec");
+    if (application.empty())
+      application = "C:\\Windows\\System32\\cmd.exe";
+    
+    command_line = "cmd.exe /c \"" + line + "\"";
+  }
+  
+  std::vector<char> buffer(command_line.begin(), command_line.end());
+  buffer.push_back('\0');
+  
+  STARTUPINFOA startup = {0};
+  startup.cb = sizeof(startup);
+  PROCESS_INFORMATION process;
+  
+  // When our output is being captured (background job), the child's output has to be captured too. It also must not
+  // read from the console, otherwise it would steal the keystrokes meant for the prompt.
+  HANDLE output_read = nullptr, output_write = nullptr, null_input = nullptr;
+  std::unique_lock<std::mutex> inherit_guard(InheritLock);
+  
+  if (ConsoleCapture) {
+    SECURITY_ATTRIBUTES attributes = { sizeof(attributes), nullptr, TRUE };
+    
+    if (CreatePipe(&output_read, &output_write, &attributes, 0)) {
+      SetHandleInformation(output_read, HANDLE_FLAG_INHERIT, 0);
+      null_input = CreateFileA("NUL", GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, &attributes, OPEN_EXISTING, 0, nullptr);
+      
+      startup.dwFlags |= STARTF_USESTDHANDLES;
+      startup.hStdInput = null_input;
+      startup.hStdOutput = output_write;
+      startup.hStdError = output_write;
+    }
+  }
+  
+  BOOL started = CreateProcessA(application.c_str(), buffer.data(), nullptr, nullptr, TRUE, 0, nullptr, nullptr, &startup, &process);
+  auto error = GetLastError();
+  
+  // Our copy of the write end has to go away, otherwise ReadFile() below never sees the end of the pipe
+  Cleanup_HANDLE(&output_write);
+  if (null_input != INVALID_HANDLE_VALUE)
+    Cleanup_HANDLE(&null_input);
+  inherit_guard.unlock();
+  
+  if (!started) {
+    Cleanup_HANDLE(&output_read);
+    ConsolePrint("%s: unable to start (error %lu)\n", args[0].c_str(), error);
+    return error;
+  }
+  
+  if (output_read) {
+    char chunk[4096];
+    DWORD read;
+    
+    while (ReadFile(output_read, chunk, sizeof(chunk), &read, nullptr) && read > 0)
+      ConsoleCapture->Append(chunk, read);
+    
+    Cleanup_HANDLE(&output_read);
+  }
+  
+  WaitForSingleObject(process.hProcess, INFINITE);
+  
+  DWORD code = 0;
+  GetExitCodeProcess(process.hProcess, &code);
+  
+  // Accounted to whoever ran the command, so `time` covers the child as well
+  FILETIME creation, exit, kernel, user;
+  if (GetProcessTimes(process.hProcess, &creation, &exit, &kernel, &user)) {
+    ChildUsage.kernel += ((uint64_t) kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+    ChildUsage.user += ((uint64_t) user.dwHighDateTime << 32) | user.dwLowDateTime;
+  }
+  
+  IO_COUNTERS io;
+  if (GetProcessIoCounters(process.hProcess, &io)) {
+    ChildUsage.read_bytes += io.ReadTransferCount;
+    ChildUsage.read_operations += io.ReadOperationCount;
+    ChildUsage.write_operations += io.WriteOperationCount;
+    ChildUsage.other_operations += io.OtherOperationCount;
+  }
+  
+  CloseHandle(process.hThread);
+  CloseHandle(process.hProcess);
+  
+  return code;
+}
+
+using CommandFunction = std::function<void(const VectorString &)>;
+
+// Built-in commands, keyed by their lower-cased name
+std::unordered_map<std::string, CommandFunction> Builtins;
+
+// A command started with a trailing '&'. It runs on the worker pool with its output buffered, and the output is shown
+// between prompts once it finishes (or streamed by `fg`).
+struct Job {
+  unsigned id;
+  std::string command;
+  ConsoleBuffer output;
+  size_t shown = 0;
+  std::atomic<bool> done{false};
+};
+
+static std::vector<std::shared_ptr<Job>> Jobs;
+static std::mutex JobsLock;
+static std::condition_variable JobsCondition;
+static unsigned NextJobID = 1;
+
+static DWORD ExecuteCommand(const std::string &line);
+
+static void StartJob(const std::string &command)
+{
+  auto job = std::make_shared<Job>();
+  job->command = command;
+  
+  {
+    std::lock_guard<std::mutex> guard(JobsLock);
+    
+    // Numbering starts over once every job has been reported
+    if (Jobs.empty())
+      NextJobID = 1;
+    
+    job->id = NextJobID++;
+    Jobs.push_back(job);
+  }
+  
+  ConsolePrint("[%u] %s\n", job->id, command.c_str());
+  
+  Workers().Submit([job] () -> void {
+    ConsoleCapture = &job->output;
+    ExecuteCommand(job->command);
+    ConsoleCapture = nullptr;
+    
+    std::lock_guard<std::mutex> guard(JobsLock);
+    job->done = true;
+    JobsCondition.notify_all();
+  });
+}
+
+static std::shared_ptr<Job> FindJob(const VectorString &args)
+{
+  std::lock_guard<std::mutex> guard(JobsLock);
+  
+  if (Jobs.empty())
+    return nullptr;
+  
+  if (args.size() < 2)
+    return Jobs.back();
+  
+  // Both "fg 2" and "fg %2" are accepted
+  auto id = (unsigned) strtoul(args[1].c_str() + (args[1][0] == '%' ? 1 : 0), nullptr, 10);
+  for (const auto &job : Jobs) {
+    if (job->id == id)
+      return job;
+  }
+  
+  return nullptr;
+}
+
+static void RemoveJob(const std::shared_ptr<Job> &job)
+{
+  std::lock_guard<std::mutex> guard(JobsLock);
+  Jobs.erase(std::remove(Jobs.begin(), Jobs.end(), job), Jobs.end());
+}
+
+// Prints the output of the given job as it arrives, until the job is finished.
+static void ForegroundJob(const std::shared_ptr<Job> &job)
+{
+  bool done = false;
+  
+  while (!done) {
+    {
+      std::unique_lock<std::mutex> guard(JobsLock);
+      JobsCondition.wait_for(guard, std::chrono::milliseconds(100), [&job] () -> bool { return job->done.load(); });
+      done = job->done;
+    }
+    
+    ConsolePrint("%s", job->output.Take(&job->shown).c_str());
+  }
+  
+  RemoveJob(job);
+}
+
+// Called before each prompt. Shows (and forgets) every job that finished since the last prompt.
+static void ReportFinishedJobs()
+{
+  std::vector<std::shared_ptr<Job>> finished;
+  
+  {
+    std::lock_guard<std::mutex> guard(JobsLock);
+    
+    for (const auto &job : Jobs) {
+      if (job->done)
+        finished.push_back(job);
+    }
+  }
+  
+  for (const auto &job : finished) {
+    ConsolePrint("%s", job->output.Take(&job->shown).c_str());
+    ConsolePrint("[%u] Done    %s\n", job->id, job->command.c_str());
+    RemoveJob(job);
+  }
+}
+
+// Runs a single command line and returns its status: the exit code of an external program, 0 for built-ins and jobs.
+static DWORD ExecuteCommand(const std::string &line)
+{
+  TRACE_SCOPE("ExecuteCommand");
+  
+  auto command = line;
+  while (!command.empty() && command.back() == ' ')
+    command.pop_back();
+  
+  if (!command.empty() && command.back() == '&') {
+    command.pop_back();
+    StartJob(command);
+    return 0;
+  }
+  
+  VectorString args = split(command, ' ');
+  args.erase(std::remove(args.begin(), args.end(), std::string()), args.end());
+  
+  if (args.empty())
+    return 0;
+  
+  auto builtin = Builtins.find(ToLower(args[0]));
+  if (builtin != Builtins.end()) {
+    builtin->second(args);
+    return 0;
+  }
+  
+  return RunExternalCommand(command, args);
+}
+
+// Returns the built-ins and PATH executables starting with the given prefix, sorted and without duplicates.
+static VectorString CompleteCommand(const std::string &prefix)
+{
+  auto key = ToLower(prefix);
+  VectorString v = Executables.Complete(key);
+  
+  for (const auto &builtin : Builtins) {
+    if (builtin.first.compare(0, key.length(), key) == 0)
+      v.push_back(builtin.first);
+  }
+  
+  std::sort(v.begin(), v.end());
+  v.erase(std::unique(v.begin(), v.end()), v.end());
+  
+  return v;
+}
+
+static void RegisterBuiltins()
+{
+  Builtins["dir"] = [] (const VectorString &args) -> void {
+    const auto ToPattern = [] (std::string s) -> std::string {
+      if (s[s.length() - 1] != '\\' && s[s.length() - 1] != '/') {
+        s += '\\';
+      }
+      
+      return s + "*.*";
+    };
+    
+    if (args.size() >= 2) {
+      for (size_t i = 1; i < args.size(); ++i) {
+        PrintDirectory(ToPattern(args[i]).c_str());
+      }
+    } else {
+      PrintDirectory(ToPattern(GetWorkingDirectory()).c_str());
+    }
+  };
+  
+  Builtins["cls"] = Builtins["clear"] = [] (const VectorString &args) -> void {
+    if (Interactive)
+      ConsoleClear();
+  };
+  
+  Builtins["type"] = [] (const VectorString &args) -> void {
+    if (args.size() < 2)
+      return;
+    
+    auto extension = ToLower(args[1].substr(args[1].find_last_of(".") + 1));
+    
+    if (extension == "pdf") {
+      PrintPDF(ReadPDF(args[1].c_str()));
+    } else if (extension == "exe") {
+      PrintPE(ReadPE(args[1].c_str()));
+    } else if (extension == "bmp") {
+      PrintBMP(ReadBMP(args[1].c_str()));
+    } else if (extension == "zip") {
+      PrintZIP(ReadZIP(args[1].c_str()));
+    } else if (auto plugin = FindFormatPlugin(args[1].c_str())) {
+      Format_Plugin format(plugin);
+      format.ParseFile(args[1].c_str());
+      PrintPlugin(format);
+    }
+  };
+  
+  // `plugins` lists the format plugins `type` knows about (see format_plugin.hpp)
+  Builtins["plugins"] = [] (const VectorString &args) -> void {
+    FormatPlugins::Get().Print();
+  };
+  
+  // The sample files the format parsers were written against. Used to be parsed on every startup.
+  Builtins["demo"] = [] (const VectorString &args) -> void {
+    PrintBMP(ReadBMP("TestBMP.bmp"));
+    PrintPDF(ReadPDF("TestPDF.pdf"));
+    PrintPE(ReadPE("GetFileSize.exe"));
+    PrintZIP(ReadZIP("TestZIP.zip"));
+  };
+  
+  Builtins["echo"] = [] (const VectorString &args) -> void {
+    std::string line;
+    for (size_t i = 1; i < args.size(); ++i)
+      line += (i > 1 ? " " : "") + args[i];
+    
+    ConsolePrint("%s\n", line.c_str());
+  };
+  
+  // Starts this executable in -c mode a number of times and reports how long it takes until the first byte of command
+  // output arrives and until the process exits.
+  Builtins["bench-startup"] = [] (const VectorString &args) -> void {
+    int runs = args.size() >= 2 ? atoi(args[1].c_str()) : 20;
+    if (runs <= 0)
+      runs = 20;
+    
+    char executable[MAX_PATH];
+    GetModuleFileNameA(nullptr, executable, MAX_PATH);
+    
+    std::vector<double> first_output, total;
+    
+    for (int i = 0; i < runs; ++i) {
+      SECURITY_ATTRIBUTES attributes = { sizeof(attributes), nullptr, TRUE };
+      HANDLE output_read = nullptr, output_write = nullptr;
+      std::unique_lock<std::mutex> inherit_guard(InheritLock);
+      
+      if (!CreatePipe(&output_read, &output_write, &attributes, 0))
+        break;
+      
+      SetHandleInformation(output_read, HANDLE_FLAG_INHERIT, 0);
+      
+      STARTUPINFOA startup = {0};
+      startup.cb = sizeof(startup);
+      startup.dwFlags |= STARTF_USESTDHANDLES;
+      startup.hStdOutput = output_write;
+      startup.hStdError = output_write;
+      
+      auto command_line = std::string("\"") + executable + "\" -c \"echo ready\"";
+      std::vector<char> buffer(command_line.begin(), command_line.end());
+      buffer.push_back('\0');
+      
+      PROCESS_INFORMATION process;
+      auto start = GetMilliseconds();
+      BOOL started = CreateProcessA(executable, buffer.data(), nullptr, nullptr, TRUE, 0, nullptr, nullptr, &startup, &process);
+      Cleanup_HANDLE(&output_write);
+      inherit_guard.unlock();
+      
+      if (!started) {
+        Cleanup_HANDLE(&output_read);
+        ConsolePrint("bench-startup: unable to start %s\n", executable);
+        return;
+      }
+      
+      char chunk[256];
+      DWORD read;
+      bool first = true;
+      
+      while (ReadFile(output_read, chunk, sizeof(chunk), &read, nullptr) && read > 0) {
+        if (first)
+          first_output.push_back(GetMilliseconds() - start);
+        first = false;
+      }
+      
+      WaitForSingleObject(process.hProcess, INFINITE);
+      total.push_back(GetMilliseconds() - start);
+      
+      CloseHandle(process.hThread);
+      CloseHandle(process.hProcess);
+      Cleanup_HANDLE(&output_read);
+    }
+    
+    const auto Report = [] (const char *name, std::vector<double> v) -> void {
+      if (v.empty())
+        return;
+      
+      std::sort(v.begin(), v.end());
+      ConsolePrint("%-20s min %8.3f ms  median %8.3f ms  max %8.3f ms\n", name, v.front(), v[v.size() / 2], v.back());
+    };
+    
+    ConsolePrint("%i runs of -c \"echo ready\"\n", runs);
+    Report("first output", first_output);
+    Report("exit", total);
+  };
+  
+  Builtins["exit"] = [] (const VectorString &args) -> void {
+    ExitFunction();
+  };
+  
+  // `list` shows the PhysicalDrives and their volumes, `list image.img...` the partitions of disk images.
+  Builtins["list"] = [] (const VectorString &args) -> void {
+    if (args.size() >= 2) {
+      VectorString paths(args.begin() + 1, args.end());
+      auto devices = ProbeDevices(paths, true);
+      
+      for (size_t i = 0; i < devices.size(); ++i) {
+        if (!devices[i].valid)
+          ConsolePrint("list: unable to open %s\n", paths[i].c_str());
+        
+        PrintDevice(devices[i]);
+      }
+    } else {
+      for (const auto &device : ListDisk())
+        PrintDevice(device);
+    }
+  };
+  
+  // `bench [-b block size] [-q queue depth] [-t seconds] <device|image>` measures raw read performance, i. e.
+  // `bench \\.\PhysicalDrive0`: sequential reads of the block size (at most 8 in flight), then random 4K reads at
+  // queue depth 1 and at the given depth. Reads only, the device is never written to.
+  Builtins["bench"] = [] (const VectorString &args) -> void {
+    uint32_t block_size = 1024 * 1024;
+    uint32_t queue_depth = 32;
+    double seconds = 3;
+    std::string path;
+    
+    for (size_t i = 1; i < args.size(); ++i) {
+      if (args[i] == "-b" && i + 1 < args.size())
+        block_size = (uint32_t) strtoul(args[++i].c_str(), nullptr, 0);
+      else if (args[i] == "-q" && i + 1 < args.size())
+        queue_depth = (uint32_t) strtoul(args[++i].c_str(), nullptr, 0);
+      else if (args[i] == "-t" && i + 1 < args.size())
+        seconds = atof(args[++i].c_str());
+      else
+        path = args[i];
+    }
+    
+    if (path.empty() || block_size == 0 || block_size % 4096 != 0 || queue_depth == 0 || queue_depth > 1024 || seconds <= 0) {
+      ConsolePrint("usage: bench [-b block size (multiple of 4096)] [-q queue depth (1-1024)] [-t seconds] <device|image>\n");
+      return;
+    }
+    
+    // Devices go through their BlockDevice for the size, the reads themselves bypass it
+    HANDLE handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, nullptr);
+    if (handle == INVALID_HANDLE_VALUE) {
+      ConsolePrint("bench: unable to open %s\n", path.c_str());
+      return;
+    }
+    
+    uint64_t size = 0;
+    LARGE_INTEGER length;
+    if (GetFileSizeEx(handle, &length) && length.QuadPart > 0)
+      size = length.QuadPart;
+    else
+      size = BlockDevice_Handle(handle, 512).GetSize();
+    
+    if (size < block_size) {
+      ConsolePrint("bench: %s is smaller than the block size\n", path.c_str());
+      CloseHandle(handle);
+      return;
+    }
+    
+    ConsolePrint("%s: %" PRIu64 " MiB, %.0f s per test\n", path.c_str(), size / 1024 / 1024, seconds);
+    
+    BenchResult sequential, random_qd1, random;
+    bool success = RunBenchmark(handle, size, block_size, std::min<uint32_t>(queue_depth, 8), false, seconds, &sequential);
+    if (success) {
+      PrintBenchResult(("Sequential " + std::to_string(block_size / 1024) + "K").c_str(), sequential);
+      success = RunBenchmark(handle, size, 4096, 1, true, seconds, &random_qd1);
+    }
+    if (success) {
+      PrintBenchResult("Random 4K QD1", random_qd1);
+      success = RunBenchmark(handle, size, 4096, queue_depth, true, seconds, &random);
+    }
+    if (success)
+      PrintBenchResult(("Random 4K QD" + std::to_string(queue_depth)).c_str(), random);
+    
+    CloseHandle(handle);
+    
+    if (!success) {
+      ConsolePrint("bench: reading %s failed\n", path.c_str());
+      return;
+    }
+    
+    // Rotating disks need a seek (milliseconds) per random read, flash doesn't. NVMe is what keeps scaling with the
+    // queue depth well past what SATA (32 commands) allows.
+    auto latency = random_qd1.GetPercentile(50);
+    auto iops = random.operations / (random.milliseconds / 1000.0);
+    const char *type = latency >= 2000 ? "rotating disk (HDD)" : (iops >= 150000 ? "NVMe SSD" : "SSD");
+    ConsolePrint("Class: %s\n", type);
+    
+    // A long tail on random reads is the usual first sign of a failing disk (retries, remapped sectors)
+    if (random_qd1.GetPercentile(99.9) > 20 * latency && random_qd1.GetPercentile(99.9) > 50000)
+      ConsolePrint("Warning: p99.9 latency is %.0fx the median, the device may be degraded\n", random_qd1.GetPercentile(99.9) / latency);
+  };
+  
+  // `hash [-a blake3|sha256] <file|device>...` prints a checksum per file, like b3sum/sha256sum. BLAKE3 (the default)
+  // hashes on every core, SHA-256 is sequential by design but uses the SHA extensions when the CPU has them.
+  Builtins["hash"] = [] (const VectorString &args) -> void {
+    std::string algorithm = "blake3";
+    VectorString paths;
+    
+    for (size_t i = 1; i < args.size(); ++i) {
+      if (args[i] == "-a" && i + 1 < args.size())
+        algorithm = ToLower(args[++i]);
+      else
+        paths.push_back(args[i]);
+    }
+    
+    if (paths.empty() || (algorithm != "blake3" && algorithm != "sha256")) {
+      ConsolePrint("usage: hash [-a blake3|sha256] <file|device>...\n");
+      return;
+    }
+    
+    for (const auto &path : paths) {
+      uint8_t digest[32];
+      bool success;
+      
+      if (algorithm == "sha256") {
+        SHA256 hasher;
+        success = ReadStream(path.c_str(), [&hasher] (const uint8_t *data, size_t size, bool last) -> void {
+          hasher.Update(data, size);
+        });
+        hasher.Final(digest);
+      } else {
+        BLAKE3 hasher;
+        success = ReadStream(path.c_str(), [&hasher] (const uint8_t *data, size_t size, bool last) -> void {
+          hasher.UpdateParallel(data, size, last);
+        });
+        hasher.Final(digest);
+      }
+      
+      if (success)
+        ConsolePrint("%s  %s\n", ToHex(digest, sizeof(digest)).c_str(), path.c_str());
+      else
+        ConsolePrint("hash: unable to read %s\n", path.c_str());
+    }
+  };
+  
+  // `hexdump [-s offset] [-n length] [-f pattern] <file|image|device>` shows raw bytes. Interactive sessions get a pager
+  // unless -n is given, otherwise `length` bytes (256 by default) are printed. -f starts at the first match of the
+  // pattern (text, or hex bytes after "0x") instead.
+  Builtins["hexdump"] = [] (const VectorString &args) -> void {
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    std::string pattern, path;
+    
+    for (size_t i = 1; i < args.size(); ++i) {
+      if (args[i] == "-s" && i + 1 < args.size())
+        offset = strtoull(args[++i].c_str(), nullptr, 0);
+      else if (args[i] == "-n" && i + 1 < args.size())
+        length = strtoull(args[++i].c_str(), nullptr, 0);
+      else if (args[i] == "-f" && i + 1 < args.size())
+        pattern = ParseBytePattern(args[++i]);
+      else
+        path = args[i];
+    }
+    
+    if (path.empty()) {
+      ConsolePrint("usage: hexdump [-s offset] [-n length] [-f text|0xhex] <file|image|device>\n");
+      return;
+    }
+    
+    ByteSource source(path.c_str());
+    if (!source.IsOpen()) {
+      ConsolePrint("hexdump: unable to open %s\n", path.c_str());
+      return;
+    }
+    
+    if (!pattern.empty()) {
+      offset = source.Find(pattern, offset);
+      if (offset == UINT64_MAX) {
+        ConsolePrint("hexdump: pattern not found in %s\n", path.c_str());
+        return;
+      }
+    }
+    
+    if (Interactive && ConsoleCapture == nullptr && length == 0) {
+      ViewBytes(source, path, offset);
+      return;
+    }
+    
+    std::string text;
+    for (uint64_t end = std::min(offset + (length != 0 ? length : 256), source.GetSize()); offset < end; ) {
+      size_t count = (size_t) std::min<uint64_t>(end - offset, 1024 * 1024);
+      auto data = source.Get(offset, count);
+      if (data == nullptr) {
+        ConsolePrint("hexdump: unable to read %s at %" PRIu64 "\n", path.c_str(), offset);
+        break;
+      }
+      
+      text.clear();
+      FormatHexLines(text, offset, data, count, source.GetSize() > UINT32_MAX);
+      ConsolePrint("%s", text.c_str());
+      offset += count;
+    }
+  };
+  
+  // `search [-e pattern]... [-m count] <pattern> <file|directory|image|device>...` prints the offset of every
+  // occurrence of the patterns (text, or hex bytes after "0x"), at most `count` (1000 by default) per file. Directories
+  // are searched recursively. Files are split into 256 MiB ranges searched concurrently, so a single large image keeps
+  // every core busy as well.
+  Builtins["search"] = [] (const VectorString &args) -> void {
+    const uint64_t range = 256 * 1024 * 1024;
+    
+    VectorString patterns, paths;
+    size_t maximum = 1000;
+    bool explicit_patterns = false;
+    
+    for (size_t i = 1; i < args.size(); ++i) {
+      if (args[i] == "-e" && i + 1 < args.size()) {
+        patterns.push_back(ParseBytePattern(args[++i]));
+        explicit_patterns = true;
+      } else if (args[i] == "-m" && i + 1 < args.size()) {
+        maximum = (size_t) strtoull(args[++i].c_str(), nullptr, 0);
+      } else if (!explicit_patterns && patterns.empty()) {
+        patterns.push_back(ParseBytePattern(args[i]));
+      } else {
+        paths.push_back(args[i]);
+      }
+    }
+    
+    if (patterns.empty() || paths.empty() || maximum == 0 || std::any_of(patterns.begin(), patterns.end(), [] (const std::string &p) -> bool { return p.empty(); })) {
+      ConsolePrint("usage: search [-e pattern]... [-m count] <text|0xhex> <file|directory|image|device>...\n");
+      return;
+    }
+    
+    VectorString files;
+    for (const auto &path : paths) {
+      auto attributes = GetFileAttributesA(path.c_str());
+      
+      if (attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+        for (auto &file : TraverseDirectoryTree(path))
+          files.push_back(std::move(file.name));
+      } else {
+        files.push_back(path);
+      }
+    }
+    
+    // The sizes decide how each file is split up
+    std::vector<uint64_t> sizes(files.size(), UINT64_MAX);
+    Workers().ParallelFor(files.size(), [&files, &sizes] (size_t i) -> void {
+      ByteSource source(files[i].c_str());
+      if (source.IsOpen())
+        sizes[i] = source.GetSize();
+    });
+    
+    struct Range {
+      size_t file;
+      uint64_t begin, end;
+      std::vector<SearchMatch> matches;
+      bool failed;
+    };
+    
+    std::vector<Range> ranges;
+    for (size_t i = 0; i < files.size(); ++i) {
+      if (sizes[i] == UINT64_MAX) {
+        ConsolePrint("search: unable to open %s\n", files[i].c_str());
+        continue;
+      }
+      
+      for (uint64_t begin = 0; begin < sizes[i]; begin += range)
+        ranges.push_back(Range { i, begin, std::min(begin + range, sizes[i]), {}, false });
+    }
+    
+    MultiPatternMatcher matcher(patterns);
+    
+    Workers().ParallelFor(ranges.size(), [&files, &ranges, &matcher, maximum] (size_t i) -> void {
+      auto &r = ranges[i];
+      ByteSource source(files[r.file].c_str());
+      
+      if (source.IsOpen())
+        SearchSource(source, matcher, r.begin, r.end, maximum + 1, r.matches);
+      else
+        r.failed = true;
+    });
+    
+    // Ranges are in file and offset order, which is the order matches are printed in
+    std::vector<size_t> printed(files.size(), 0);
+    for (const auto &r : ranges) {
+      if (r.failed)
+        ConsolePrint("search: unable to read %s\n", files[r.file].c_str());
+      
+      for (const auto &match : r.matches) {
+        if (printed[r.file]++ == maximum)
+          ConsolePrint("%s: more than %zu matches, the rest is not shown\n", files[r.file].c_str(), maximum);
+        if (printed[r.file] > maximum)
+          break;
+        
+        ConsolePrint("%s: %" PRIu64 " (0x%" PRIx64 ")  %s\n", files[r.file].c_str(), match.offset, match.offset, FormatBytePattern(matcher.GetPattern(match.pattern)).c_str());
+      }
+    }
+  };
+  
+  // `carve <image|device> [directory]` recovers the PDF, BMP, PE and ZIP files in a disk image into the directory
+  // (".\\carved" by default)
+  Builtins["carve"] = [] (const VectorString &args) -> void {
+    if (args.size() < 2) {
+      ConsolePrint("usage: carve <image|device> [directory]\n");
+      return;
+    }
+    
+    auto directory = args.size() >= 3 ? args[2] : GetWorkingDirectory() + "\\carved";
+    bool success;
+    auto objects = CarveImage(args[1].c_str(), directory, success);
+    
+    std::vector<size_t> counts(CarveFormats().size(), 0);
+    for (const auto &object : objects) {
+      const char *extension = CarveFormats()[object.format].extension;
+      
+      if (object.path.empty()) {
+        ConsolePrint("%12" PRIx64 "  %s  %12" PRIu64 "  (unable to write)\n", object.offset, extension, object.size);
+        continue;
+      }
+      
+      ConsolePrint("%12" PRIx64 "  %s  %12" PRIu64 "  %s%s\n", object.offset, extension, object.size, object.path.c_str(), object.truncated ? " (truncated)" : "");
+      ++counts[object.format];
+    }
+    
+    if (!success) {
+      ConsolePrint("carve: unable to read %s or create %s\n", args[1].c_str(), directory.c_str());
+      return;
+    }
+    
+    std::string summary;
+    for (size_t i = 0; i < counts.size(); ++i)
+      summary += (i > 0 ? ", " : "") + std::to_string(counts[i]) + " " + CarveFormats()[i].extension;
+    ConsolePrint("Recovered %s\n", summary.c_str());
+  };
+  
+  // `view [-w columns] [-256] [-o offset] <file|image|device>` draws a bitmap in the console, scaled down to fit the
+  // window (or `columns`). `-o` shows one inside an image, at an offset `carve` reported. `-256` sticks to the
+  // 256-color palette for consoles without 24-bit color.
+  Builtins["view"] = [] (const VectorString &args) -> void {
+    uint64_t offset = 0;
+    uint32_t columns = 0;
+    bool truecolor = true;
+    std::string path;
+    
+    for (size_t i = 1; i < args.size(); ++i) {
+      if (args[i] == "-w" && i + 1 < args.size())
+        columns = (uint32_t) strtoul(args[++i].c_str(), nullptr, 0);
+      else if (args[i] == "-o" && i + 1 < args.size())
+        offset = strtoull(args[++i].c_str(), nullptr, 0);
+      else if (args[i] == "-256")
+        truecolor = false;
+      else
+        path = args[i];
+    }
+    
+    if (path.empty()) {
+      ConsolePrint("usage: view [-w columns] [-256] [-o offset] <file|image|device>\n");
+      return;
+    }
+    
+    // A character cell holds two pixels, one above the other. The last column stays empty, so lines don't wrap, and
+    // the last line is left for the prompt.
+    uint32_t width = 79, height = 2 * 23;
+    CONSOLE_SCREEN_BUFFER_INFO screen;
+    if (ConsoleCapture == nullptr && GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &screen)) {
+      width = std::max(screen.srWindow.Right - screen.srWindow.Left, 1);
+      height = 2 * std::max(screen.srWindow.Bottom - screen.srWindow.Top, 1);
+    }
+    
+    if (columns != 0) {
+      width = columns;
+      height = 2 * 65536;
+    }
+    
+    RGBAImage image;
+    bool success = MakeBMPThumbnail(path.c_str(), offset, width, height, image);
+    if (image.pixels.empty()) {
+      ConsolePrint("view: %s is not a bitmap, holds a JPEG/PNG image, or can't be opened\n", path.c_str());
+      return;
+    }
+    
+    WriteFrame(RenderHalfBlocks(image, truecolor));
+    if (!success)
+      ConsolePrint("view: %s is truncated, not all of it could be decoded\n", path.c_str());
+  };
+  
+  // `dupes [directory]` lists sets of identical files below the directory (the current one by default)
+  Builtins["dupes"] = [] (const VectorString &args) -> void {
+    auto directory = args.size() >= 2 ? args[1] : GetWorkingDirectory();
+    uint64_t files = 0, reclaimable = 0;
+    
+    for (const auto &duplicates : FindDuplicates(directory)) {
+      const auto size = duplicates.first;
+      const auto &group = duplicates.second;
+      
+      ConsolePrint("%zu files of %" PRIu64 " bytes:\n", group.size(), size);
+      for (const auto &path : group)
+        ConsolePrint("  %s\n", path.c_str());
+      
+      files += group.size() - 1;
+      reclaimable += size * (group.size() - 1);
+    }
+    
+    ConsolePrint("%" PRIu64 " duplicate files, %" PRIu64 " MiB reclaimable\n", files, reclaimable / 1024 / 1024);
+  };
+  
+  Builtins["cd"] = [] (const VectorString &args) -> void {
+    if (args.size() >= 2)
+      SetCurrentDirectory(args[1].c_str());
+  };
+  
+  // Windows has no per-process system call counter, the kernel's I/O operation counts are the closest thing to it.
+  // CPU time and I/O are process-wide (plus the external commands run), so jobs running meanwhile are included too.
+  Builtins["time"] = [] (const VectorString &args) -> void {
+    std::string command;
+    for (size_t i = 1; i < args.size(); ++i)
+      command += (i > 1 ? " " : "") + args[i];
+    
+    auto before = GetResourceUsage();
+    auto start = GetMilliseconds();
+    
+    auto status = ExecuteCommand(command);
+    
+    auto wall = GetMilliseconds() - start;
+    auto after = GetResourceUsage();
+    
+    ConsolePrint("\n");
+    ConsolePrint("real    %10.3f s\n", wall / 1000.0);
+    ConsolePrint("user    %10.3f s\n", (after.user - before.user) / 1e7);
+    ConsolePrint("sys     %10.3f s\n", (after.kernel - before.kernel) / 1e7);
+    ConsolePrint("read    %10" PRIu64 " bytes\n", after.read_bytes - before.read_bytes);
+    ConsolePrint("I/O ops %10" PRIu64 " (read %" PRIu64 ", write %" PRIu64 ", other %" PRIu64 ")\n",
+      (after.read_operations - before.read_operations) + (after.write_operations - before.write_operations) + (after.other_operations - before.other_operations),
+      after.read_operations - before.read_operations, after.write_operations - before.write_operations, after.other_operations - before.other_operations);
+    
+    if (status != 0)
+      ConsolePrint("status  %10lu\n", status);
+  };
+  
+  Builtins["trace"] = [] (const VectorString &args) -> void {
+    if (args.size() >= 2 && args[1] == "on") {
+      TraceClear();
+      TraceEnabled = true;
+    } else if (args.size() >= 2 && args[1] == "off") {
+      TraceEnabled = false;
+    } else if (args.size() >= 3 && args[1] == "dump") {
+      FILE *f = fopen(args[2].c_str(), "w");
+      
+      if (!f) {
+        ConsolePrint("trace: unable to write %s\n", args[2].c_str());
+        return;
+      }
+      
+      auto n = TraceExport(f);
+      Cleanup_FILE(&f);
+      ConsolePrint("trace: %zu events written to %s\n", n, args[2].c_str());
+    } else {
+      ConsolePrint("usage: trace on|off|dump <file.json>\n");
+    }
+  };
+  
+  Builtins["jobs"] = [] (const VectorString &args) -> void {
+    std::lock_guard<std::mutex> guard(JobsLock);
+    
+    for (const auto &job : Jobs)
+      ConsolePrint("[%u] %-8s%s\n", job->id, job->done ? "Done" : "Running", job->command.c_str());
+  };
+  
+  Builtins["fg"] = [] (const VectorString &args) -> void {
+    auto job = FindJob(args);
+    
+    if (!job) {
+      ConsolePrint("fg: no such job\n");
+      return;
+    }
+    
+    ConsolePrint("%s\n", job->command.c_str());
+    ForegroundJob(job);
+  };
+  
+  Builtins["wait"] = [] (const VectorString &args) -> void {
+    std::vector<std::shared_ptr<Job>> waiting;
+    
+    if (args.size() >= 2) {
+      auto job = FindJob(args);
+      if (job)
+        waiting.push_back(job);
+    } else {
+      std::lock_guard<std::mutex> guard(JobsLock);
+      waiting = Jobs;
+    }
+    
+    {
+      std::unique_lock<std::mutex> guard(JobsLock);
+      JobsCondition.wait(guard, [&waiting] () -> bool {
+        return std::all_of(waiting.begin(), waiting.end(), [] (const std::shared_ptr<Job> &job) -> bool { return job->done.load(); });
+      });
+    }
+    
+    ReportFinishedJobs();
+  };
+}
+
+// Non-interactive command files (`shell script.sh`, `shell -c "..."` or commands piped into stdin). A script is
+// compiled once into a flat instruction list: every line is pre-split into literal text and variable references, and
+// variables are resolved to slots, so running a loop a thousand times never parses anything again.
+//
+//   # comment
+//   set NAME value            $NAME, ${NAME}, $? (last status), $0..$9 (script arguments), $$ (a literal '$')
+//   if [not] exist PATH       if A == B, if A != B, if COMMAND (true when its status is 0)
+//   else
+//   end
+//   for NAME in WORDS...
+//   end
+//   exit [STATUS]
+//
+// Statements are separated by new lines or ';'. Anything else is a command, a trailing '&' runs it as a job.
+class Script {
+  struct Piece {
+    bool variable;
+    uint32_t slot;
+    std::string text;
+  };
+  
+  using Text = std::vector<Piece>;
+  
+  enum Opcode : uint8_t {
+    OP_EXECUTE,     // text: command
+    OP_SET,         // slot = text
+    OP_JUMP,        // target
+    OP_JUMP_UNLESS, // condition, target
+    OP_FOR,         // slot, text: words, target: past the loop
+    OP_NEXT,        // target: first instruction of the body
+    OP_EXIT,        // text: status
+  };
+  
+  enum ConditionKind : uint8_t {
+    CONDITION_EXIST,
+    CONDITION_EQUAL,
+    CONDITION_COMMAND,
+  };
+  
+  struct Condition {
+    ConditionKind kind;
+    bool negate;
+    uint32_t left, right;
+  };
+  
+  struct Instruction {
+    Opcode opcode;
+    uint32_t slot;
+    uint32_t text;
+    uint32_t target;
+  };
+  
+  struct Block {
+    bool loop;
+    uint32_t start;
+    uint32_t line;
+    std::vector<uint32_t> patches;
+  };
+  
+  struct Loop {
+    VectorString words;
+    size_t next;
+  };
+  
+  // Slots 0..9 hold the script arguments, slot 10 holds $?
+  static const uint32_t StatusSlot = 10;
+  
+  std::vector<Instruction> code;
+  std::vector<Text> texts;
+  std::vector<Condition> conditions;
+  VectorString names;
+  
+  std::string error;
+  uint32_t line = 0;
+  
+  uint32_t Slot(const std::string &name)
+  {
+    for (uint32_t i = 0; i < names.size(); ++i) {
+      if (names[i] == name)
+        return i;
+    }
+    
+    names.push_back(name);
+    return names.size() - 1;
+  }
+  
+  static std::string Trim(const std::string &s)
+  {
+    auto first = s.find_first_not_of(" \t\r");
+    if (first == std::string::npos)
+      return std::string();
+    
+    return s.substr(first, s.find_last_not_of(" \t\r") - first + 1);
+  }
+  
+  // Strips a single pair of surrounding double quotes
+  static std::string Unquote(const std::string &s)
+  {
+    if (s.length() >= 2 && s.front() == '"' && s.back() == '"')
+      return s.substr(1, s.length() - 2);
+    
+    return s;
+  }
+  
+  // Splits on spaces, keeping double-quoted words (quotes included) together.
+  static VectorString Words(const std::string &s)
+  {
+    VectorString v;
+    std::string word;
+    bool quoted = false;
+    
+    for (auto c : s) {
+      if (c == '"')
+        quoted = !quoted;
+      
+      if ((c == ' ' || c == '\t') && !quoted) {
+        if (!word.empty())
+          v.push_back(word);
+        word.clear();
+      } else {
+        word += c;
+      }
+    }
+    
+    if (!word.empty())
+      v.push_back(word);
+    
+    return v;
+  }
+  
+  uint32_t CompileText(const std::string &s)
+  {
+    Text text;
+    std::string literal;
+    
+    const auto Flush = [&text, &literal] () -> void {
+      if (!literal.empty())
+        text.push_back({ false, 0, literal });
+      literal.clear();
+    };
+    
+    for (size_t i = 0; i < s.length(); ++i) {
+      if (s[i] != '$' || i + 1 >= s.length()) {
+        literal += s[i];
+        continue;
+      }
+      
+      auto c = s[i + 1];
+      std::string name;
+      
+      if (c == '$') {
+        literal += '$';
+        ++i;
+        continue;
+      } else if (c == '?') {
+        Flush();
+        text.push_back({ true, StatusSlot, std::string() });
+        ++i;
+        continue;
+      } else if (isdigit((unsigned char) c)) {
+        Flush();
+        text.push_back({ true, (uint32_t) (c - '0'), std::string() });
+        ++i;
+        continue;
+      } else if (c == '{') {
+        auto end = s.find('}', i + 2);
+        if (end == std::string::npos) {
+          literal += s[i];
+          continue;
+        }
+        
+        name = s.substr(i + 2, end - i - 2);
+        i = end;
+      } else {
+        size_t end = i + 1;
+        while (end < s.length() && (isalnum((unsigned char) s[end]) || s[end] == '_'))
+          ++end;
         
-        case PARTITION_STYLE_RAW: {
-          /* ?? */
-          break;
+        if (end == i + 1) {
+          literal += s[i];
+          continue;
         }
+        
+        name = s.substr(i + 1, end - i - 1);
+        i = end - 1;
       }
       
-      info->size = block.PartitionLength.QuadPart;
-      info->offset = block.StartingOffset.QuadPart;
-      info->number = block.PartitionNumber;
+      Flush();
+      text.push_back({ true, Slot(name), name });
     }
-  }
-}
-
-DriveInfo GetDriveDataFromGUID(const char *GUID)
-{
-  // CreateFile() doesn't allow the trailing '\\' when opening device(s) as GUID. Strip it out.
-  std::string name(GUID);
-  if (name[name.length() - 1] == '\\')
-    name.pop_back();
-  
-  DriveInfo info;
-  HANDLE handle = CreateFile(name.c_str(), GENERIC_READ, FILE_SHARE_WRITE | FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
-
-  if (handle != INVALID_HANDLE_VALUE) {
-    // Name
-    info.name = name;
     
-    // info.size, info.offset, info.number, info.GPT will be available after this call
-    GetAdditionalPartitionInfo(&info, handle);
-    
-    // info.sectors, info.NTFS will be available after this call
-    GetPartitionFSData_GUID(&info, handle);
+    Flush();
+    texts.push_back(text);
     
-    // info.disk will be available after this call
-    GetPartitionParentDevice(&info, handle);
-
-    CloseHandle(handle);
+    return texts.size() - 1;
   }
   
-  return info;
-}
-
-DriveInfo GetDriveDataFromLetter(const char *p)
-{
-  // Turn the raw drive letter query into something CreateFile() can digest
-  // (i. e. \\?\Volume{GUID_ID}\ -> \\.\\\?\Volume{GUID_ID})
-  auto query = std::string("\\\\.\\") + p;
-  query.pop_back();
+  uint32_t Emit(Opcode opcode, uint32_t slot = 0, uint32_t text = 0, uint32_t target = 0)
+  {
+    code.push_back({ opcode, slot, text, target });
+    return code.size() - 1;
+  }
   
-  DriveInfo info;
-  HANDLE handle = CreateFile(query.c_str(), GENERIC_READ, FILE_SHARE_WRITE | FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
-
-  if (handle != INVALID_HANDLE_VALUE) {
-    // Name
-    std::string name(query);
-    name.erase(0, 4);
-    info.name = name;
+  bool Fail(const std::string &message)
+  {
+    if (error.empty())
+      error = "line " + std::to_string(line) + ": " + message;
     
-    // info.size, info.offset, info.number, info.GPT will be available after this call
-    GetAdditionalPartitionInfo(&info, handle);
+    return false;
+  }
+  
+  bool CompileCondition(const std::string &rest, uint32_t *index)
+  {
+    auto words = Words(rest);
+    Condition condition = { CONDITION_COMMAND, false, 0, 0 };
+    size_t first = 0;
     
-    // info.sectors, info.NTFS will be available after this call
-    GetPartitionFSData_Letter(&info, handle);
+    if (!words.empty() && words[0] == "not") {
+      condition.negate = true;
+      ++first;
+    }
     
-    // info.disk will be available after this call
-    GetPartitionParentDevice(&info, handle);
+    if (first >= words.size())
+      return Fail("missing condition");
     
+    if (words[first] == "exist" && words.size() == first + 2) {
+      condition.kind = CONDITION_EXIST;
+      condition.left = CompileText(Unquote(words[first + 1]));
+    } else if (words.size() == first + 3 && (words[first + 1] == "==" || words[first + 1] == "!=")) {
+      condition.kind = CONDITION_EQUAL;
+      condition.negate ^= words[first + 1] == "!=";
+      condition.left = CompileText(Unquote(words[first]));
+      condition.right = CompileText(Unquote(words[first + 2]));
+    } else {
+      std::string command;
+      for (size_t i = first; i < words.size(); ++i)
+        command += (i > first ? " " : "") + words[i];
+      
+      condition.kind = CONDITION_COMMAND;
+      condition.left = CompileText(command);
+    }
     
-    CloseHandle(handle);
+    conditions.push_back(condition);
+    *index = conditions.size() - 1;
+    
+    return true;
   }
   
-  return info;
-}
-
-DWORD    GetFilePointer   (HANDLE hFile) {
-    return SetFilePointer(hFile, 0, NULL, FILE_CURRENT);
-}
-
-// Try to extract the "representable" name for the given volume GUID to be used. Returns empty if 
-// the volume doesn't have a letter assigned, or it's the system recovery volume.
-static std::string ExtractDriveNameFromGUID(const char *name)
-{
-  DWORD size = 16;
-  BOOL success = FALSE;
-  uint8_t round = 16;
-  
-  for (uint8_t i = 0; i < round; ++i) {
-    char buffer[16];
-    success = GetVolumePathNamesForVolumeNameA(name, buffer, size, nullptr);
-    if (success == TRUE) {
-      return std::string(buffer);
+  bool CompileStatement(const std::string &statement, std::vector<Block> &blocks)
+  {
+    auto space = statement.find_first_of(" \t");
+    auto keyword = statement.substr(0, space);
+    auto rest = space == std::string::npos ? std::string() : Trim(statement.substr(space));
+    
+    if (keyword == "set") {
+      auto separator = rest.find_first_of(" \t=");
+      auto name = rest.substr(0, separator);
+      
+      if (name.empty())
+        return Fail("set without a variable name");
+      
+      auto value = separator == std::string::npos ? std::string() : Trim(rest.substr(separator + 1));
+      Emit(OP_SET, Slot(name), CompileText(Unquote(value)));
+    } else if (keyword == "if") {
+      uint32_t condition;
+      if (!CompileCondition(rest, &condition))
+        return false;
+      
+      Block block = { false, 0, line };
+      block.patches.push_back(Emit(OP_JUMP_UNLESS, condition));
+      blocks.push_back(block);
+    } else if (keyword == "else") {
+      if (blocks.empty() || blocks.back().loop)
+        return Fail("else without if");
+      
+      // The jump-unless of the if lands here, while the end of the then-branch has to skip the else-branch
+      auto &block = blocks.back();
+      auto skip = Emit(OP_JUMP);
+      
+      for (auto patch : block.patches)
+        code[patch].target = code.size();
+      
+      block.patches.clear();
+      block.patches.push_back(skip);
+    } else if (keyword == "for") {
+      auto words = Words(rest);
+      
+      if (words.size() < 2 || words[1] != "in")
+        return Fail("expected: for NAME in WORDS...");
+      
+      auto list = rest.substr(rest.find(" in") + 3);
+      
+      Block block = { true, 0, line };
+      block.patches.push_back(Emit(OP_FOR, Slot(words[0]), CompileText(Trim(list))));
+      block.start = code.size();
+      blocks.push_back(block);
+    } else if (keyword == "end") {
+      if (blocks.empty())
+        return Fail("end without if/for");
+      
+      auto block = blocks.back();
+      blocks.pop_back();
+      
+      if (block.loop)
+        Emit(OP_NEXT, 0, 0, block.start);
+      
+      for (auto patch : block.patches)
+        code[patch].target = code.size();
+    } else if (keyword == "exit") {
+      Emit(OP_EXIT, 0, CompileText(rest.empty() ? std::string("$?") : rest));
     } else {
-      if (GetLastError() == ERROR_MORE_DATA)
-        size *= 2;
+      Emit(OP_EXECUTE, 0, CompileText(statement));
     }
+    
+    return true;
   }
   
-  return std::string();
-}
-
-// Extracts typical device properties from a PhysicalDrive-based query.
-static DeviceInfo ExtractDeviceInfoFromQuery(const char *drive)
-{
-  HANDLE hDevice = INVALID_HANDLE_VALUE;  // handle to the drive to be examined 
-  BOOL result   = FALSE;                 // results flag
-  DWORD junk     = 0;                     // discard results
-  DeviceInfo device;
+  std::string Expand(uint32_t index, const VectorString &values) const
+  {
+    std::string s;
+    
+    for (const auto &piece : texts[index]) {
+      if (!piece.variable) {
+        s += piece.text;
+      } else if (!values[piece.slot].empty() || piece.text.empty()) {
+        s += values[piece.slot];
+      } else {
+        // Unset script variables fall back to the environment, i. e. $PATH or $USERNAME
+        s += GetEnvironmentString(piece.text.c_str());
+      }
+    }
+    
+    return s;
+  }
   
-  hDevice = CreateFileA(drive, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr);
+  bool Evaluate(const Condition &condition, VectorString &values) const
+  {
+    bool result = false;
+    
+    switch (condition.kind) {
+      case CONDITION_EXIST: {
+        result = GetFileAttributesA(Expand(condition.left, values).c_str()) != INVALID_FILE_ATTRIBUTES;
+        break;
+      }
+      
+      case CONDITION_EQUAL: {
+        result = Expand(condition.left, values) == Expand(condition.right, values);
+        break;
+      }
+      
+      case CONDITION_COMMAND: {
+        auto status = ExecuteCommand(Expand(condition.left, values));
+        values[StatusSlot] = std::to_string(status);
+        result = status == 0;
+        break;
+      }
+    }
+    
+    return result != condition.negate;
+  }
   
-  if (hDevice != INVALID_HANDLE_VALUE) {
+public:
+  Script()
+  {
+    for (int i = 0; i <= 9; ++i)
+      names.push_back(std::to_string(i));
+    names.push_back("?");
+  }
+  ~Script() {}
+  
+  const std::string &GetError() const
+  {
+    return error;
+  }
+  
+  bool Compile(const std::string &source)
+  {
+    std::vector<Block> blocks;
+    line = 0;
     
-    // Gather DISK_GEOMETRY data
-    {
-      DISK_GEOMETRY surface;
+    for (const auto &raw : split(source, '\n')) {
+      ++line;
       
-      if ((result = DeviceIoControl(hDevice, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0, &surface, sizeof(surface), &junk, (LPOVERLAPPED) NULL)) == TRUE) {
-        device.sector_size = surface.BytesPerSector;
-        device.cylinders = surface.Cylinders.QuadPart;
-        device.sectors = surface.SectorsPerTrack * surface.TracksPerCylinder * surface.Cylinders.QuadPart;
+      // Statements are separated by ';' outside of double quotes
+      std::string statement;
+      bool quoted = false;
+      
+      for (size_t i = 0; i <= raw.length(); ++i) {
+        auto c = i < raw.length() ? raw[i] : ';';
+        
+        if (c == '"')
+          quoted = !quoted;
+        
+        if (c == ';' && !quoted) {
+          statement = Trim(statement);
+          
+          if (!statement.empty() && statement[0] != '#' && !CompileStatement(statement, blocks))
+            return false;
+          
+          statement.clear();
+        } else {
+          statement += c;
+        }
       }
     }
     
-    // Gather device type (TRIM of SSD)
-    {
-      /*
-      STORAGE_PROPERTY_QUERY spqTrim;
-      spqTrim.PropertyId = (STORAGE_PROPERTY_ID)StorageDeviceTrimProperty;
-      spqTrim.QueryType = PropertyStandardQuery;
-
-      uint32_t bytesReturned = 0;
-      DEVICE_TRIM_DESCRIPTOR dtd = {0};
-      if(::DeviceIoControl(hDevice, IOCTL_STORAGE_QUERY_PROPERTY, &spqTrim, sizeof(spqTrim), &dtd, sizeof(dtd), &bytesReturned, NULL) && bytesReturned == sizeof(dtd))
-        device.SSD = dtd.TrimEnabled;
-      */
+    if (!blocks.empty()) {
+      line = blocks.back().line;
+      return Fail(blocks.back().loop ? "for without end" : "if without end");
     }
     
-    // Deduce GPT/MBR device type
-    PARTITION_INFORMATION_EX block;
-    NTSTATUS status;
-    IO_STATUS_BLOCK iosb;
-    bool GPT = false;
+    return true;
+  }
+  
+  DWORD Run(const VectorString &arguments)
+  {
+    VectorString values(names.size());
+    std::vector<Loop> loops;
     
-    if (0 <= (status = NtDeviceIoControlFile(hDevice, 0, 0, 0, &iosb, IOCTL_DISK_GET_PARTITION_INFO_EX, 0, 0, &block, sizeof(block)))) {
-      GPT = block.PartitionStyle == PARTITION_STYLE_GPT;
-    }
+    for (size_t i = 0; i < arguments.size() && i <= 9; ++i)
+      values[i] = arguments[i];
+    values[StatusSlot] = "0";
     
-    // Gather additional disk data
-    FILE *f = DeviceToFileHandle(hDevice);
-    if (f)
-    {
-      fseek(f, 0, SEEK_SET);
+    DWORD status = 0;
+    size_t pc = 0;
+    
+    while (pc < code.size()) {
+      const auto &instruction = code[pc++];
       
-      if (GPT) {
-        // Try to read LBA 0 (protective MBR)
-        char *buffer = new char[device.sector_size];
-        fread(buffer, device.sector_size, 1, f);
+      switch (instruction.opcode) {
+        case OP_EXECUTE: {
+          status = ExecuteCommand(Expand(instruction.text, values));
+          values[StatusSlot] = std::to_string(status);
+          ReportFinishedJobs();
+          break;
+        }
         
-        // This is the LBA 0, in that case continue reading more bytes to get to our EFI
-        if ((buffer[0] != 'E') || (buffer[1] != 'F') || (buffer[2] != 'I')) {
-          fread(buffer, device.sector_size, 1, f);
-          printf("Correct GPT for %s %i\n", drive, (buffer[0] == 'E') && (buffer[1] == 'F') && (buffer[2] == 'I') && (buffer[3] == ' ') && (buffer[4] == 'P') && (buffer[5] == 'A') && (buffer[6] == 'R') && (buffer[7] == 'T'));
+        case OP_SET: {
+          values[instruction.slot] = Expand(instruction.text, values);
+          break;
         }
-
-		delete[] buffer;
-      } else { // MBR
-        char *buffer = new char[device.sector_size];
-        fread(buffer, device.sector_size, 1, f);
-        printf("MBR buffer for %s: %s\n", drive, buffer);
-        printf("Boot sector correctness %i %i 0x%02hhx\n", buffer[device.sector_size - 2] == 0x55, buffer[device.sector_size - 1] == 0xaa, buffer[device.sector_size - 1]);
         
-        char partbuf[16 * 4];
+        case OP_JUMP: {
+          pc = instruction.target;
+          break;
+        }
         
-        for (int i = 0; i < 4; ++i) {
-          printf("Copying 16 bytes from %i into %i\n", 16 * i, 446 + (16 * i));
-          //memcpy((void *) partbuf, (void *) buffer[446 + (16*i)], 16);
-          memcpy(&partbuf[16*i], &buffer[446 + (16*i)], 16);
+        case OP_JUMP_UNLESS: {
+          if (!Evaluate(conditions[instruction.slot], values))
+            pc = instruction.target;
+          break;
+        }
+        
+        case OP_FOR: {
+          auto words = split(Expand(instruction.text, values), ' ');
+          words.erase(std::remove(words.begin(), words.end(), std::string()), words.end());
+          
+          if (words.empty()) {
+            pc = instruction.target;
+          } else {
+            values[instruction.slot] = words[0];
+            loops.push_back({ words, 1 });
+          }
+          break;
         }
-
-		delete[] buffer;
         
-        for (int i = 0; i < 4; ++i) {
-          auto ID = partbuf[16*i + 4];
-          if (ID != 0x00) {
-            switch (ID) {
-              case 131: { // Fall-through to -125, decimal from signed 2's complement
-                
-              }
-              
-              case -125: { // 0x83
-                uint32_t offset;
-                memcpy(&offset, &partbuf[16*i + 8], 4);
-                printf("  Found Generic Linux partition at offset %i\n", offset);
-                
-                uint8_t bootable;
-                memcpy(&bootable, &partbuf[16+i+0], 1);
-                printf("    Bootable 0x%02hhx\n", bootable);
-                
-                /*
-                fseek(f, 0, SEEK_SET);
-                
-                fseek(f, (offset + 128) * device.sector_size, SEEK_CUR);
-                printf("Current pointer: %i (%i * %i)\n", ftell(f), offset, device.sector_size);
-                char buffer[device.sector_size];
-                
-                
-                printf("%i\n", fread(buffer, device.sector_size, 1, f));
-                printf("Device buffer: [%s]\n", buffer);
-                printf("Device buffer: [%c]\n", buffer[40]);
-                
-                for (auto i = 0; i < strlen(buffer); ++i)
-                {
-                  printf(" %i %c", i, buffer[i]);
-                  if (buffer[i] == '_' && buffer[i + 1] == 'B') {
-                    printf("MOM i'm on the TV!!!\n");
-                  }
-                }
-                */
-                
-                // EXT4
-                {
-                  fseek(f, 0, SEEK_SET);
-                   _fseeki64(f, (uint64_t) ((uint64_t)(offset) * (uint64_t)device.sector_size), SEEK_CUR);
-                   // printf("%" PRIu64 "\n", _ftelli64(f));
-                   _fseeki64(f, 1024L, SEEK_CUR);
-                  
-                  /*
-                  fseek(f, 0, SEEK_SET);
-                  uint64_t piece = (offset / 16) * device.sector_size, total = 0;
-                  for (int i = 0; i < 16; ++i) {
-                    printf("fseek = %i (%" PRIu64 " = %i * %i) \n", _fseeki64(f, piece, SEEK_CUR), offset * device.sector_size, offset, device.sector_size);
-                    total += piece;
-                    printf("%" PRIu64 "\n", _ftelli64(f));
-                  }
-                  
-                  printf("desired offset: %" PRIu64 ", target offset: %" PRIu64 ", total = %" PRIu64 "\n", (uint64_t) ((uint64_t)(offset) * (uint64_t)device.sector_size), _ftelli64(f), total);
-                  */
-                  
-                  /*
-                  for (int i = 0; i < 16; ++i) {
-                    printf("seeking to %" PRIu64 ": %i\n", (9437312 * device.sector_size) * i, _fseeki64(f, 9437312 * device.sector_size, SEEK_CUR));
-                    printf("%" PRIu64 "\n", _ftelli64(f));
-                  }
-                  */
-                  
-                  /*
-                  SetFilePointer(hDevice, 0, NULL, FILE_BEGIN);
-                  SetFilePointer(hDevice, offset * device.sector_size, nullptr, FILE_CURRENT);
-                  printf("%" PRIu64 "\n", GetFilePointer(hDevice));
-                  */
-                  //SetFilePointer(hDevice, 1024, NULL, FILE_CURRENT);
-                  DWORD dr;
-                  char *buffer = new char[device.sector_size];
-                  if (ReadFile(hDevice, buffer, device.sector_size, &dr, 0) == TRUE) {
-                    for (int i = 0; i < device.sector_size; ++i) {
-                      if (buffer[i] == 0x53) {
-                        if (buffer[i+1] == 239 || buffer[i+1] == -17) {
-                          printf("      Found ext4-formatted partition at offset %" PRIu64 " byte %" PRIu64 " (%02hhx%02hhx)\n", offset, (uint64_t) ((uint64_t)(offset) * (uint64_t)device.sector_size), buffer[i], buffer[i+1]);
-                        }
-                      }
-                      //printf("%i 0x%02hhx ", i, buffer[i]);
-                    }
-                  }
-				  delete[] buffer;
-                }
-                
-                // BTRFS
-                {
-                  SetFilePointer(hDevice, 0, NULL, FILE_BEGIN);
-                  SetFilePointer(hDevice, (offset + 128) * device.sector_size, NULL, FILE_CURRENT);
-                  
-                  char *buffer = new char[device.sector_size];
-                  DWORD dr;
-                  if (ReadFile(hDevice, buffer, device.sector_size, &dr, 0) == TRUE) {
-                    for (int i = 0; i < device.sector_size; ++i) {
-                      if (buffer[i] == '_' && buffer[i+1] == 'B') {
-                        printf("      Found Btrfs-formatted partition at offset %i byte %i (%i)\n", offset+128, ((offset + 128) * device.sector_size) + i, i);
-                      }
-                    }
-                  }
-				  delete[] buffer;
-                }
-                
-                break;
-              }
-              
-              case 0x07: {
-                uint32_t offset;
-                memcpy(&offset, &partbuf[16*i + 8], 4);
-                printf("  Found NTFS-formatted partition at offset %i\n", offset);
-                break;
-              }
-              
-              case 0x0b: {
-                printf("  Found 32-bit FAT partition\n");
-                break;
-              }
-              
-              case 130: {
-
-              }
-              
-              case -126: {
-                uint32_t offset;
-                memcpy(&offset, &partbuf[16*i + 8], 4);
-                printf("  Found Linux swap partition at offset %i\n", offset);
-                break;
-              }
-              
-              default: {
-                printf("Partition ID: 0x%02hhx\n", ID);
-              }
-            }
+        case OP_NEXT: {
+          auto &loop = loops.back();
+          
+          if (loop.next < loop.words.size()) {
+            values[code[instruction.target - 1].slot] = loop.words[loop.next++];
+            pc = instruction.target;
+          } else {
+            loops.pop_back();
           }
+          break;
+        }
+        
+        case OP_EXIT: {
+          return (DWORD) strtoul(Expand(instruction.text, values).c_str(), nullptr, 10);
         }
       }
     }
     
-    // GAther additio
-    {
-      //
-    }
-    
-    device.valid = true;
-    CloseHandle(hDevice);
-  } else {
-    device.valid = false;
+    return status;
   }
-  
-  return device;
-}
+};
 
-// Currently, this routine doesn't list EFI system partition(s) and is pretty slow, in the sense it queries for each and every single 
-// available PhysicalDrive, and then read all available volume(s) through FindFirstVolumeA()/FindNextVolumeA()/FindVolumeClose(), determine
-// if the volume(s) belongs to the particular PhysicalDrive. So it esentially does (number of PhysicalDrive) * (number of volume(s)) iteration.
-std::vector<DeviceInfo> ListDisk()
+// Compiles and runs a script, then waits for the jobs it left behind. Returns the status to exit the process with.
+static int RunScript(const std::string &name, const std::string &source, const VectorString &arguments)
 {
-  std::vector<DeviceInfo> v;
-  for (int i = 0; i < 16; ++i) {
-    // Extract basic information for each PhysicalDrive to be queried
-    DeviceInfo device = ExtractDeviceInfoFromQuery((std::string("\\\\.\\PhysicalDrive") + std::to_string(i)).c_str());
-    
-    printf("Valid? %i\n", device.valid);
-    
-    if (device.valid)
-    {
-      // printf("i = %i\n", i);
-      /*
-      printf("Sector size: %i\n", info.sector_size);
-      printf("Size: %" PRIu64 " GiB\n", (info.sectors * info.sector_size) / 1024 / 1024 / 1024);
-      */
-      
-      char buffer[256];
-      char drive[256];
-      HANDLE h = FindFirstVolumeA(buffer, 256);
-      BOOL success = FALSE;
-      
-      // Query for every single volume, using FindFirstVolumeA()/FindNextVolumeA()/FindVolumeClose(), which returns the volume's HANDLE and its GUID
-      if (h != INVALID_HANDLE_VALUE) {
-        do {
-          // Verify if the GUID is actually in the correct format
-          if (buffer[0] == '\\' && buffer[1] == '\\' && buffer[2] == '?' && buffer[3] == '\\' && buffer[strlen(buffer) - 1] == '\\') {
-            buffer[strlen(buffer) - 1] = 0;
-            buffer[strlen(buffer)] = '\\';
-            
-            // Try to get the partition's drive letter (F:\, E:\, A:\), etc. from GUID (i. e, \\?\Volume{7b1b4990-1a6a-01d4-c824-8c1d350dea00}\)
-            auto drive_letter = ExtractDriveNameFromGUID(buffer);
-            
-            // This is a named, fully functional, healthy partition
-            if (drive_letter != std::string()) {
-              auto drive = GetDriveDataFromLetter(drive_letter.c_str());
-              
-              // If the queried partition matches its parent's device ID, then the particular partition belongs to the parent.
-              if (drive.disk == i)
-                device.drive.push_back(drive);
-              
-              // printf("%i\n", GetDriveDataFromLetter(query.c_str()));
-              // device.push_back(ExtractDeviceInfoFromQuery(query.c_str()));
-            } else {
-              // Probably something else, i. e. system partition. In that case, query by GUID, not by its drive letter
-              auto drive = GetDriveDataFromGUID(buffer);
-              
-              if (drive.disk == i)
-                device.drive.push_back(drive);
-            }
-          }
-          success = FindNextVolumeA(h, buffer, 256);
-        } while (success == TRUE);
-        
-        device.number = i;
-        v.push_back(device);
-        
-        FindVolumeClose(h);
-      }
-    }
+  Script script;
+  
+  if (!script.Compile(source)) {
+    fprintf(stderr, "%s: %s\n", name.c_str(), script.GetError().c_str());
+    return 2;
   }
   
-  printf("size = %i\n", v.size());
-  return v;
+  auto status = script.Run(arguments);
+  Builtins["wait"]({ "wait" });
+  fflush(stdout);
+  
+  return (int) status;
 }
 
-int main()
+static bool ReadWholeFile(FILE *f, std::string *contents)
 {
-  {
-    auto BMPFile = ReadBMP("TestBMP.bmp");
-    ConsolePrint("BMP Size: %i\n", BMPFile.GetSize());
-    ConsolePrint("BMP Width/Height: %ix%i\n", BMPFile.GetWidth(), BMPFile.GetHeight());
-    ConsolePrint("BMP Planes: %i\n", BMPFile.GetPlaneCount());
-    ConsolePrint("BMP BPP: %i\n", BMPFile.GetBPP());
-  }
+  char chunk[65536];
+  size_t read;
   
-  {
-    auto PDFFile = ReadPDF("TestPDF.pdf");
-    ConsolePrint("PDF Size: %i\n", PDFFile.GetSize());
-    ConsolePrint("PDF Version: %s\n", PDFFile.GetVersion().c_str());
-  }
+  while ((read = fread(chunk, 1, sizeof(chunk), f)) > 0)
+    contents->append(chunk, read);
   
-  {
-    auto PEFile = ReadPE("GetFileSize.exe");
-    ConsolePrint("PE Checksum: 0x%02hhx\n", PEFile.GetChecksum());
-    ConsolePrint("PE Section Count: %i\n", PEFile.GetSectionCount());
-    ConsolePrint("PE 32-bit: %i\n", !PEFile.Is64Bit());
-    ConsolePrint("PE Linker Version: %i.%i\n", PEFile.GetMajorLinkerVersion(), PEFile.GetMinorLinkerVersion());
-    ConsolePrint("PE Required OS Version: %i.%i\n", PEFile.GetMajorOSVersion(), PEFile.GetMinorOSVersion());
-    ConsolePrint("PE Image Version: %i.%i\n", PEFile.GetMajorImageVersion(), PEFile.GetMinorImageVersion());
-    ConsolePrint("PE Stack Size: %i KiB\n", PEFile.GetStackSize() / 1024 ^ 2);
-    ConsolePrint("PE Properties:\n");
-    for (const auto &c : PEFile.GetProperties())
-      ConsolePrint("  %s\n", c);
-    ConsolePrint("\n");
-  }
+  return ferror(f) == 0;
+}
+
+int main(int argc, char **argv)
+{
+  RegisterBuiltins();
   
-  {
-    auto ZIPFile = ReadZIP("TestZIP.zip");
-    ConsolePrint("ZIP CRC32: 0x%02hhx\n", ZIPFile.GetCRC32());
+  if (argc >= 2 && strcmp(argv[1], "--startup-time") == 0) {
+    StartupTiming = true;
+    argv[1] = argv[0];
+    ++argv;
+    --argc;
   }
   
-  const auto PrintDirectory = [] (const char *directory) -> void {
-    ConsolePrint("\nDirectory contents of %s\n", directory);
-    uint32_t n = 0;
-    for (const auto &v : TraverseDirectory(directory)) {
-      ConsolePrint("%s %s ", v.attribute.c_str(), v.name.c_str());
-      if (!v.directory) {
-        ConsolePrint("Size: %i\n", v.size);
-      } else {
-        ConsolePrint("\n");
-      }
-      ++n;
+  // Scripting mode: `shell -c "commands"`, `shell script.sh [arguments]` or commands piped into stdin
+  if (argc >= 3 && strcmp(argv[1], "-c") == 0) {
+    std::string source;
+    for (int i = 2; i < argc; ++i)
+      source += std::string(i > 2 ? " " : "") + argv[i];
+    
+    return RunScript("-c", source, { argv[0] });
+  } else if (argc >= 2) {
+    std::string source;
+    FILE *f = fopen(argv[1], "rb");
+    
+    if (!f || !ReadWholeFile(f, &source)) {
+      fprintf(stderr, "%s: unable to read script\n", argv[1]);
+      Cleanup_FILE(&f);
+      return 2;
     }
-
-    ConsolePrint("%i files.\n", n);
-  };
+    
+    Cleanup_FILE(&f);
+    return RunScript(argv[1], source, VectorString(argv + 1, argv + argc));
+  } else if (GetFileType(GetStdHandle(STD_INPUT_HANDLE)) != FILE_TYPE_CHAR) {
+    std::string source;
+    ReadWholeFile(stdin, &source);
+    
+    return RunScript("stdin", source, { argv[0] });
+  }
   
-  /*
-  PrintDirectory("D:\\*.*");
-  PrintDirectory("C:\\*.*");
-  PrintDirectory("G:\\*.*");
-  */
+  Interactive = true;
+  Executables.BuildAsync();
   
-  ConsoleClear();
-  ConsoleSetTitle("shsh (shershell)");
-  // ConsolePrint("w = %i; h = %i\n", ConsoleGetSize().first, ConsoleGetSize().second);
-  ConsoleSetSize(800, 600);
-  // ConsolePrint("w = %i; h = %i\n", ConsoleGetSize().first, ConsoleGetSize().second);
-  SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE),  5);
+  // The window and screen buffer are only set up when there is a console to set up, i. e. not when stdout is redirected
+  DWORD mode;
+  if (GetConsoleMode(GetStdHandle(STD_OUTPUT_HANDLE), &mode)) {
+    ConsoleClear();
+    ConsoleSetTitle("shsh (shershell)");
+    // ConsolePrint("w = %i; h = %i\n", ConsoleGetSize().first, ConsoleGetSize().second);
+    ConsoleSetSize(800, 600);
+    // ConsolePrint("w = %i; h = %i\n", ConsoleGetSize().first, ConsoleGetSize().second);
+    SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE),  5);
+  }
   
   // ConsolePrint("Clang %i.%i.%i on Windows\n", __clang_major__, __clang_minor__, __clang_patchlevel__);
   
@@ -1431,7 +7336,39 @@ int main()
   };
   
   TabCallFunction = [] (void) -> void {
-    ConsolePrint("TAB!");
+    // Only the command name (the first word) is completed, from the built-ins and the PATH index
+    if (input.find(' ') != std::string::npos)
+      return;
+    
+    auto matches = CompleteCommand(input);
+    if (matches.empty())
+      return;
+    
+    // Longest prefix shared by all the matches
+    std::string common = matches[0];
+    for (const auto &match : matches) {
+      size_t n = 0;
+      while (n < common.length() && n < match.length() && common[n] == match[n])
+        ++n;
+      common.resize(n);
+    }
+    
+    if (matches.size() == 1)
+      common += ' ';
+    
+    ConsoleSetPosition(GetUserPrompt().length() + input.length(), ConsoleGetPosition().second);
+    
+    if (common.length() > input.length()) {
+      ConsolePrint("%s", common.c_str() + input.length());
+      input = common;
+    } else {
+      ConsolePrint("\n");
+      for (const auto &match : matches)
+        ConsolePrint("%s  ", match.c_str());
+      ConsolePrint("\n");
+      PrintPrompt();
+      ConsolePrint("%s", input.c_str());
+    }
   };
   
   ExitFunction = [] (void) -> void {
@@ -1439,6 +7376,7 @@ int main()
   };
   
   for (;;) {
+    ReportFinishedJobs();
     PrintPrompt();
     bool should_new_line = false;
     
@@ -1446,89 +7384,13 @@ int main()
       auto c = _getch();
       
       if (c == '\r') {
-        // std::getline(std::cin, input);
-        if (input.find("dir", 0) != std::string::npos) {
-          auto v = split(input, ' ', [] (std::string &s) -> void {
-            auto length = s.length();
-            if (s[length - 1] != '\\' || s[length - 1] != '/') {
-              s += '\\';
-            }
-            
-            s += "*.*";
-          });
-          
-          if (v.size() >= 2) {
-            for (int i = 0; i < v.size(); ++i) {
-              PrintDirectory(v[i].c_str());
-            }
-          } else {
-            auto dir = GetWorkingDirectory();
-            if (dir[dir.length() - 1] != '\\' || dir[dir.length() - 1] != '/') {
-              dir += '\\';
-            }
-            
-            dir += "*.*";
-            PrintDirectory(dir.c_str());
-          }
-        } else if ((input.find("clear", 0) != std::string::npos) || (input.find("cls", 0) != std::string::npos)) {
-          ConsoleClear();
-        } else if (input.find("type", 0) != std::string::npos) {
-          auto v = split(input, ' ');
-          if(v[1].substr(v[1].find_last_of(".") + 1) == "pdf") {
-            auto PDFFile = ReadPDF("TestPDF.pdf");
-            ConsolePrint("PDF Size: %i\n", PDFFile.GetSize());
-            ConsolePrint("PDF Version: %s\n", PDFFile.GetVersion().c_str());
-          } else if (v[1].substr(v[1].find_last_of(".") + 1) == "exe") {
-            auto PEFile = ReadPE("GetFileSize.exe");
-            ConsolePrint("PE Checksum: 0x%02hhx\n", PEFile.GetChecksum());
-            ConsolePrint("PE Section Count: %i\n", PEFile.GetSectionCount());
-            ConsolePrint("PE 32-bit: %i\n", !PEFile.Is64Bit());
-            ConsolePrint("PE Linker Version: %i.%i\n", PEFile.GetMajorLinkerVersion(), PEFile.GetMinorLinkerVersion());
-            ConsolePrint("PE Required OS Version: %i.%i\n", PEFile.GetMajorOSVersion(), PEFile.GetMinorOSVersion());
-            ConsolePrint("PE Image Version: %i.%i\n", PEFile.GetMajorImageVersion(), PEFile.GetMinorImageVersion());
-            ConsolePrint("PE Stack Size: %i KiB\n", PEFile.GetStackSize() / 1024 ^ 2);
-            ConsolePrint("PE Properties:\n");
-            for (const auto &c : PEFile.GetProperties())
-              ConsolePrint("  %s\n", c);
-            ConsolePrint("\n");
-          }
-        } else if (input == "exit") {
-          ExitFunction();
-        } else if (input == "list") {
-          for (const auto &device : ListDisk()) {
-            if (device.valid) {
-              printf("ID: #%i\n", device.number);
-              printf("SSD: %i\n", device.SSD);
-              printf("Cylinders: %i\n", device.cylinders);
-              printf("Sector size: %i bytes\n", device.sector_size);
-              printf("Size: %" PRIu64 " GiB\n", (device.sectors * device.sector_size) / 1024 / 1024 / 1024);
-              for (const auto &drive : device.drive) {
-                printf("  Name: %s\n", drive.name.c_str());
-                printf("    Parent: #%i\n", drive.disk);
-                printf("    Number: #%i\n", drive.number);
-                printf("    FS: %s\n", drive.FS.c_str());
-                printf("    GPT: %i\n", drive.GPT);
-                printf("    Sectors: %i\n", drive.sectors);
-                printf("    Starting Offset: %" PRIu64 " \n", drive.offset);
-                printf("    Size: %" PRIu64 " bytes (%" PRIu64 " MiB)\n", drive.size, drive.size / 1024 / 1024);
-                
-                if (drive.GPT) {
-                  printf("      GPT type: %s\n", drive.GPT_Type.c_str());
-                } else {
-                  printf("      MBR boot: %i\n", drive.MBR_Boot);
-                }
-              }
-            }
-          }
-        } else if (input.find("cd", 0) != std::string::npos) {
-          auto v = split(input, ' ');
-          SetCurrentDirectory(v[1].c_str());
-        }
+        ConsolePrint("\n");
+        ExecuteCommand(input);
         ConsolePrint("Input received: %s\n", input.c_str());
         ConsolePrint("\n");
         input = "";
         should_new_line = true;
-      } else if (c == '  ') {
+      } else if (c == '\t') {
         TabCallFunction();
         should_new_line = false;
       } else if (c == '\b') {
@@ -0,0 +1,56 @@
+// Interface between the shell and format plugins, DLLs teaching `type` file formats the shell doesn't know itself.
+//
+// A plugin sits in the "plugins" directory next to the shell's executable as two files with the same name: the DLL,
+// and a text file ending in ".magic" that tells which files are the plugin's, so the DLL needn't be loaded to find
+// out:
+//
+//   # Acme archives
+//   name Acme archive
+//   magic 0 ACME
+//   magic 512 0x55 aa
+//
+// Each "magic" line is an offset and the bytes found there, as text or as hex bytes after "0x" (the syntax `search`
+// takes). A file matching any of them is the plugin's. The .magic files are read the first time `type` meets a file it
+// has no parser for; a DLL is loaded the first time a file matches one of its magics, and stays loaded.
+//
+// The DLL exports SHELL_FORMAT_PLUGIN_ENTRY, a ShellGetFormatPluginFunction returning its description. Strings are
+// UTF-8. Structures only ever grow at the end, older plugins keep working with newer shells.
+
+#ifndef SHELL_FORMAT_PLUGIN_HPP
+#define SHELL_FORMAT_PLUGIN_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHELL_FORMAT_PLUGIN_VERSION 1
+#define SHELL_FORMAT_PLUGIN_ENTRY "ShellGetFormatPlugin"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Reports one property of the file being parsed, `type` prints them as "name: value" lines in the order reported.
+// The strings are copied, they only have to live until the call returns.
+typedef void (*ShellFormatPropertyFunction)(void *context, const char *name, const char *value);
+
+typedef struct ShellFormatPlugin {
+  uint32_t version; // SHELL_FORMAT_PLUGIN_VERSION the plugin was built against
+  uint32_t size;    // sizeof(ShellFormatPlugin) as the plugin knows it
+  const char *name; // The format's name, e.g. "Acme archive"
+
+  // Parses the object at data[0]. `complete` is nonzero when `data` is a whole file, zero for a span that merely starts
+  // with the object; reads must not go past `length` either way. Returns nonzero if the object is in the plugin's
+  // format, with *size set to its length in bytes as far as the format tells (left alone otherwise), and its
+  // properties reported through `property`. May be called from several threads at once.
+  int (*Parse)(const uint8_t *data, size_t length, int complete, uint64_t *size, ShellFormatPropertyFunction property, void *context);
+} ShellFormatPlugin;
+
+// `host_version` is the shell's SHELL_FORMAT_PLUGIN_VERSION. A plugin that can't work with that version returns NULL.
+// The description has to stay valid as long as the DLL is loaded.
+typedef const ShellFormatPlugin *(*ShellGetFormatPluginFunction)(uint32_t host_version);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
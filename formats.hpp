@@ -0,0 +1,1943 @@
+// The file format parsers behind `type`, `view` and `carve`: bounds-checked byte access, the Format classes and the
+// PDF object reader they need.
+//
+// Not self-contained: Shell.cpp includes it after the standard headers, <windows.h> and TRACE_SCOPE, the fuzz targets
+// after fuzz/shim.hpp, which stands in for those on other systems.
+
+#ifndef SHELL_FORMATS_HPP
+#define SHELL_FORMATS_HPP
+
+#include "format_plugin.hpp"
+
+// Lookup tables are built on first use, so starting the shell doesn't pay for tables only `type` needs.
+static const std::unordered_map<uint16_t, const char *> &ImageFileHeader_Characteristics()
+{
+  static const std::unordered_map<uint16_t, const char *> table {
+    { IMAGE_FILE_RELOCS_STRIPPED, "IMAGE_FILE_RELOCS_STRIPPED" },
+    { IMAGE_FILE_EXECUTABLE_IMAGE, "IMAGE_FILE_EXECUTABLE_IMAGE" },
+    { IMAGE_FILE_LINE_NUMS_STRIPPED, "IMAGE_FILE_LINE_NUMS_STRIPPED" },
+    { IMAGE_FILE_LOCAL_SYMS_STRIPPED, "IMAGE_FILE_LOCAL_SYMS_STRIPPED" },
+    // { IMAGE_FILE_AGGRESIVE_WS_TRIM, "IMAGE_FILE_AGGRESIVE_WS_TRIM" }, // Obsolete
+    { IMAGE_FILE_LARGE_ADDRESS_AWARE, "IMAGE_FILE_LARGE_ADDRESS_AWARE" },
+    // { IMAGE_FILE_BYTES_REVERSED_LO, "IMAGE_FILE_BYTES_REVERSED_LO" }, // Obsolete
+    { IMAGE_FILE_32BIT_MACHINE, "IMAGE_FILE_32BIT_MACHINE" },
+    { IMAGE_FILE_DEBUG_STRIPPED, "IMAGE_FILE_DEBUG_STRIPPED" },
+    { IMAGE_FILE_REMOVABLE_RUN_FROM_SWAP, "IMAGE_FILE_REMOVABLE_RUN_FROM_SWAP" },
+    { IMAGE_FILE_NET_RUN_FROM_SWAP, "IMAGE_FILE_NET_RUN_FROM_SWAP" },
+    { IMAGE_FILE_SYSTEM, "IMAGE_FILE_SYSTEM" },
+    { IMAGE_FILE_DLL, "IMAGE_FILE_DL" },
+    { IMAGE_FILE_UP_SYSTEM_ONLY, "IMAGE_FILE_UP_SYSTEM_ONLY" },
+    // { IMAGE_FILE_BYTES_REVERSED_HI, "IMAGE_FILE_BYTES_REVERSED_HI" }, // Obsolete
+  };
+  
+  return table;
+}
+
+static const std::unordered_map<uint16_t, const char *> &ImageFileHeader_Machine()
+{
+  static const std::unordered_map<uint16_t, const char *> table {
+    { IMAGE_FILE_MACHINE_AMD64, "IMAGE_FILE_MACHINE_AMD64" }, // 0x8664
+    { IMAGE_FILE_MACHINE_I386, "IMAGE_FILE_MACHINE_I386" }, // 0x014c
+    { IMAGE_FILE_MACHINE_IA64, "IMAGE_FILE_MACHINE_IA64" }, // 0x0200
+  };
+  
+  return table;
+}
+
+static const std::unordered_map<uint16_t, const char *> &ImageOptionalHeader_DllCharacteristics()
+{
+  static const std::unordered_map<uint16_t, const char *> table {
+    { IMAGE_DLLCHARACTERISTICS_HIGH_ENTROPY_VA, "IMAGE_DLLCHARACTERISTICS_HIGH_ENTROPY_VA" },
+    { IMAGE_DLLCHARACTERISTICS_DYNAMIC_BASE, "IMAGE_DLLCHARACTERISTICS_DYNAMIC_BASE" },
+    { IMAGE_DLLCHARACTERISTICS_FORCE_INTEGRITY, "IMAGE_DLLCHARACTERISTICS_FORCE_INTEGRITY" },
+    { IMAGE_DLLCHARACTERISTICS_NX_COMPAT, "IMAGE_DLLCHARACTERISTICS_NX_COMPAT" },
+    { IMAGE_DLLCHARACTERISTICS_NO_ISOLATION, "IMAGE_DLLCHARACTERISTICS_NO_ISOLATION" },
+    { IMAGE_DLLCHARACTERISTICS_NO_SEH, "IMAGE_DLLCHARACTERISTICS_NO_SEH" },
+    { IMAGE_DLLCHARACTERISTICS_NO_BIND, "IMAGE_DLLCHARACTERISTICS_NO_BIND" },
+    { IMAGE_DLLCHARACTERISTICS_APPCONTAINER, "IMAGE_DLLCHARACTERISTICS_APPCONTAINER" },
+    { IMAGE_DLLCHARACTERISTICS_WDM_DRIVER, "IMAGE_DLLCHARACTERISTICS_WDM_DRIVER" },
+    { IMAGE_DLLCHARACTERISTICS_GUARD_CF, "IMAGE_DLLCHARACTERISTICS_GUARD_CF" },
+    { IMAGE_DLLCHARACTERISTICS_TERMINAL_SERVER_AWARE, "IMAGE_DLLCHARACTERISTICS_TERMINAL_SERVER_AWARE" },
+  };
+  
+  return table;
+}
+
+// Little-endian field access for on-disk structures (Windows only runs little-endian, so this is a plain copy).
+template <typename T>
+static T LoadLE(const void *p)
+{
+  T value;
+  memcpy(&value, p, sizeof(T));
+  return value;
+}
+
+template <typename T>
+static T LoadBE(const void *p)
+{
+  auto bytes = (const uint8_t *) p;
+  T value = 0;
+  for (size_t i = 0; i < sizeof(T); ++i)
+    value = (T) ((value << 8) | bytes[i]);
+  
+  return value;
+}
+
+// Converts `count` UTF-16LE (or BE) code units (stopping at a terminating zero) into UTF-8.
+static std::string UTF16ToUTF8(const uint8_t *data, size_t count, bool big_endian = false)
+{
+  std::string s;
+  
+  for (size_t i = 0; i < count; ++i) {
+    uint32_t c = big_endian ? LoadBE<uint16_t>(data + 2 * i) : LoadLE<uint16_t>(data + 2 * i);
+    if (c == 0)
+      break;
+    
+    // Surrogate pair
+    if (c >= 0xD800 && c < 0xDC00 && i + 1 < count) {
+      uint32_t low = big_endian ? LoadBE<uint16_t>(data + 2 * (i + 1)) : LoadLE<uint16_t>(data + 2 * (i + 1));
+      if (low >= 0xDC00 && low < 0xE000) {
+        c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+        ++i;
+      }
+    }
+    
+    if (c < 0x80) {
+      s += (char) c;
+    } else if (c < 0x800) {
+      s += (char) (0xC0 | (c >> 6));
+      s += (char) (0x80 | (c & 0x3F));
+    } else if (c < 0x10000) {
+      s += (char) (0xE0 | (c >> 12));
+      s += (char) (0x80 | ((c >> 6) & 0x3F));
+      s += (char) (0x80 | (c & 0x3F));
+    } else {
+      s += (char) (0xF0 | (c >> 18));
+      s += (char) (0x80 | ((c >> 12) & 0x3F));
+      s += (char) (0x80 | ((c >> 6) & 0x3F));
+      s += (char) (0x80 | (c & 0x3F));
+    }
+  }
+  
+  return s;
+}
+
+// Bounds-checked little-endian reads from a span of bytes, for the format parsers. Reading or seeking past the end
+// returns zero and leaves the reader failed, so a parser can read a whole header and check once at the end.
+class ByteReader {
+  const uint8_t *data;
+  size_t length;
+  size_t position = 0;
+  bool failed = false;
+  
+public:
+  ByteReader(const uint8_t *data, size_t length) : data(data), length(length) {}
+  
+  template <typename T>
+  T Read()
+  {
+    if (failed || length - position < sizeof(T)) {
+      failed = true;
+      return T();
+    }
+    
+    T value = LoadLE<T>(data + position);
+    position += sizeof(T);
+    return value;
+  }
+  
+  void Skip(size_t count)
+  {
+    if (failed || count > length - position)
+      failed = true;
+    else
+      position += count;
+  }
+  
+  void Seek(size_t offset)
+  {
+    if (failed || offset > length)
+      failed = true;
+    else
+      position = offset;
+  }
+  
+  // Position of the first `pattern` at or after `from`, GetLength() if there is none
+  size_t Find(const char *pattern, size_t pattern_length, size_t from) const
+  {
+    if (from >= length)
+      return length;
+    
+    return std::search(data + from, data + length, (const uint8_t *) pattern, (const uint8_t *) pattern + pattern_length) - data;
+  }
+  
+  size_t Tell() const { return position; }
+  size_t GetLength() const { return length; }
+  bool Failed() const { return failed; }
+};
+
+class Format {
+protected:
+  uint64_t size = -1;
+  bool ready = false;
+  bool complete = false; // Parse() got exactly the object (a whole file), not a span starting with it
+public:
+
+  Format() {}
+  virtual ~Format() {}
+  
+  uint64_t GetSize() const
+  {
+    return size;
+  }
+  
+  bool IsReady() const
+  {
+    return ready;
+  }
+  
+  // Called first by Parse(), ParseWhole() and ParseFile(), so a format object parsed again reflects only the last
+  // object. Formats with fields of their own extend it.
+  virtual void Reset()
+  {
+    this->size = -1;
+    this->ready = false;
+    this->complete = false;
+  }
+  
+  // Parses the object starting at data[0]. Reads never go past `length`, so any span of bytes (a mapped file, a window
+  // of a disk image) can be handed over. On success `size` is the object's length as its structure tells, which can be
+  // more than `length` for formats recording it in a header.
+  bool Parse(const uint8_t *data, size_t length)
+  {
+    Reset();
+    return ParseObject(data, length);
+  }
+  
+  // Parses a span holding exactly one object, not just starting with it: the data is the whole file (or the whole
+  // object carved out of a disk image), formats that would look for its end take it as given.
+  bool ParseWhole(const uint8_t *data, size_t length)
+  {
+    Reset();
+    this->complete = true;
+    return ParseObject(data, length);
+  }
+  
+  // Parses a file holding one object, mapped into memory as a whole. The size is the file's.
+  void ParseFile(const char *name)
+  {
+    Reset();
+    
+    HANDLE file = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+      return;
+    
+    LARGE_INTEGER length;
+    HANDLE mapping = nullptr;
+    const uint8_t *view = nullptr;
+    
+    // Empty files can't be mapped (and hold no object)
+    if (GetFileSizeEx(file, &length) && length.QuadPart > 0 && (uint64_t) length.QuadPart <= SIZE_MAX)
+      mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping != nullptr)
+      view = (const uint8_t *) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    
+    if (view != nullptr && ParseWhole(view, (size_t) length.QuadPart))
+      this->size = length.QuadPart;
+    
+    if (view != nullptr)
+      UnmapViewOfFile(view);
+    if (mapping != nullptr)
+      CloseHandle(mapping);
+    CloseHandle(file);
+  }
+  
+protected:
+  // The format's own part of Parse(), ParseWhole() and ParseFile(), always called right after Reset()
+  virtual bool ParseObject(const uint8_t *data, size_t length) = 0;
+};
+
+class Format_Document : public Format {
+public:
+  Format_Document() {}
+  ~Format_Document() {}
+};
+
+class Format_Binary_Image : public Format {
+protected:
+  uint16_t architecture = 0;
+public:
+  Format_Binary_Image() {}
+  ~Format_Binary_Image() {}
+  virtual bool Is64Bit() const = 0;
+  
+  void Reset()
+  {
+    Format::Reset();
+    this->architecture = 0;
+  }
+};
+
+class Format_Archiver : public Format {
+public:
+  Format_Archiver() {}
+  ~Format_Archiver() {}
+};
+
+class Format_Image : public Format {
+protected:
+  uint64_t width = 0, height = 0;
+  uint16_t planes = 0;
+  
+public:
+  Format_Image() {}
+  ~Format_Image() {}
+  
+  void Reset()
+  {
+    Format::Reset();
+    this->width = 0;
+    this->height = 0;
+    this->planes = 0;
+  }
+  
+  uint64_t GetWidth() const
+  {
+    return width;
+  }
+  
+  uint64_t GetHeight() const
+  {
+    return height;
+  }
+  
+  uint16_t GetPlaneCount() const
+  {
+    return planes;
+  }
+};
+
+// Deflate (RFC 1951) decompression, optionally inside a zlib (RFC 1950) wrapper, after Mark Adler's puff: canonical
+// Huffman codes are decoded a bit at a time, which is slow but small. Only PDF streams use it, and only the few the
+// PDF parser asks for.
+namespace Deflate {
+  struct BitReader {
+    const uint8_t *data;
+    size_t length;
+    size_t position = 0;
+    uint32_t bits = 0;
+    int count = 0;
+    bool failed = false;
+    
+    BitReader(const uint8_t *data, size_t length) : data(data), length(length) {}
+    
+    uint32_t Get(int n)
+    {
+      while (count < n) {
+        if (position >= length) {
+          failed = true;
+          return 0;
+        }
+        
+        bits |= (uint32_t) data[position++] << count;
+        count += 8;
+      }
+      
+      uint32_t value = bits & ((1u << n) - 1);
+      bits >>= n;
+      count -= n;
+      return value;
+    }
+  };
+  
+  // Code counts per length and the symbols in code order, which is all a canonical code needs
+  struct Huffman {
+    uint16_t counts[16];
+    uint16_t symbols[288];
+    
+    bool Build(const uint8_t *lengths, int n)
+    {
+      memset(counts, 0, sizeof(counts));
+      for (int i = 0; i < n; ++i)
+        ++counts[lengths[i]];
+      
+      // Over-subscribed codes are invalid, incomplete ones are allowed (a single distance code)
+      int left = 1;
+      for (int length = 1; length < 16; ++length) {
+        left = (left << 1) - counts[length];
+        if (left < 0)
+          return false;
+      }
+      
+      uint16_t offsets[16];
+      offsets[1] = 0;
+      for (int length = 1; length < 15; ++length)
+        offsets[length + 1] = offsets[length] + counts[length];
+      
+      for (int i = 0; i < n; ++i) {
+        if (lengths[i] != 0)
+          symbols[offsets[lengths[i]]++] = (uint16_t) i;
+      }
+      
+      return true;
+    }
+    
+    int Decode(BitReader &reader) const
+    {
+      int code = 0, first = 0, index = 0;
+      
+      for (int length = 1; length < 16; ++length) {
+        code |= (int) reader.Get(1);
+        int count = counts[length];
+        
+        if (code - count < first)
+          return symbols[index + (code - first)];
+        
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+      }
+      
+      return -1;
+    }
+  };
+  
+  static const uint16_t LengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+  static const uint8_t LengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+  static const uint16_t DistanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+  static const uint8_t DistanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+  
+  static bool Codes(BitReader &reader, const Huffman &literals, const Huffman &distances, std::string &out, size_t maximum)
+  {
+    for (;;) {
+      int symbol = literals.Decode(reader);
+      if (symbol < 0 || reader.failed)
+        return false;
+      
+      if (symbol < 256) {
+        if (out.length() >= maximum)
+          return false;
+        
+        out += (char) symbol;
+        continue;
+      }
+      
+      if (symbol == 256)
+        return true;
+      
+      symbol -= 257;
+      if (symbol >= 29)
+        return false;
+      
+      size_t length = LengthBase[symbol] + reader.Get(LengthExtra[symbol]);
+      
+      int distance_symbol = distances.Decode(reader);
+      if (distance_symbol < 0 || distance_symbol >= 30)
+        return false;
+      
+      size_t distance = DistanceBase[distance_symbol] + reader.Get(DistanceExtra[distance_symbol]);
+      if (reader.failed || distance > out.length() || out.length() + length > maximum)
+        return false;
+      
+      // May overlap what it copies, byte by byte is what the format means
+      size_t from = out.length() - distance;
+      for (size_t i = 0; i < length; ++i)
+        out += out[from + i];
+    }
+  }
+  
+  static bool Fixed(BitReader &reader, std::string &out, size_t maximum)
+  {
+    static const auto tables = [] () -> std::pair<Huffman, Huffman> {
+      uint8_t lengths[288];
+      std::pair<Huffman, Huffman> t;
+      
+      for (int i = 0; i < 288; ++i)
+        lengths[i] = i < 144 ? 8 : (i < 256 ? 9 : (i < 280 ? 7 : 8));
+      t.first.Build(lengths, 288);
+      
+      for (int i = 0; i < 30; ++i)
+        lengths[i] = 5;
+      t.second.Build(lengths, 30);
+      
+      return t;
+    }();
+    
+    return Codes(reader, tables.first, tables.second, out, maximum);
+  }
+  
+  static bool Dynamic(BitReader &reader, std::string &out, size_t maximum)
+  {
+    static const uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    
+    int literal_count = (int) reader.Get(5) + 257;
+    int distance_count = (int) reader.Get(5) + 1;
+    int code_count = (int) reader.Get(4) + 4;
+    if (literal_count > 286 || distance_count > 30)
+      return false;
+    
+    uint8_t lengths[320] = {0};
+    for (int i = 0; i < code_count; ++i)
+      lengths[order[i]] = (uint8_t) reader.Get(3);
+    
+    Huffman code_lengths;
+    if (reader.failed || !code_lengths.Build(lengths, 19))
+      return false;
+    
+    // The literal/length and distance code lengths, run-length encoded as one sequence
+    for (int i = 0; i < literal_count + distance_count; ) {
+      int symbol = code_lengths.Decode(reader);
+      if (symbol < 0 || reader.failed)
+        return false;
+      
+      if (symbol < 16) {
+        lengths[i++] = (uint8_t) symbol;
+        continue;
+      }
+      
+      uint8_t length = 0;
+      int repeat;
+      if (symbol == 16) {
+        if (i == 0)
+          return false;
+        length = lengths[i - 1];
+        repeat = 3 + (int) reader.Get(2);
+      } else if (symbol == 17) {
+        repeat = 3 + (int) reader.Get(3);
+      } else {
+        repeat = 11 + (int) reader.Get(7);
+      }
+      
+      if (i + repeat > literal_count + distance_count)
+        return false;
+      while (repeat-- > 0)
+        lengths[i++] = length;
+    }
+    
+    // Without an end-of-block code the block can't end
+    Huffman literals, distances;
+    if (lengths[256] == 0 || !literals.Build(lengths, literal_count) || !distances.Build(lengths + literal_count, distance_count))
+      return false;
+    
+    return Codes(reader, literals, distances, out, maximum);
+  }
+}
+
+// Decompresses `data` into `out`, failing on malformed data or once the output would exceed `maximum` bytes (which
+// keeps a small, hostile stream from expanding into gigabytes). The Adler-32 trailer isn't checked.
+static bool Inflate(const uint8_t *data, size_t length, std::string &out, size_t maximum)
+{
+  out.clear();
+  
+  // zlib header: deflate, no preset dictionary, checksum. Some writers leave the header out, that's raw deflate then.
+  if (length >= 2 && (data[0] & 0x0f) == 8 && (data[0] >> 4) <= 7 && ((data[0] << 8) | data[1]) % 31 == 0 && !(data[1] & 0x20)) {
+    data += 2;
+    length -= 2;
+  }
+  
+  Deflate::BitReader reader(data, length);
+  
+  for (bool last = false; !last; ) {
+    last = reader.Get(1) != 0;
+    uint32_t type = reader.Get(2);
+    bool success;
+    
+    if (type == 0) {
+      // Stored: byte aligned, the bits left in the current byte are dropped
+      reader.bits = 0;
+      reader.count = 0;
+      
+      if (reader.length - reader.position < 4)
+        return false;
+      
+      size_t stored = LoadLE<uint16_t>(reader.data + reader.position);
+      if ((stored ^ 0xffff) != LoadLE<uint16_t>(reader.data + reader.position + 2))
+        return false;
+      
+      reader.position += 4;
+      if (reader.length - reader.position < stored || out.length() + stored > maximum)
+        return false;
+      
+      out.append((const char *) reader.data + reader.position, stored);
+      reader.position += stored;
+      success = true;
+    } else if (type == 1) {
+      success = Deflate::Fixed(reader, out, maximum);
+    } else if (type == 2) {
+      success = Deflate::Dynamic(reader, out, maximum);
+    } else {
+      success = false;
+    }
+    
+    if (!success || reader.failed)
+      return false;
+  }
+  
+  return true;
+}
+
+// Object-level access to a PDF through its cross-reference data, found from the end of the file: `startxref` in the
+// last kilobyte points at the newest xref section (a table, or a compressed xref stream), whose /Prev leads to the
+// older ones. Only the tail, the xref sections and the objects asked for are read, so on a mapped file the pages in
+// between are never touched.
+class PDFReader {
+public:
+  struct Object {
+    enum Type { Null, Boolean, Number, Name, String, Array, Dictionary, Reference } type = Null;
+    double number = 0;
+    uint32_t id = 0, generation = 0; // Reference
+    std::string text;                // Name, String
+    std::vector<Object> items;       // Array items, Dictionary values
+    VectorString keys;               // Dictionary keys
+    
+    const Object *Find(const char *key) const
+    {
+      for (size_t i = 0; i < keys.size() && type == Dictionary; ++i) {
+        if (keys[i] == key)
+          return &items[i];
+      }
+      
+      return nullptr;
+    }
+    
+    bool IsName(const char *name) const
+    {
+      return type == Name && text == name;
+    }
+    
+    // A whole number from 0 to `maximum` (2^53 at most, beyond that doubles skip integers). Numbers in a file can be
+    // anything, casting one out of range is undefined.
+    bool GetInteger(uint64_t &value, uint64_t maximum = MaximumInteger) const
+    {
+      if (type != Number || !(number >= 0) || number > (double) (maximum < MaximumInteger ? maximum : MaximumInteger) || number != (double) (uint64_t) number)
+        return false;
+      
+      value = (uint64_t) number;
+      return true;
+    }
+    
+    static const uint64_t MaximumInteger = (uint64_t) 1 << 53;
+  };
+  
+private:
+  // Objects are numbered densely, larger numbers than this don't occur in real files
+  static const uint32_t MaximumObjects = 8 * 1024 * 1024;
+  static const size_t MaximumStream = 64 * 1024 * 1024;
+  static const size_t MaximumCache = 64 * 1024 * 1024; // Decoded object streams kept at once
+  static const int MaximumDepth = 32;
+  
+  struct XRefEntry {
+    uint8_t type = 0;    // 0 unknown or free, 1 at `offset`, 2 number `index` in object stream `offset`
+    bool listed = false; // By a newer section, older ones don't change it even when it's free
+    uint64_t offset = 0;
+    uint32_t index = 0;
+  };
+  
+  using XRefSection = std::vector<std::pair<uint64_t, XRefEntry>>; // (number, entry)
+  
+  // The parts of an object stream Resolve() needs, kept as each is decoded
+  struct ObjectStream {
+    std::string data;
+    std::vector<std::pair<uint32_t, size_t>> objects; // (number, offset in data)
+  };
+  
+  const uint8_t *data;
+  size_t length;
+  std::vector<XRefEntry> xref;
+  uint64_t limit = 0; // Object numbers from here on are ignored
+  std::unordered_map<uint32_t, ObjectStream> object_streams;
+  size_t cached = 0;  // Bytes of decoded data in object_streams
+  Object trailer;
+  int resolving = 0;
+  
+  static bool IsSpace(uint8_t c)
+  {
+    return c == 0 || c == '\t' || c == '\n' || c == '\f' || c == '\r' || c == ' ';
+  }
+  
+  static bool IsDelimiter(uint8_t c)
+  {
+    return c == '(' || c == ')' || c == '<' || c == '>' || c == '[' || c == ']' || c == '{' || c == '}' || c == '/' || c == '%';
+  }
+  
+  static bool IsRegular(uint8_t c)
+  {
+    return !IsSpace(c) && !IsDelimiter(c);
+  }
+  
+  // Tokens and objects are read from any buffer, the file or a decoded object stream
+  struct Lexer {
+    const uint8_t *data;
+    size_t length;
+    size_t position;
+    
+    Lexer(const uint8_t *data, size_t length, size_t position) : data(data), length(length), position(position) {}
+    
+    void SkipSpace()
+    {
+      while (position < length) {
+        if (data[position] == '%') {
+          while (position < length && data[position] != '\r' && data[position] != '\n')
+            ++position;
+        } else if (IsSpace(data[position])) {
+          ++position;
+        } else {
+          break;
+        }
+      }
+    }
+    
+    std::string ReadKeyword()
+    {
+      SkipSpace();
+      size_t start = position;
+      while (position < length && IsRegular(data[position]))
+        ++position;
+      
+      return std::string((const char *) data + start, position - start);
+    }
+    
+    bool ReadInteger(uint64_t &value)
+    {
+      SkipSpace();
+      size_t start = position;
+      value = 0;
+      
+      while (position < length && isdigit(data[position]) && position - start < 19)
+        value = value * 10 + (data[position++] - '0');
+      
+      return position > start && (position >= length || !IsRegular(data[position]));
+    }
+    
+    bool ParseObject(Object &out, int depth)
+    {
+      SkipSpace();
+      if (position >= length || depth > MaximumDepth)
+        return false;
+      
+      uint8_t c = data[position];
+      
+      if (c == '/') {
+        out.type = Object::Name;
+        for (++position; position < length && IsRegular(data[position]); ++position) {
+          // #xx escapes
+          if (data[position] == '#' && position + 2 < length && isxdigit(data[position + 1]) && isxdigit(data[position + 2])) {
+            char hex[3] = { (char) data[position + 1], (char) data[position + 2], 0 };
+            out.text += (char) strtoul(hex, nullptr, 16);
+            position += 2;
+          } else {
+            out.text += (char) data[position];
+          }
+        }
+        
+        return true;
+      }
+      
+      if (c == '(') {
+        out.type = Object::String;
+        int nesting = 1;
+        
+        for (++position; position < length; ++position) {
+          c = data[position];
+          
+          if (c == '\\' && position + 1 < length) {
+            c = data[++position];
+            
+            if (c >= '0' && c <= '7') {
+              int value = 0;
+              for (int i = 0; i < 3 && position < length && data[position] >= '0' && data[position] <= '7'; ++i)
+                value = value * 8 + (data[position++] - '0');
+              out.text += (char) value;
+              --position;
+            } else if (c == '\r' || c == '\n') {
+              // Line continuation
+              if (c == '\r' && position + 1 < length && data[position + 1] == '\n')
+                ++position;
+            } else {
+              static const char escapes[] = "n\nr\rt\tb\bf\f";
+              auto escape = strchr(escapes, c);
+              out.text += escape != nullptr && c != 0 && (escape - escapes) % 2 == 0 ? escape[1] : (char) c;
+            }
+          } else if (c == '(') {
+            ++nesting;
+            out.text += (char) c;
+          } else if (c == ')') {
+            if (--nesting == 0) {
+              ++position;
+              return true;
+            }
+            out.text += (char) c;
+          } else {
+            out.text += (char) c;
+          }
+        }
+        
+        return false;
+      }
+      
+      if (c == '<' && position + 1 < length && data[position + 1] == '<') {
+        out.type = Object::Dictionary;
+        position += 2;
+        
+        for (;;) {
+          SkipSpace();
+          if (position + 1 < length && data[position] == '>' && data[position + 1] == '>') {
+            position += 2;
+            return true;
+          }
+          
+          Object key, value;
+          if (!ParseObject(key, depth + 1) || key.type != Object::Name || !ParseObject(value, depth + 1))
+            return false;
+          
+          out.keys.push_back(std::move(key.text));
+          out.items.push_back(std::move(value));
+        }
+      }
+      
+      if (c == '<') {
+        out.type = Object::String;
+        std::string digits;
+        
+        for (++position; position < length && data[position] != '>'; ++position) {
+          if (isxdigit(data[position]))
+            digits += (char) data[position];
+          else if (!IsSpace(data[position]))
+            return false;
+        }
+        
+        if (position >= length)
+          return false;
+        ++position;
+        
+        if (digits.length() % 2 != 0)
+          digits += '0';
+        for (size_t i = 0; i < digits.length(); i += 2)
+          out.text += (char) strtoul(digits.substr(i, 2).c_str(), nullptr, 16);
+        
+        return true;
+      }
+      
+      if (c == '[') {
+        out.type = Object::Array;
+        ++position;
+        
+        for (;;) {
+          SkipSpace();
+          if (position < length && data[position] == ']') {
+            ++position;
+            return true;
+          }
+          
+          Object item;
+          if (!ParseObject(item, depth + 1))
+            return false;
+          out.items.push_back(std::move(item));
+        }
+      }
+      
+      if (isdigit(c) || c == '+' || c == '-' || c == '.') {
+        size_t start = position;
+        while (position < length && (isdigit(data[position]) || data[position] == '+' || data[position] == '-' || data[position] == '.'))
+          ++position;
+        
+        out.type = Object::Number;
+        out.number = atof(std::string((const char *) data + start, position - start).c_str());
+        
+        // "12 0 R" is a reference
+        bool integer = std::all_of(data + start, data + position, [] (uint8_t d) -> bool { return isdigit(d) != 0; });
+        if (integer && out.number <= UINT32_MAX) {
+          size_t after = position;
+          uint64_t generation;
+          
+          if (ReadInteger(generation) && generation <= 65535 && ReadKeyword() == "R") {
+            out.type = Object::Reference;
+            out.id = (uint32_t) out.number;
+            out.generation = (uint32_t) generation;
+          } else {
+            position = after;
+          }
+        }
+        
+        return true;
+      }
+      
+      auto keyword = ReadKeyword();
+      if (keyword == "true" || keyword == "false") {
+        out.type = Object::Boolean;
+        out.number = keyword == "true";
+        return true;
+      }
+      
+      return keyword == "null";
+    }
+  };
+  
+  // "12 0 obj <value> [stream ... endstream]" at `offset`. `stream` and `stream_length` give the raw stream data.
+  bool ReadIndirectObject(uint64_t offset, uint32_t id, Object &value, const uint8_t **stream, size_t *stream_length)
+  {
+    if (offset >= length)
+      return false;
+    
+    Lexer lexer(data, length, (size_t) offset);
+    uint64_t number, generation;
+    
+    if (!lexer.ReadInteger(number) || (id != UINT32_MAX && number != id) || !lexer.ReadInteger(generation) ||
+        lexer.ReadKeyword() != "obj" || !lexer.ParseObject(value, 0))
+      return false;
+    
+    if (stream == nullptr)
+      return true;
+    
+    *stream = nullptr;
+    *stream_length = 0;
+    
+    auto end_of_value = lexer.position;
+    if (value.type != Object::Dictionary || lexer.ReadKeyword() != "stream") {
+      lexer.position = end_of_value;
+      return true;
+    }
+    
+    // The data starts after the end of line following "stream"
+    auto start = lexer.position;
+    if (start < length && data[start] == '\r')
+      ++start;
+    if (start < length && data[start] == '\n')
+      ++start;
+    
+    // /Length is usually right; when it isn't (or is an object of its own that can't be read), "endstream" tells
+    Object stream_size;
+    auto size = value.Find("Length");
+    if (size != nullptr)
+      stream_size = Resolve(*size);
+    
+    uint64_t count;
+    if (!stream_size.GetInteger(count, SIZE_MAX))
+      count = SIZE_MAX;
+    
+    if (count > length - start || !CheckEndStream(start + count)) {
+      ByteReader reader(data, length);
+      auto end = reader.Find("endstream", 9, start);
+      if (end >= length)
+        return false;
+      
+      // Drop the end of line before "endstream"
+      count = end - start;
+      if (count > 0 && data[start + count - 1] == '\n')
+        --count;
+      if (count > 0 && data[start + count - 1] == '\r')
+        --count;
+    }
+    
+    *stream = data + start;
+    *stream_length = count;
+    return true;
+  }
+  
+  bool CheckEndStream(size_t position) const
+  {
+    Lexer lexer(data, length, position);
+    return lexer.ReadKeyword() == "endstream";
+  }
+  
+  // Undoes the PNG row filters xref and object streams are usually stored with (/DecodeParms /Predictor 10-15)
+  static bool UndoPredictor(std::string &stream, const Object *parameters)
+  {
+    const Object *predictor = parameters != nullptr ? parameters->Find("Predictor") : nullptr;
+    if (predictor == nullptr || predictor->number < 10)
+      return predictor == nullptr || predictor->number <= 1;
+    
+    auto Integer = [parameters] (const char *key, double fallback) -> size_t {
+      auto value = parameters->Find(key);
+      return (size_t) (value != nullptr && value->type == Object::Number && value->number > 0 && value->number < 65536 ? value->number : fallback);
+    };
+    
+    size_t pixel = std::max<size_t>(1, Integer("Colors", 1) * Integer("BitsPerComponent", 8) / 8);
+    size_t row = (Integer("Colors", 1) * Integer("BitsPerComponent", 8) * Integer("Columns", 1) + 7) / 8;
+    
+    std::string out;
+    std::vector<uint8_t> previous(row, 0), current(row);
+    
+    for (size_t at = 0; at + 1 + row <= stream.length(); at += 1 + row) {
+      uint8_t filter = (uint8_t) stream[at];
+      
+      for (size_t i = 0; i < row; ++i) {
+        int x = (uint8_t) stream[at + 1 + i];
+        int left = i >= pixel ? current[i - pixel] : 0;
+        int up = previous[i];
+        int up_left = i >= pixel ? previous[i - pixel] : 0;
+        
+        switch (filter) {
+          case 0: break;
+          case 1: x += left; break;
+          case 2: x += up; break;
+          case 3: x += (left + up) / 2; break;
+          case 4: {
+            int p = left + up - up_left;
+            int pa = abs(p - left), pb = abs(p - up), pc = abs(p - up_left);
+            x += pa <= pb && pa <= pc ? left : (pb <= pc ? up : up_left);
+            break;
+          }
+          default: return false;
+        }
+        
+        current[i] = (uint8_t) x;
+      }
+      
+      out.append((const char *) current.data(), row);
+      previous.swap(current);
+    }
+    
+    stream = std::move(out);
+    return true;
+  }
+  
+  // Applies the stream's filters. Only FlateDecode (by far the most common, and what xref and object streams use) is
+  // supported.
+  static bool DecodeStream(const Object &dictionary, const uint8_t *raw, size_t raw_length, std::string &out)
+  {
+    const Object *filter = dictionary.Find("Filter");
+    const Object *parameters = dictionary.Find("DecodeParms");
+    
+    // A one-element filter array is the same as the filter itself
+    if (filter != nullptr && filter->type == Object::Array && filter->items.size() == 1) {
+      filter = &filter->items[0];
+      if (parameters != nullptr && parameters->type == Object::Array)
+        parameters = parameters->items.empty() ? nullptr : &parameters->items[0];
+    }
+    
+    if (filter == nullptr) {
+      out.assign((const char *) raw, raw_length);
+      return true;
+    }
+    
+    if (!filter->IsName("FlateDecode") && !filter->IsName("Fl"))
+      return false;
+    
+    return Inflate(raw, raw_length, out, MaximumStream) && UndoPredictor(out, parameters != nullptr && parameters->type == Object::Dictionary ? parameters : nullptr);
+  }
+  
+  static void AddEntry(XRefSection &section, uint64_t number, uint8_t type, uint64_t offset, uint32_t index)
+  {
+    XRefEntry entry;
+    entry.type = type;
+    entry.offset = offset;
+    entry.index = index;
+    section.push_back(std::make_pair(number, entry));
+  }
+  
+  // Sections are read newest first, so an entry listed already is the current one, free or not. Within a section, free
+  // entries come last: hybrid files list the objects of their hidden xref stream as free in the table.
+  void SetEntries(const XRefSection &section)
+  {
+    for (int free = 0; free < 2; ++free) {
+      for (const auto &entry : section) {
+        if ((entry.second.type == 0) != (free == 1) || entry.first >= limit)
+          continue;
+        
+        if (entry.first >= xref.size())
+          xref.resize((size_t) entry.first + 1);
+        
+        auto &current = xref[(size_t) entry.first];
+        if (!current.listed) {
+          current = entry.second;
+          current.listed = true;
+        }
+      }
+    }
+  }
+  
+  // A classic "xref" table, followed by its trailer dictionary
+  bool ReadXRefTable(Lexer &lexer, Object &section_trailer, XRefSection &section)
+  {
+    for (;;) {
+      auto position = lexer.position;
+      uint64_t first, count;
+      
+      if (!lexer.ReadInteger(first) || !lexer.ReadInteger(count)) {
+        lexer.position = position;
+        return lexer.ReadKeyword() == "trailer" && lexer.ParseObject(section_trailer, 0) && section_trailer.type == Object::Dictionary;
+      }
+      
+      if (first + count > MaximumObjects)
+        return false;
+      
+      for (uint64_t i = 0; i < count; ++i) {
+        uint64_t offset, generation;
+        if (!lexer.ReadInteger(offset) || !lexer.ReadInteger(generation))
+          return false;
+        
+        auto kind = lexer.ReadKeyword();
+        if (kind != "n" && kind != "f")
+          return false;
+        
+        AddEntry(section, first + i, kind == "n" ? 1 : 0, offset, 0);
+      }
+    }
+  }
+  
+  // An xref stream (PDF 1.5): binary rows of /W-sized big-endian fields, its dictionary is the trailer
+  bool ReadXRefStream(uint64_t offset, Object &section_trailer, XRefSection &section)
+  {
+    const uint8_t *raw;
+    size_t raw_length;
+    std::string rows;
+    
+    if (!ReadIndirectObject(offset, UINT32_MAX, section_trailer, &raw, &raw_length) || raw == nullptr)
+      return false;
+    
+    auto type = section_trailer.Find("Type");
+    auto widths = section_trailer.Find("W");
+    auto size = section_trailer.Find("Size");
+    
+    if (type == nullptr || !type->IsName("XRef") || widths == nullptr || widths->type != Object::Array || widths->items.size() != 3 ||
+        size == nullptr || !DecodeStream(section_trailer, raw, raw_length, rows))
+      return false;
+    
+    size_t w[3], row = 0;
+    for (int i = 0; i < 3; ++i) {
+      uint64_t width;
+      if (!widths->items[i].GetInteger(width, 8))
+        return false;
+      w[i] = (size_t) width;
+      row += w[i];
+    }
+    
+    if (row == 0)
+      return false;
+    
+    // (first, count) pairs, all objects by default
+    std::vector<uint64_t> index;
+    auto subsections = section_trailer.Find("Index");
+    if (subsections != nullptr && subsections->type == Object::Array) {
+      for (const auto &item : subsections->items) {
+        uint64_t value;
+        if (!item.GetInteger(value, MaximumObjects))
+          return false;
+        index.push_back(value);
+      }
+    } else {
+      uint64_t count;
+      if (!size->GetInteger(count, MaximumObjects))
+        return false;
+      index.push_back(0);
+      index.push_back(count);
+    }
+    
+    auto Field = [&rows] (size_t at, size_t width) -> uint64_t {
+      uint64_t value = 0;
+      for (size_t i = 0; i < width; ++i)
+        value = (value << 8) | (uint8_t) rows[at + i];
+      return value;
+    };
+    
+    size_t at = 0;
+    for (size_t i = 0; i + 1 < index.size(); i += 2) {
+      if (index[i] + index[i + 1] > MaximumObjects)
+        return false;
+      
+      for (uint64_t j = 0; j < index[i + 1] && at + row <= rows.length(); ++j, at += row) {
+        // A missing type field means type 1
+        uint64_t kind = w[0] == 0 ? 1 : Field(at, w[0]);
+        uint64_t second = Field(at + w[0], w[1]);
+        uint64_t third = Field(at + w[0] + w[1], w[2]);
+        
+        if (kind <= 2)
+          AddEntry(section, index[i] + j, (uint8_t) kind, second, (uint32_t) third);
+      }
+    }
+    
+    return true;
+  }
+  
+  // The object stream `number`, decoded and with its table of contents read
+  const ObjectStream *GetObjectStream(uint32_t number)
+  {
+    auto it = object_streams.find(number);
+    if (it != object_streams.end())
+      return &it->second;
+    
+    if (number >= xref.size() || xref[number].type != 1)
+      return nullptr;
+    
+    Object dictionary;
+    const uint8_t *raw;
+    size_t raw_length;
+    ObjectStream stream;
+    
+    if (!ReadIndirectObject(xref[number].offset, number, dictionary, &raw, &raw_length) || raw == nullptr ||
+        !DecodeStream(dictionary, raw, raw_length, stream.data))
+      return nullptr;
+    
+    auto count = dictionary.Find("N");
+    auto first = dictionary.Find("First");
+    uint64_t start;
+    if (count == nullptr || first == nullptr || !first->GetInteger(start, stream.data.length()))
+      return nullptr;
+    
+    // "number offset" pairs, offsets relative to /First
+    Lexer lexer((const uint8_t *) stream.data.data(), stream.data.length(), 0);
+    for (double i = 0; i < count->number; ++i) {
+      uint64_t id, offset;
+      if (!lexer.ReadInteger(id) || !lexer.ReadInteger(offset))
+        break;
+      
+      stream.objects.push_back(std::make_pair((uint32_t) id, (size_t) start + (size_t) offset));
+    }
+    
+    // Dropped all at once when full, a document's objects rarely span many streams
+    if (cached + stream.data.length() > MaximumCache) {
+      object_streams.clear();
+      cached = 0;
+    }
+    
+    cached += stream.data.length();
+    return &(object_streams[number] = std::move(stream));
+  }
+  
+public:
+  PDFReader(const uint8_t *data, size_t length) : data(data), length(length) {}
+  
+  // Reads the xref sections from `startxref` down the /Prev chain. False if there are none or they're damaged.
+  bool Load()
+  {
+    TRACE_SCOPE("PDFReader::Load");
+    
+    const size_t tail = std::min<size_t>(length, 1024);
+    
+    // The last "startxref" (there is one per incremental update)
+    size_t at = length;
+    for (size_t i = length - tail; i + 9 <= length; ++i) {
+      if (memcmp(data + i, "startxref", 9) == 0)
+        at = i + 9;
+    }
+    
+    Lexer lexer(data, length, at);
+    uint64_t offset;
+    if (at >= length || !lexer.ReadInteger(offset))
+      return false;
+    
+    std::unordered_set<uint64_t> visited;
+    
+    // Every object number below the highest takes at least a byte of xref data, so a tiny file can't make the table
+    // huge; the newest trailer's /Size narrows it down further
+    limit = std::min<uint64_t>(MaximumObjects, length);
+    
+    while (visited.insert(offset).second && visited.size() <= 256 && offset < length) {
+      Object section_trailer;
+      XRefSection section;
+      Lexer lexer(data, length, (size_t) offset);
+      
+      bool success;
+      if (lexer.ReadKeyword() == "xref") {
+        success = ReadXRefTable(lexer, section_trailer, section);
+        
+        // Hybrid files: the objects only newer readers should see are in an xref stream next to the table
+        auto hidden = section_trailer.Find("XRefStm");
+        Object ignored;
+        uint64_t stream;
+        if (success && hidden != nullptr && hidden->GetInteger(stream))
+          ReadXRefStream(stream, ignored, section);
+      } else {
+        success = ReadXRefStream(offset, section_trailer, section);
+      }
+      
+      if (!success)
+        break;
+      
+      auto size = section_trailer.Find("Size");
+      uint64_t objects;
+      if (trailer.type != Object::Dictionary && size != nullptr && size->GetInteger(objects))
+        limit = std::min(limit, objects);
+      
+      SetEntries(section);
+      
+      // Newer trailers win
+      for (size_t i = 0; i < section_trailer.keys.size(); ++i) {
+        if (trailer.Find(section_trailer.keys[i].c_str()) == nullptr) {
+          trailer.keys.push_back(section_trailer.keys[i]);
+          trailer.items.push_back(section_trailer.items[i]);
+        }
+      }
+      trailer.type = Object::Dictionary;
+      
+      auto previous = section_trailer.Find("Prev");
+      if (previous == nullptr || !previous->GetInteger(offset))
+        break;
+    }
+    
+    return trailer.Find("Root") != nullptr;
+  }
+  
+  const Object &GetTrailer() const
+  {
+    return trailer;
+  }
+  
+  // Objects in use, as listed by the xref sections
+  size_t GetObjectCount() const
+  {
+    return (size_t) std::count_if(xref.begin(), xref.end(), [] (const XRefEntry &e) -> bool { return e.type != 0; });
+  }
+  
+  // The object a reference points to, anything else as is. Null when it can't be found or read.
+  Object Resolve(const Object &object)
+  {
+    if (object.type != Object::Reference)
+      return object;
+    
+    Object value;
+    if (object.id >= xref.size() || resolving >= MaximumDepth)
+      return value;
+    
+    ++resolving;
+    const auto entry = xref[object.id];
+    
+    if (entry.type == 1) {
+      if (!ReadIndirectObject(entry.offset, object.id, value, nullptr, nullptr))
+        value = Object();
+    } else if (entry.type == 2 && entry.offset <= UINT32_MAX) {
+      auto stream = GetObjectStream((uint32_t) entry.offset);
+      
+      if (stream != nullptr && entry.index < stream->objects.size() && stream->objects[entry.index].first == object.id) {
+        Lexer lexer((const uint8_t *) stream->data.data(), stream->data.length(), stream->objects[entry.index].second);
+        if (!lexer.ParseObject(value, 0))
+          value = Object();
+      }
+    }
+    
+    --resolving;
+    return value;
+  }
+  
+  // Dictionary entry `key` of a (possibly referenced) dictionary, resolved
+  Object Get(const Object &dictionary, const char *key)
+  {
+    auto resolved = Resolve(dictionary);
+    auto value = resolved.Find(key);
+    return value != nullptr ? Resolve(*value) : Object();
+  }
+};
+
+// PDF text strings are UTF-16BE when they start with a byte order mark, PDFDocEncoding (close enough to Latin-1)
+// otherwise
+static std::string DecodePDFText(const std::string &text)
+{
+  if (text.length() >= 2 && (uint8_t) text[0] == 0xfe && (uint8_t) text[1] == 0xff)
+    return UTF16ToUTF8((const uint8_t *) text.data() + 2, (text.length() - 2) / 2, true);
+  
+  std::string s;
+  for (unsigned char c : text) {
+    if (c < 0x80) {
+      s += (char) c;
+    } else {
+      s += (char) (0xC0 | (c >> 6));
+      s += (char) (0x80 | (c & 0x3F));
+    }
+  }
+  
+  return s;
+}
+
+class Format_PDF : public Format_Document {
+  std::string version;
+  bool xref = false;
+  size_t objects = 0;
+  int64_t pages = -1;
+  bool encrypted = false;
+  std::vector<std::pair<std::string, std::string>> info;
+  
+  // Everything past the header comes from the cross-reference data; without it (damaged or truncated files) only the
+  // version is known
+  void ParseStructure(const uint8_t *data, size_t length)
+  {
+    PDFReader reader(data, length);
+    if (!reader.Load())
+      return;
+    
+    this->xref = true;
+    this->objects = reader.GetObjectCount();
+    
+    const auto &trailer = reader.GetTrailer();
+    this->encrypted = trailer.Find("Encrypt") != nullptr;
+    
+    auto count = reader.Get(reader.Get(*trailer.Find("Root"), "Pages"), "Count");
+    uint64_t pages;
+    if (count.GetInteger(pages))
+      this->pages = (int64_t) pages;
+    
+    // The strings are encrypted along with everything else
+    auto document = trailer.Find("Info");
+    if (document == nullptr || this->encrypted)
+      return;
+    
+    static const char *keys[] = { "Title", "Author", "Subject", "Keywords", "Creator", "Producer", "CreationDate", "ModDate" };
+    auto dictionary = reader.Resolve(*document);
+    
+    for (auto key : keys) {
+      auto value = reader.Get(dictionary, key);
+      if (value.type == PDFReader::Object::String && !value.text.empty())
+        this->info.push_back(std::make_pair(key, DecodePDFText(value.text)));
+    }
+  }
+  
+public:
+  Format_PDF() {}
+  ~Format_PDF() {}
+  
+  std::string GetVersion() const
+  {
+    return version;
+  }
+  
+  bool HasCrossReference() const { return xref; }
+  size_t GetObjectCount() const { return objects; }
+  int64_t GetPageCount() const { return pages; } // -1 if unknown
+  bool IsEncrypted() const { return encrypted; }
+  const std::vector<std::pair<std::string, std::string>> &GetInfo() const { return info; }
+  
+  void Reset()
+  {
+    Format_Document::Reset();
+    this->version.clear();
+    this->xref = false;
+    this->objects = 0;
+    this->pages = -1;
+    this->encrypted = false;
+    this->info.clear();
+  }
+  
+protected:
+  bool ParseObject(const uint8_t *data, size_t length)
+  {
+    TRACE_SCOPE("Format_PDF::Parse");
+    
+    ByteReader reader(data, length);
+    
+    // "%PDF-1.7", the version runs to the end of the line
+    if (length < 8 || memcmp(data, "%PDF-", 5) != 0 || !isdigit(data[5]) || data[6] != '.')
+      return false;
+    
+    size_t end = 5;
+    while (end < length && end < 5 + 15 && data[end] != '\r' && data[end] != '\n')
+      ++end;
+    this->version.assign((const char *) data + 5, end - 5);
+    
+    size_t last = length;
+    
+    // A file is the document, there is nothing to look for (and nothing between the header and the tail is read).
+    // Otherwise every incremental update appends another "%%EOF", the document runs to the last one before the next
+    // PDF header (the next file, when carving a disk image) or the end of the data.
+    if (!this->complete) {
+      size_t next = reader.Find("%PDF-", 5, 5);
+      last = 0;
+      for (size_t at = reader.Find("%%EOF", 5, 0); at < next; at = reader.Find("%%EOF", 5, at + 5))
+        last = at + 5;
+      
+      if (last == 0)
+        return false;
+      
+      // Along with its end of line
+      for (int i = 0; i < 2 && last < next && (data[last] == '\r' || data[last] == '\n'); ++i)
+        ++last;
+    }
+    
+    ParseStructure(data, last);
+    
+    this->size = last;
+    this->ready = true;
+    return true;
+  }
+};
+
+class Format_BMP : public Format_Image {
+  uint16_t bpp = 0;
+  uint32_t compression = BI_RGB;
+  uint32_t pixels = 0;              // Offset of the pixel data
+  bool top_down = false;
+  uint32_t masks[4] = {0, 0, 0, 0}; // Red, green, blue, alpha (zero when there is none)
+  std::vector<uint32_t> palette;    // RGBA, red in the lowest byte
+public:
+  // Not in wingdi.h: BI_BITFIELDS with an alpha mask (Windows CE)
+  static const uint32_t BI_ALPHABITFIELDS = 6;
+  
+  Format_BMP() {}
+  ~Format_BMP() {}
+  
+  uint16_t GetBPP() const
+  {
+    return bpp;
+  }
+  
+  uint32_t GetCompression() const { return compression; }
+  uint32_t GetPixelOffset() const { return pixels; }
+  bool IsTopDown() const { return top_down; }
+  const uint32_t *GetMasks() const { return masks; }
+  const std::vector<uint32_t> &GetPalette() const { return palette; }
+  
+  // Bytes per stored row of an uncompressed bitmap, rows are padded to 4 bytes
+  uint64_t GetStride() const
+  {
+    return (this->width * this->bpp + 31) / 32 * 4;
+  }
+  
+  void Reset()
+  {
+    Format_Image::Reset();
+    this->bpp = 0;
+    this->compression = BI_RGB;
+    this->pixels = 0;
+    this->top_down = false;
+    std::fill(std::begin(this->masks), std::end(this->masks), 0);
+    this->palette.clear();
+  }
+  
+protected:
+  bool ParseObject(const uint8_t *data, size_t length)
+  {
+    TRACE_SCOPE("Format_BMP::Parse");
+    
+    ByteReader reader(data, length);
+    
+    // Header structure (14 bytes, 2 for magic, 4 for file size, 4 reserved, 4 for buffer offset)
+    if (reader.Read<uint8_t>() != 'B' || reader.Read<uint8_t>() != 'M')
+      return false;
+    
+    uint32_t file_size = reader.Read<uint32_t>();
+    reader.Skip(4);
+    this->pixels = reader.Read<uint32_t>();
+    
+    // Info header structure, BITMAPCOREHEADER (12 bytes) has 16-bit dimensions, all later versions 32-bit ones
+    uint32_t header_size = reader.Read<uint32_t>();
+    int64_t width, height;
+    if (header_size == 12) {
+      width = reader.Read<uint16_t>();
+      height = reader.Read<int16_t>();
+    } else {
+      width = reader.Read<int32_t>();
+      height = reader.Read<int32_t>();
+    }
+    
+    this->planes = reader.Read<uint16_t>();
+    this->bpp = reader.Read<uint16_t>();
+    
+    uint32_t colors = 0;
+    if (header_size >= 40) {
+      this->compression = reader.Read<uint32_t>();
+      reader.Skip(4 * 3); // SizeImage, XPelsPerMeter, YPelsPerMeter
+      colors = reader.Read<uint32_t>();
+    }
+    
+    // There is no checksum, so the fields have to make sense
+    static const uint32_t header_sizes[] = { 12, 40, 52, 56, 64, 108, 124 };
+    static const uint16_t depths[] = { 1, 2, 4, 8, 16, 24, 32 };
+    
+    bool bitfields = this->compression == BI_BITFIELDS || this->compression == BI_ALPHABITFIELDS;
+    
+    if (reader.Failed() || std::find(std::begin(header_sizes), std::end(header_sizes), header_size) == std::end(header_sizes) ||
+        std::find(std::begin(depths), std::end(depths), this->bpp) == std::end(depths) || this->planes != 1 ||
+        width <= 0 || width > 65536 || height == 0 || height < -65536 || height > 65536 || this->pixels < 14 + header_size ||
+        this->compression > BI_ALPHABITFIELDS || (this->compression == BI_RLE8 && this->bpp != 8) ||
+        (this->compression == BI_RLE4 && this->bpp != 4) || (bitfields && this->bpp != 16 && this->bpp != 32))
+      return false;
+    
+    // Negative heights are top-down bitmaps
+    this->width = (uint64_t) width;
+    this->height = (uint64_t) (height < 0 ? -height : height);
+    this->top_down = height < 0;
+    
+    // Color masks follow the 40-byte header (or are part of the later ones). Without them 16 bits are 5-5-5 and 32
+    // bits are 8-8-8 with an unused byte.
+    size_t palette_offset = 14 + header_size;
+    if (bitfields) {
+      reader.Seek(14 + 40);
+      for (int i = 0; i < 3; ++i)
+        this->masks[i] = reader.Read<uint32_t>();
+      
+      if (this->compression == BI_ALPHABITFIELDS || header_size >= 56)
+        this->masks[3] = reader.Read<uint32_t>();
+      
+      if (header_size == 40)
+        palette_offset += this->compression == BI_ALPHABITFIELDS ? 16 : 12;
+      
+      if (reader.Failed() || this->masks[0] == 0 || this->masks[1] == 0 || this->masks[2] == 0)
+        return false;
+    } else if (this->bpp == 16) {
+      this->masks[0] = 0x7c00;
+      this->masks[1] = 0x03e0;
+      this->masks[2] = 0x001f;
+    } else if (this->bpp == 32) {
+      this->masks[0] = 0x00ff0000;
+      this->masks[1] = 0x0000ff00;
+      this->masks[2] = 0x000000ff;
+    }
+    
+    // The palette (BGR, plus a reserved byte unless the header is the old 12-byte one), up to the pixel data
+    if (this->bpp <= 8) {
+      size_t entry = header_size == 12 ? 3 : 4;
+      size_t count = colors != 0 && colors < (1u << this->bpp) ? colors : (1u << this->bpp);
+      count = std::min(count, (this->pixels - std::min<size_t>(this->pixels, palette_offset)) / entry);
+      
+      reader.Seek(palette_offset);
+      for (size_t i = 0; i < count && !reader.Failed(); ++i) {
+        uint8_t b = reader.Read<uint8_t>(), g = reader.Read<uint8_t>(), r = reader.Read<uint8_t>();
+        if (entry == 4)
+          reader.Skip(1);
+        
+        this->palette.push_back(r | (g << 8) | (b << 16) | 0xff000000u);
+      }
+      
+      if (reader.Failed())
+        return false;
+    }
+    
+    // Writers don't all fill in the file size, it's known from the dimensions for uncompressed bitmaps
+    this->size = file_size >= this->pixels ? file_size : this->pixels + GetStride() * this->height;
+    this->ready = true;
+    return true;
+  }
+};
+
+class Format_PE : public Format_Binary_Image {
+  std::vector<const char *> properties;
+  uint8_t version[2] = {0, 0};
+  uint16_t version_OS[2] = {0, 0};
+  uint16_t version_image[2] = {0, 0};
+  uint64_t size_stack = 0;
+  uint32_t checksum = 0;
+  uint16_t sections = 0;
+public:
+  Format_PE() {}
+  ~Format_PE() {}
+  
+  std::vector<const char *> GetProperties() const { return properties; }
+  
+  uint8_t GetMajorLinkerVersion() const { return version[0]; }
+  uint8_t GetMinorLinkerVersion() const { return version[1]; }
+  uint16_t GetMajorOSVersion() const { return version_OS[0]; }
+  uint16_t GetMinorOSVersion() const { return version_OS[1]; }
+  uint16_t GetMajorImageVersion() const { return version_image[0]; }
+  uint16_t GetMinorImageVersion() const { return version_image[1]; }
+  uint64_t GetStackSize() const { return size_stack; }
+  uint32_t GetChecksum() const { return checksum; }
+  uint16_t GetSectionCount() const { return sections; }
+  
+  bool Is64Bit() const
+  {
+    return (std::find(properties.begin(), properties.end(), "IMAGE_FILE_MACHINE_AMD64") != properties.end()) && (this->architecture == 0x20b);
+  }
+  
+  void Reset()
+  {
+    Format_Binary_Image::Reset();
+    this->properties.clear();
+    std::fill(std::begin(this->version), std::end(this->version), 0);
+    std::fill(std::begin(this->version_OS), std::end(this->version_OS), 0);
+    std::fill(std::begin(this->version_image), std::end(this->version_image), 0);
+    this->size_stack = 0;
+    this->checksum = 0;
+    this->sections = 0;
+  }
+  
+protected:
+  bool ParseObject(const uint8_t *data, size_t length)
+  {
+    TRACE_SCOPE("Format_PE::Parse");
+    
+    ByteReader reader(data, length);
+    
+    // DOS stub, which starts with "MZ" and has the offset of the PE header at 0x3c
+    if (reader.Read<uint16_t>() != 0x5a4d)
+      return false;
+    
+    reader.Seek(0x3c);
+    reader.Seek(reader.Read<uint32_t>());
+    
+    if (reader.Read<uint32_t>() != 0x00004550) // "PE\0\0"
+      return false;
+    
+    // Begin of _IMAGE_FILE_HEADER
+    // Read Machine
+    uint16_t type = reader.Read<uint16_t>();
+    
+    // Read NumberOfSections
+    this->sections = reader.Read<uint16_t>();
+    
+    // Skip over TimeDateStamp + PointerToSymbolTable + NumberOfSymbols (4 bytes each)
+    reader.Skip(12);
+    
+    // Read SizeOfOptionalHeader and Characteristics
+    uint16_t opt_head_size = reader.Read<uint16_t>();
+    uint16_t properties = reader.Read<uint16_t>();
+    
+    // Optional Header Standard Fields (Image Only)
+    size_t optional_header = reader.Tell();
+    this->architecture = reader.Read<uint16_t>();
+    
+    if (reader.Failed() || (this->architecture != 0x10b && this->architecture != 0x20b) || this->sections == 0 || this->sections > 96)
+      return false;
+    
+    this->version[0] = reader.Read<uint8_t>();
+    this->version[1] = reader.Read<uint8_t>();
+    
+    reader.Skip(
+      4 + /*SizeOfCode */
+      4 + /*SizeOfInitializedData */
+      4 + /*SizeOfUninitializedData*/
+      4 + /*AddressOfEntryPoint */
+      4 /*BaseOfCode*/
+    );
+    
+    if (this->architecture == 0x10b) {
+      reader.Skip(4); /* BaseOfData*/
+    }
+    
+    size_t step = (this->architecture == 0x10b) ? 4 : 8;
+    
+    reader.Skip(
+      step + /* ImageBase */
+      (4 * 2) /* SectionAlignment + FileAlignment */
+    );
+    
+    this->version_OS[0] = reader.Read<uint16_t>();
+    this->version_OS[1] = reader.Read<uint16_t>();
+    
+    this->version_image[0] = reader.Read<uint16_t>();
+    this->version_image[1] = reader.Read<uint16_t>();
+    
+    reader.Skip(
+      (2 * 2) + /* MajorSubsystemVersion +MinorSubsystemVersion*/
+      (4 * 2) /* Win32VersionValue +SizeOfImage */
+    );
+    
+    uint32_t size_headers = reader.Read<uint32_t>();
+    this->checksum = reader.Read<uint32_t>();
+    uint16_t subsystem = reader.Read<uint16_t>();
+    
+    uint16_t dll_characteristics = reader.Read<uint16_t>();
+    
+    this->size_stack = step == 4 ? reader.Read<uint32_t>() : reader.Read<uint64_t>();
+    
+    // SizeOfStackCommit, SizeOfHeapReserve, SizeOfHeapCommit, LoaderFlags, then the data directories. The fifth one
+    // (the certificate table) is the only one given as a file offset, signatures are appended after the sections.
+    reader.Skip(3 * step + 4);
+    uint32_t directories = reader.Read<uint32_t>();
+    uint64_t certificates_end = 0;
+    if (directories > 4) {
+      reader.Skip(4 * 8);
+      uint32_t offset = reader.Read<uint32_t>();
+      certificates_end = offset != 0 ? (uint64_t) offset + reader.Read<uint32_t>() : 0;
+    }
+    
+    // The file ends with the section whose raw data lies furthest in, or with the certificates
+    uint64_t end = std::max<uint64_t>(size_headers, certificates_end);
+    reader.Seek(optional_header + opt_head_size);
+    for (uint16_t i = 0; i < this->sections; ++i) {
+      reader.Skip(16); // Name, VirtualSize, VirtualAddress
+      uint32_t raw_size = reader.Read<uint32_t>();
+      uint32_t raw_offset = reader.Read<uint32_t>();
+      reader.Skip(16);
+      
+      if (raw_size != 0)
+        end = std::max<uint64_t>(end, (uint64_t) raw_offset + raw_size);
+    }
+    
+    if (reader.Failed())
+      return false;
+    
+    auto machine = ImageFileHeader_Machine().find(type);
+    if (machine != ImageFileHeader_Machine().end())
+      this->properties.push_back(machine->second);
+    
+    for (const auto &c : ImageFileHeader_Characteristics()) {
+      if (properties & c.first)
+        this->properties.push_back(c.second);
+    }
+    
+    for (const auto &c : ImageOptionalHeader_DllCharacteristics()) {
+      if (dll_characteristics & c.first)
+        this->properties.push_back(c.second);
+    }
+    
+    switch (subsystem) {
+      case IMAGE_SUBSYSTEM_NATIVE: this->properties.push_back("IMAGE_SUBSYSTEM_NATIVE"); break;
+      case IMAGE_SUBSYSTEM_WINDOWS_GUI: this->properties.push_back("IMAGE_SUBSYSTEM_WINDOWS_GUI"); break;
+      case IMAGE_SUBSYSTEM_WINDOWS_CUI: this->properties.push_back("IMAGE_SUBSYSTEM_WINDOWS_CUI"); break;
+      case IMAGE_SUBSYSTEM_OS2_CUI: this->properties.push_back("IMAGE_SUBSYSTEM_OS2_CUI"); break;
+      case IMAGE_SUBSYSTEM_POSIX_CUI: this->properties.push_back("IMAGE_SUBSYSTEM_POSIX_CUI"); break;
+      case IMAGE_SUBSYSTEM_WINDOWS_CE_GUI: this->properties.push_back("IMAGE_SUBSYSTEM_WINDOWS_CE_GUI"); break;
+      case IMAGE_SUBSYSTEM_EFI_APPLICATION: this->properties.push_back("IMAGE_SUBSYSTEM_EFI_APPLICATION"); break;
+    }
+    
+    this->size = end;
+    this->ready = true;
+    return true;
+  }
+};
+
+class Format_ZIP : public Format_Archiver {
+protected:
+  uint16_t version = 0;
+  uint16_t flags = 0;
+  uint16_t compression = 0;
+  uint32_t crc32 = 0;
+  uint32_t compressed_size = 0;
+  uint32_t uncompressed_size = 0;
+  uint64_t entries = 0;
+  
+  // End of central directory record at `at`: it names the offset (relative to the archive's start) and size of the
+  // central directory, which has to end right where the record (or its ZIP64 counterpart) starts. Records not
+  // pointing back like that belong to some archive stored inside this one. Returns the archive's size, 0 if the
+  // record doesn't fit.
+  uint64_t CheckEndOfCentralDirectory(const uint8_t *data, size_t length, size_t at)
+  {
+    ByteReader record(data, length);
+    record.Seek(at + 4);
+    record.Skip(2 * 3); // This disk, central directory disk, entries on this disk
+    uint64_t count = record.Read<uint16_t>();
+    uint64_t directory_size = record.Read<uint32_t>();
+    uint64_t directory_offset = record.Read<uint32_t>();
+    uint64_t end = at + 22 + record.Read<uint16_t>();
+    uint64_t directory_end = at;
+    
+    // ZIP64: the fields that didn't fit are in the ZIP64 record, which the locator right before this one points to
+    if (directory_offset == 0xffffffff || directory_size == 0xffffffff || count == 0xffff) {
+      ByteReader locator(data, length);
+      locator.Seek(at >= 20 ? at - 20 : length + 1);
+      if (locator.Read<uint32_t>() != 0x07064b50)
+        return 0;
+      
+      locator.Skip(4);
+      directory_end = locator.Read<uint64_t>();
+      
+      ByteReader record64(data, length);
+      record64.Seek(locator.Failed() || directory_end > length ? length + 1 : (size_t) directory_end);
+      if (record64.Read<uint32_t>() != 0x06064b50)
+        return 0;
+      
+      record64.Skip(8 + 2 * 2 + 4 * 2 + 8);
+      count = record64.Read<uint64_t>();
+      directory_size = record64.Read<uint64_t>();
+      directory_offset = record64.Read<uint64_t>();
+      if (record64.Failed())
+        return 0;
+    }
+    
+    // Hostile ZIP64 values could wrap the sum around
+    if (record.Failed() || end > length || directory_size > directory_end || directory_offset != directory_end - directory_size)
+      return 0;
+    
+    this->entries = count;
+    return end;
+  }
+  
+public:
+  Format_ZIP() {}
+  ~Format_ZIP() {}
+  
+  uint32_t GetCRC32() const { return crc32; }
+  uint16_t GetVersion() const { return version; }
+  uint32_t GetCompressedSize() const { return compressed_size; }
+  uint32_t GetUncompressedSize() const { return uncompressed_size; }
+  uint64_t GetEntryCount() const { return entries; }
+  
+  void Reset()
+  {
+    Format_Archiver::Reset();
+    this->version = 0;
+    this->flags = 0;
+    this->compression = 0;
+    this->crc32 = 0;
+    this->compressed_size = 0;
+    this->uncompressed_size = 0;
+    this->entries = 0;
+  }
+  
+protected:
+  bool ParseObject(const uint8_t *data, size_t length)
+  {
+    TRACE_SCOPE("Format_ZIP::Parse");
+    
+    ByteReader reader(data, length);
+    
+    // The first local file header
+    if (reader.Read<uint32_t>() != 0x04034b50)
+      return false;
+    
+    this->version = reader.Read<uint16_t>();
+    this->flags = reader.Read<uint16_t>();
+    this->compression = reader.Read<uint16_t>();
+    
+    reader.Skip(4);
+    
+    this->crc32 = reader.Read<uint32_t>();
+    this->compressed_size = reader.Read<uint32_t>();
+    this->uncompressed_size = reader.Read<uint32_t>();
+    
+    if (reader.Failed())
+      return false;
+    
+    // Sizes are often only known after the data (in a data descriptor), so the archive's end is found through its
+    // end of central directory record rather than by walking the entries
+    for (size_t at = reader.Find("PK\5\6", 4, 30); at < length; at = reader.Find("PK\5\6", 4, at + 4)) {
+      auto end = CheckEndOfCentralDirectory(data, length, at);
+      
+      if (end != 0) {
+        this->size = end;
+        this->ready = true;
+        return true;
+      }
+    }
+    
+    return false;
+  }
+};
+
+// A format parsed by a plugin DLL (see format_plugin.hpp)
+class Format_Plugin : public Format {
+  const ShellFormatPlugin *plugin;
+  std::vector<std::pair<std::string, std::string>> properties;
+  
+  static void AddProperty(void *context, const char *name, const char *value)
+  {
+    auto format = (Format_Plugin *) context;
+    format->properties.emplace_back(name != nullptr ? name : "", value != nullptr ? value : "");
+  }
+  
+public:
+  explicit Format_Plugin(const ShellFormatPlugin *plugin) : plugin(plugin) {}
+  ~Format_Plugin() {}
+  
+  const char *GetName() const
+  {
+    return plugin->name != nullptr ? plugin->name : "Plugin";
+  }
+  
+  const std::vector<std::pair<std::string, std::string>> &GetProperties() const
+  {
+    return properties;
+  }
+  
+  void Reset()
+  {
+    Format::Reset();
+    this->properties.clear();
+  }
+  
+protected:
+  bool ParseObject(const uint8_t *data, size_t length)
+  {
+    TRACE_SCOPE("Format_Plugin::Parse");
+    
+    uint64_t size = length;
+    
+    if (!plugin->Parse(data, length, this->complete, &size, AddProperty, this))
+      return false;
+    
+    this->size = size;
+    this->ready = true;
+    return true;
+  }
+};
+
+#endif
@@ -0,0 +1,35 @@
+// Runs a fuzz target once over each file named on the command line, for compilers without libFuzzer. The corpus then
+// works as a regression test, checked by the sanitizers and the targets' own FUZZ_CHECKs.
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int main(int argc, char **argv)
+{
+  for (int i = 1; i < argc; ++i) {
+    FILE *file = fopen(argv[i], "rb");
+    if (file == nullptr) {
+      fprintf(stderr, "%s: can't open\n", argv[i]);
+      return 1;
+    }
+
+    std::vector<uint8_t> content;
+    uint8_t buffer[65536];
+    for (size_t n; (n = fread(buffer, 1, sizeof(buffer), file)) > 0; )
+      content.insert(content.end(), buffer, buffer + n);
+    fclose(file);
+
+    // Exactly as large as the input, so AddressSanitizer catches a read past its end
+    std::unique_ptr<uint8_t[]> data(new uint8_t[content.size()]);
+    std::copy(content.begin(), content.end(), data.get());
+
+    fprintf(stderr, "%s\n", argv[i]);
+    LLVMFuzzerTestOneInput(data.get(), content.size());
+  }
+
+  return 0;
+}
@@ -0,0 +1,26 @@
+// Fuzz target for Format_BMP
+
+#include "shim.hpp"
+#include "../formats.hpp"
+
+static bool Same(const Format_BMP &a, const Format_BMP &b)
+{
+  return a.IsReady() == b.IsReady() && a.GetSize() == b.GetSize() && a.GetWidth() == b.GetWidth() &&
+    a.GetHeight() == b.GetHeight() && a.GetPlaneCount() == b.GetPlaneCount() && a.GetBPP() == b.GetBPP() &&
+    a.GetCompression() == b.GetCompression() && a.GetPixelOffset() == b.GetPixelOffset() &&
+    a.IsTopDown() == b.IsTopDown() && std::equal(a.GetMasks(), a.GetMasks() + 4, b.GetMasks()) &&
+    a.GetPalette() == b.GetPalette();
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  Format_BMP fresh, reused;
+  fresh.Parse(data, size);
+  
+  // A reused object has to report the same as a fresh one, whatever it parsed before
+  reused.Parse(data, size / 2);
+  reused.Parse(data, size);
+  FUZZ_CHECK(Same(fresh, reused));
+  
+  return 0;
+}
@@ -0,0 +1,29 @@
+// Fuzz target for Format_PDF, the cross-reference reader and the deflate decoder behind it
+
+#include "shim.hpp"
+#include "../formats.hpp"
+
+static bool Same(const Format_PDF &a, const Format_PDF &b)
+{
+  return a.IsReady() == b.IsReady() && a.GetSize() == b.GetSize() && a.GetVersion() == b.GetVersion() &&
+    a.HasCrossReference() == b.HasCrossReference() && a.GetObjectCount() == b.GetObjectCount() &&
+    a.GetPageCount() == b.GetPageCount() && a.IsEncrypted() == b.IsEncrypted() && a.GetInfo() == b.GetInfo();
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  Format_PDF fresh, reused;
+  fresh.Parse(data, size);
+  
+  // A reused object has to report the same as a fresh one, whatever it parsed before
+  reused.Parse(data, size / 2);
+  reused.Parse(data, size);
+  FUZZ_CHECK(Same(fresh, reused));
+  
+  // Taken as a whole document, the way `carve` checks a candidate: the header is the same, wherever the data ends
+  Format_PDF whole;
+  whole.ParseWhole(data, size);
+  FUZZ_CHECK(!whole.IsReady() || !fresh.IsReady() || whole.GetVersion() == fresh.GetVersion());
+  
+  return 0;
+}
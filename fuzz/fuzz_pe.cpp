@@ -0,0 +1,27 @@
+// Fuzz target for Format_PE
+
+#include "shim.hpp"
+#include "../formats.hpp"
+
+static bool Same(const Format_PE &a, const Format_PE &b)
+{
+  return a.IsReady() == b.IsReady() && a.GetSize() == b.GetSize() && a.GetProperties() == b.GetProperties() &&
+    a.GetMajorLinkerVersion() == b.GetMajorLinkerVersion() && a.GetMinorLinkerVersion() == b.GetMinorLinkerVersion() &&
+    a.GetMajorOSVersion() == b.GetMajorOSVersion() && a.GetMinorOSVersion() == b.GetMinorOSVersion() &&
+    a.GetMajorImageVersion() == b.GetMajorImageVersion() && a.GetMinorImageVersion() == b.GetMinorImageVersion() &&
+    a.GetStackSize() == b.GetStackSize() && a.GetChecksum() == b.GetChecksum() &&
+    a.GetSectionCount() == b.GetSectionCount() && a.Is64Bit() == b.Is64Bit();
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  Format_PE fresh, reused;
+  fresh.Parse(data, size);
+  
+  // A reused object has to report the same as a fresh one, whatever it parsed before
+  reused.Parse(data, size / 2);
+  reused.Parse(data, size);
+  FUZZ_CHECK(Same(fresh, reused));
+  
+  return 0;
+}
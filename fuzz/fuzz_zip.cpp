@@ -0,0 +1,32 @@
+// Fuzz target for Format_ZIP
+
+#include "shim.hpp"
+#include "../formats.hpp"
+
+static bool Same(const Format_ZIP &a, const Format_ZIP &b)
+{
+  return a.IsReady() == b.IsReady() && a.GetSize() == b.GetSize() && a.GetCRC32() == b.GetCRC32() &&
+    a.GetVersion() == b.GetVersion() && a.GetCompressedSize() == b.GetCompressedSize() &&
+    a.GetUncompressedSize() == b.GetUncompressedSize() && a.GetEntryCount() == b.GetEntryCount();
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  Format_ZIP fresh, reused;
+  fresh.Parse(data, size);
+  
+  // A reused object has to report the same as a fresh one, whatever it parsed before
+  reused.Parse(data, size / 2);
+  reused.Parse(data, size);
+  FUZZ_CHECK(Same(fresh, reused));
+  
+  // The archive ends at its end of central directory record, which has to be in the input
+  FUZZ_CHECK(!fresh.IsReady() || fresh.GetSize() <= size);
+  
+  // Taken as a whole archive, the way `carve` checks a candidate, it reads the same
+  Format_ZIP whole;
+  whole.ParseWhole(data, size);
+  FUZZ_CHECK(Same(fresh, whole));
+  
+  return 0;
+}
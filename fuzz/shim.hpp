@@ -0,0 +1,87 @@
+// What formats.hpp takes from Shell.cpp and <windows.h>, for building the parsers on other systems. The file mapping
+// calls behind Format::ParseFile() always fail here; the fuzz targets only hand over spans.
+
+#ifndef SHELL_FUZZ_SHIM_HPP
+#define SHELL_FUZZ_SHIM_HPP
+
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#define TRACE_SCOPE(name)
+
+using VectorString = std::vector<std::string>;
+
+typedef void *HANDLE;
+typedef union { int64_t QuadPart; } LARGE_INTEGER;
+
+#define INVALID_HANDLE_VALUE ((HANDLE) (intptr_t) -1)
+enum { GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, PAGE_READONLY, FILE_MAP_READ };
+
+inline HANDLE CreateFileA(const char *, int, int, void *, int, int, HANDLE) { return INVALID_HANDLE_VALUE; }
+inline bool GetFileSizeEx(HANDLE, LARGE_INTEGER *) { return false; }
+inline HANDLE CreateFileMappingA(HANDLE, void *, int, int, int, const char *) { return nullptr; }
+inline void *MapViewOfFile(HANDLE, int, int, int, size_t) { return nullptr; }
+inline bool UnmapViewOfFile(const void *) { return true; }
+inline bool CloseHandle(HANDLE) { return true; }
+
+// wingdi.h
+enum { BI_RGB = 0, BI_RLE8 = 1, BI_RLE4 = 2, BI_BITFIELDS = 3, BI_JPEG = 4, BI_PNG = 5 };
+
+// winnt.h
+enum : uint16_t {
+  IMAGE_FILE_RELOCS_STRIPPED = 0x0001,
+  IMAGE_FILE_EXECUTABLE_IMAGE = 0x0002,
+  IMAGE_FILE_LINE_NUMS_STRIPPED = 0x0004,
+  IMAGE_FILE_LOCAL_SYMS_STRIPPED = 0x0008,
+  IMAGE_FILE_LARGE_ADDRESS_AWARE = 0x0020,
+  IMAGE_FILE_32BIT_MACHINE = 0x0100,
+  IMAGE_FILE_DEBUG_STRIPPED = 0x0200,
+  IMAGE_FILE_REMOVABLE_RUN_FROM_SWAP = 0x0400,
+  IMAGE_FILE_NET_RUN_FROM_SWAP = 0x0800,
+  IMAGE_FILE_SYSTEM = 0x1000,
+  IMAGE_FILE_DLL = 0x2000,
+  IMAGE_FILE_UP_SYSTEM_ONLY = 0x4000,
+
+  IMAGE_FILE_MACHINE_I386 = 0x014c,
+  IMAGE_FILE_MACHINE_IA64 = 0x0200,
+  IMAGE_FILE_MACHINE_AMD64 = 0x8664,
+
+  IMAGE_SUBSYSTEM_NATIVE = 1,
+  IMAGE_SUBSYSTEM_WINDOWS_GUI = 2,
+  IMAGE_SUBSYSTEM_WINDOWS_CUI = 3,
+  IMAGE_SUBSYSTEM_OS2_CUI = 5,
+  IMAGE_SUBSYSTEM_POSIX_CUI = 7,
+  IMAGE_SUBSYSTEM_WINDOWS_CE_GUI = 9,
+  IMAGE_SUBSYSTEM_EFI_APPLICATION = 10,
+
+  IMAGE_DLLCHARACTERISTICS_HIGH_ENTROPY_VA = 0x0020,
+  IMAGE_DLLCHARACTERISTICS_DYNAMIC_BASE = 0x0040,
+  IMAGE_DLLCHARACTERISTICS_FORCE_INTEGRITY = 0x0080,
+  IMAGE_DLLCHARACTERISTICS_NX_COMPAT = 0x0100,
+  IMAGE_DLLCHARACTERISTICS_NO_ISOLATION = 0x0200,
+  IMAGE_DLLCHARACTERISTICS_NO_SEH = 0x0400,
+  IMAGE_DLLCHARACTERISTICS_NO_BIND = 0x0800,
+  IMAGE_DLLCHARACTERISTICS_APPCONTAINER = 0x1000,
+  IMAGE_DLLCHARACTERISTICS_WDM_DRIVER = 0x2000,
+  IMAGE_DLLCHARACTERISTICS_GUARD_CF = 0x4000,
+  IMAGE_DLLCHARACTERISTICS_TERMINAL_SERVER_AWARE = 0x8000,
+};
+
+// A broken invariant in a fuzz target, reported like a sanitizer finding
+#define FUZZ_CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+      abort(); \
+    } \
+  } while (0)
+
+#endif